@@ -0,0 +1,542 @@
+/*
+ * brlock.c
+ *
+ * This file implements the "big reader lock" synchronization
+ * construct, a read-write lock whose readers don't write to any
+ * memory shared with readers running elsewhere.
+ *
+ * Each thread that read-locks a brlock_t is given a slot number
+ * (the same for every brlock_t), kept in thread-specific data, and
+ * counts itself in that slot's reader count. A writer sets the
+ * BRL_WRITER bit in the lock's state word (which only one writer
+ * at a time can do) and then waits until every slot's count is
+ * zero. A reader adds itself to its count, and then checks the
+ * BRL_WRITER bit; if it's set, the reader removes itself again,
+ * and waits on the "read" condition variable until the writer is
+ * finished. Since readers stay out whenever a writer wants the
+ * lock, a stream of readers can't keep a writer waiting forever.
+ *
+ * Both sides write their own variable first and then read the
+ * other's, with sequentially consistent atomic operations, so
+ * either the writer sees the reader's count or the reader sees the
+ * writer bit. A reader that leaves while the writer bit is set
+ * must assume the writer is waiting for it: the one that brings a
+ * count to zero locks the mutex and signals the "drain" condition
+ * variable. (The writer locks the mutex before it looks at the
+ * counts for the last time, and holds it until it waits, so the
+ * signal can't be lost.) When no reader is in the way, then, a
+ * writer locks and unlocks without the mutex, too.
+ *
+ * Threads that wait for the writer bit to clear set the
+ * BRL_WAITING bit, as in rwlock.c, so that the writer knows it
+ * must lock the mutex to wake them when it unlocks.
+ *
+ * A thread must unlock a read lock in the same thread that locked
+ * it, since it's the thread's slot that counts it; and it mustn't
+ * read-lock a brlock_t it already holds for read, since a writer
+ * that arrives between the two would wait for the first read lock
+ * while the second waits for the writer.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include "errors.h"
+#include "brlock.h"
+
+#define BRL_WRITER      0x1             /* a writer holds the lock */
+#define BRL_WAITING     0x2             /* threads are waiting */
+
+static pthread_once_t brl_once = PTHREAD_ONCE_INIT;
+static pthread_key_t brl_key;           /* thread's slot number + 1 */
+static int brl_key_status;              /* error creating brl_key */
+static atomic_uint brl_next;            /* next slot number to give */
+
+/*
+ * One-time initialization routine that creates the key for the
+ * slot numbers.
+ */
+static void brl_key_init (void)
+{
+    brl_key_status = pthread_key_create (&brl_key, NULL);
+}
+
+/*
+ * Find the calling thread's reader count, giving the thread a slot
+ * number if it doesn't already have one. Slot numbers are handed out
+ * in turn, so that the first BRL_SLOTS threads each get their own.
+ */
+static int brl_slot (brlock_t *brl, brlock_slot_t **slot)
+{
+    uintptr_t index;
+    void *value;
+    int status;
+
+    status = pthread_once (&brl_once, brl_key_init);
+    if (status != 0)
+        return status;
+    if (brl_key_status != 0)
+        return brl_key_status;
+    value = pthread_getspecific (brl_key);
+    if (value != NULL)
+        index = (uintptr_t)value - 1;
+    else {
+        index = atomic_fetch_add (&brl_next, 1) % BRL_SLOTS;
+        status = pthread_setspecific (brl_key, (void*)(index + 1));
+        if (status != 0)
+            return status;
+    }
+    *slot = &brl->slot[index];
+    return 0;
+}
+
+/*
+ * Return nonzero if any thread is counted as a reader.
+ */
+static int brl_readers (brlock_t *brl)
+{
+    int index;
+
+    for (index = 0; index < BRL_SLOTS; index++)
+        if (atomic_load (&brl->slot[index].readers) != 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Remove a reader from its count, and return nonzero if it was
+ * the last one in the slot and a writer has set its bit (so that
+ * the writer may be waiting for this count).
+ */
+static int brl_remove (brlock_t *brl, brlock_slot_t *slot)
+{
+    return (atomic_fetch_sub (&slot->readers, 1) == 1
+        && (atomic_load (&brl->state) & BRL_WRITER));
+}
+
+/*
+ * Remove a reader from its count, and wake the writer if it may be
+ * waiting for it.
+ */
+static int brl_leave (brlock_t *brl, brlock_slot_t *slot)
+{
+    int status, status2;
+
+    if (!brl_remove (brl, slot))
+        return 0;
+    status = pthread_mutex_lock (&brl->mutex);
+    if (status != 0)
+        return status;
+    status = pthread_cond_signal (&brl->drain);
+    status2 = pthread_mutex_unlock (&brl->mutex);
+    return (status == 0 ? status2 : status);
+}
+
+/*
+ * Count a thread as waiting (r_wait or w_wait has just been
+ * incremented), or as no longer waiting (decremented). Called with
+ * the mutex locked.
+ */
+static void brl_waiting (brlock_t *brl)
+{
+    atomic_fetch_or (&brl->state, BRL_WAITING);
+}
+
+static void brl_waited (brlock_t *brl)
+{
+    if (brl->r_wait == 0 && brl->w_wait == 0)
+        atomic_fetch_and (&brl->state, ~BRL_WAITING);
+}
+
+/*
+ * Clear the writer bit, and wake the threads waiting for it.
+ * Called with the mutex locked.
+ */
+static int brl_release (brlock_t *brl)
+{
+    int status;
+
+    atomic_fetch_and (&brl->state, ~BRL_WRITER);
+    if (brl->r_wait > 0) {
+        status = pthread_cond_broadcast (&brl->read);
+        if (status != 0)
+            return status;
+    }
+    if (brl->w_wait > 0) {
+        status = pthread_cond_signal (&brl->write);
+        if (status != 0)
+            return status;
+    }
+    return 0;
+}
+
+/*
+ * Clear the writer bit, locking the mutex to wake waiters only
+ * if there are any.
+ */
+static int brl_unlock (brlock_t *brl)
+{
+    unsigned int state = BRL_WRITER;
+    int status, status2;
+
+    if (atomic_compare_exchange_strong (&brl->state, &state, 0))
+        return 0;
+    status = pthread_mutex_lock (&brl->mutex);
+    if (status != 0)
+        return status;
+    status = brl_release (brl);
+    status2 = pthread_mutex_unlock (&brl->mutex);
+    return (status2 != 0 ? status2 : status);
+}
+
+/*
+ * Initialize a big reader lock
+ */
+int brl_init (brlock_t *brl)
+{
+    int index, status;
+
+    for (index = 0; index < BRL_SLOTS; index++)
+        atomic_init (&brl->slot[index].readers, 0);
+    atomic_init (&brl->state, 0);
+    brl->r_wait = brl->w_wait = 0;
+    status = pthread_mutex_init (&brl->mutex, NULL);
+    if (status != 0)
+        return status;
+    status = pthread_cond_init (&brl->read, NULL);
+    if (status != 0) {
+        /* if unable to create read CV, destroy mutex */
+        pthread_mutex_destroy (&brl->mutex);
+        return status;
+    }
+    status = pthread_cond_init (&brl->write, NULL);
+    if (status != 0) {
+        /* if unable to create write CV, destroy read CV and mutex */
+        pthread_cond_destroy (&brl->read);
+        pthread_mutex_destroy (&brl->mutex);
+        return status;
+    }
+    status = pthread_cond_init (&brl->drain, NULL);
+    if (status != 0) {
+        /* if unable to create drain CV, destroy the others */
+        pthread_cond_destroy (&brl->write);
+        pthread_cond_destroy (&brl->read);
+        pthread_mutex_destroy (&brl->mutex);
+        return status;
+    }
+    brl->valid = BRLOCK_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a big reader lock
+ */
+int brl_destroy (brlock_t *brl)
+{
+    int status, status1, status2, status3;
+
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&brl->mutex);
+    if (status != 0)
+        return status;
+
+    /*
+     * Check whether any threads own the lock, or are known to be
+     * waiting; report "BUSY" if so.
+     */
+    if (atomic_load (&brl->state) != 0 || brl_readers (brl)
+            || brl->r_wait != 0 || brl->w_wait != 0) {
+        pthread_mutex_unlock (&brl->mutex);
+        return EBUSY;
+    }
+
+    brl->valid = 0;
+    status = pthread_mutex_unlock (&brl->mutex);
+    if (status != 0)
+        return status;
+    status = pthread_mutex_destroy (&brl->mutex);
+    status1 = pthread_cond_destroy (&brl->read);
+    status2 = pthread_cond_destroy (&brl->write);
+    status3 = pthread_cond_destroy (&brl->drain);
+    return (status != 0 ? status
+        : (status1 != 0 ? status1 : (status2 != 0 ? status2 : status3)));
+}
+
+/*
+ * Handle cleanup when the read lock condition variable
+ * wait is cancelled.
+ *
+ * Simply record that the thread is no longer waiting,
+ * and unlock the mutex.
+ */
+static void brl_readcleanup (void *arg)
+{
+    brlock_t *brl = (brlock_t *)arg;
+
+    brl->r_wait--;
+    brl_waited (brl);
+    pthread_mutex_unlock (&brl->mutex);
+}
+
+/*
+ * Wait for a writer to finish, and then count the thread as a
+ * reader. (This is kept out of brl_readlock, so that the fast path
+ * doesn't pay to set up the cleanup handler.)
+ */
+static int brl_readwait (brlock_t *brl, brlock_slot_t *slot)
+{
+    int status;
+
+    status = pthread_mutex_lock (&brl->mutex);
+    if (status != 0)
+        return status;
+    brl->r_wait++;
+    brl_waiting (brl);
+    pthread_cleanup_push (brl_readcleanup, (void*)brl);
+    while (1) {
+        if (!(atomic_load (&brl->state) & BRL_WRITER)) {
+            /*
+             * A writer can set its bit without the mutex, so
+             * count the thread and check again, as on the fast
+             * path (except that the mutex is already locked if
+             * the writer has to be woken).
+             */
+            atomic_fetch_add (&slot->readers, 1);
+            if (!(atomic_load (&brl->state) & BRL_WRITER))
+                break;
+            if (brl_remove (brl, slot)) {
+                status = pthread_cond_signal (&brl->drain);
+                if (status != 0)
+                    break;
+            }
+        }
+        status = pthread_cond_wait (&brl->read, &brl->mutex);
+        if (status != 0)
+            break;
+    }
+    pthread_cleanup_pop (0);
+    brl->r_wait--;
+    brl_waited (brl);
+    pthread_mutex_unlock (&brl->mutex);
+    return status;
+}
+
+/*
+ * Lock a big reader lock for read access.
+ */
+int brl_readlock (brlock_t *brl)
+{
+    brlock_slot_t *slot;
+    int status;
+
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    status = brl_slot (brl, &slot);
+    if (status != 0)
+        return status;
+    atomic_fetch_add (&slot->readers, 1);
+    if (!(atomic_load (&brl->state) & BRL_WRITER))
+        return 0;
+
+    /*
+     * A writer has the lock, or wants it. Get out of its way, and
+     * wait until it's done.
+     */
+    status = brl_leave (brl, slot);
+    if (status != 0)
+        return status;
+    return brl_readwait (brl, slot);
+}
+
+/*
+ * Attempt to lock a big reader lock for read access (don't
+ * block if unavailable).
+ */
+int brl_readtrylock (brlock_t *brl)
+{
+    brlock_slot_t *slot;
+    int status;
+
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    status = brl_slot (brl, &slot);
+    if (status != 0)
+        return status;
+    atomic_fetch_add (&slot->readers, 1);
+    if (!(atomic_load (&brl->state) & BRL_WRITER))
+        return 0;
+    status = brl_leave (brl, slot);
+    return (status == 0 ? EBUSY : status);
+}
+
+/*
+ * Unlock a big reader lock from read access.
+ */
+int brl_readunlock (brlock_t *brl)
+{
+    brlock_slot_t *slot;
+    int status;
+
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    status = brl_slot (brl, &slot);
+    if (status != 0)
+        return status;
+    return brl_leave (brl, slot);
+}
+
+/*
+ * Set the writer bit, if no other writer has it.
+ */
+static int brl_writetry (brlock_t *brl)
+{
+    unsigned int state = atomic_load (&brl->state);
+
+    while (!(state & BRL_WRITER))
+        if (atomic_compare_exchange_weak (
+                &brl->state, &state, state | BRL_WRITER))
+            return 1;
+    return 0;
+}
+
+/*
+ * Handle cleanup when the write lock condition variable
+ * wait is cancelled.
+ *
+ * Simply record that the thread is no longer waiting,
+ * and unlock the mutex.
+ */
+static void brl_writecleanup (void *arg)
+{
+    brlock_t *brl = (brlock_t *)arg;
+
+    brl->w_wait--;
+    brl_waited (brl);
+    pthread_mutex_unlock (&brl->mutex);
+}
+
+/*
+ * Handle cleanup when the wait for readers to leave is
+ * cancelled.
+ *
+ * Give up the writer bit, so that readers and other writers
+ * can continue, and unlock the mutex.
+ */
+static void brl_draincleanup (void *arg)
+{
+    brlock_t *brl = (brlock_t *)arg;
+
+    brl_release (brl);
+    pthread_mutex_unlock (&brl->mutex);
+}
+
+/*
+ * Wait for the readers that hold the lock to leave, once the
+ * writer bit is set. Called with the mutex locked. (The status is
+ * volatile because it's set between pthread_cleanup_push and
+ * pthread_cleanup_pop, which may be built on setjmp.)
+ */
+static int brl_drain (brlock_t *brl)
+{
+    volatile int status = 0;
+
+    pthread_cleanup_push (brl_draincleanup, (void*)brl);
+    while (brl_readers (brl)) {
+        status = pthread_cond_wait (&brl->drain, &brl->mutex);
+        if (status != 0)
+            break;
+    }
+    pthread_cleanup_pop (0);
+    if (status != 0)
+        brl_release (brl);
+    return status;
+}
+
+/*
+ * Wait for another writer to finish, and then for the readers
+ * to leave.
+ */
+static int brl_writewait (brlock_t *brl)
+{
+    int status;
+
+    status = pthread_mutex_lock (&brl->mutex);
+    if (status != 0)
+        return status;
+    brl->w_wait++;
+    brl_waiting (brl);
+    pthread_cleanup_push (brl_writecleanup, (void*)brl);
+    while (!brl_writetry (brl)) {
+        status = pthread_cond_wait (&brl->write, &brl->mutex);
+        if (status != 0)
+            break;
+    }
+    pthread_cleanup_pop (0);
+    brl->w_wait--;
+    brl_waited (brl);
+    if (status == 0)
+        status = brl_drain (brl);
+    pthread_mutex_unlock (&brl->mutex);
+    return status;
+}
+
+/*
+ * Lock a big reader lock for write access.
+ */
+int brl_writelock (brlock_t *brl)
+{
+    unsigned int state = 0;
+    int status, status2;
+
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    if (!atomic_compare_exchange_strong (&brl->state, &state, BRL_WRITER))
+        return brl_writewait (brl);
+
+    /*
+     * The writer bit keeps new readers out; if none are left
+     * from before, the lock is ours.
+     */
+    if (!brl_readers (brl))
+        return 0;
+    status = pthread_mutex_lock (&brl->mutex);
+    if (status != 0) {
+        brl_unlock (brl);
+        return status;
+    }
+    status = brl_drain (brl);
+    status2 = pthread_mutex_unlock (&brl->mutex);
+    return (status != 0 ? status : status2);
+}
+
+/*
+ * Attempt to lock a big reader lock for write access. Don't
+ * block if unavailable.
+ */
+int brl_writetrylock (brlock_t *brl)
+{
+    int status;
+
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    if (!brl_writetry (brl))
+        return EBUSY;
+    if (!brl_readers (brl))
+        return 0;
+
+    /*
+     * Readers hold the lock. Give it up, waking any thread that
+     * has started to wait for the writer bit to clear.
+     */
+    status = brl_unlock (brl);
+    return (status == 0 ? EBUSY : status);
+}
+
+/*
+ * Unlock a big reader lock from write access.
+ */
+int brl_writeunlock (brlock_t *brl)
+{
+    if (brl->valid != BRLOCK_VALID)
+        return EINVAL;
+    return brl_unlock (brl);
+}
@@ -0,0 +1,78 @@
+/*
+ * brlock.h
+ *
+ * This header file describes the "big reader lock" synchronization
+ * construct: a read-write lock for data that is read far more often
+ * than it is written. The type brlock_t describes the full state of
+ * the lock including the POSIX 1003.1c synchronization objects
+ * necessary.
+ *
+ * Instead of one count of readers, which every reader must modify
+ * (so that the cache line holding it moves from processor to
+ * processor on every read lock and unlock), a brlock_t has an
+ * array of reader counts, each in its own cache line. Each thread
+ * is given one of them, and counts itself only there, so readers
+ * running on different processors don't interfere with each other.
+ * The cost moves to the writer, which must look at every count to
+ * be sure that all readers are gone.
+ *
+ * The brl_init() and brl_destroy() functions, respectively, allow
+ * you to initialize/create and destroy/free the lock.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * The number of reader counts in each lock (threads beyond this
+ * number share them), and the size of a cache line. A brlock_t is
+ * BRL_SLOTS cache lines long, so it's best used for a few locks
+ * that protect a lot of data, rather than one lock per record.
+ */
+#define BRL_SLOTS       64
+#define BRL_CACHE_LINE  64
+
+/*
+ * A reader count, padded (and aligned, in static or automatic
+ * storage) so that it has a cache line to itself.
+ */
+typedef struct brlock_slot_tag {
+    _Alignas (BRL_CACHE_LINE) atomic_long readers;
+    char                pad[BRL_CACHE_LINE - sizeof (atomic_long)];
+} brlock_slot_t;
+
+/*
+ * Structure describing a big reader lock.
+ */
+typedef struct brlock_tag {
+    brlock_slot_t       slot[BRL_SLOTS]; /* reader counts */
+    atomic_uint         state;          /* writer and waiting bits */
+    int                 valid;          /* set when valid */
+    pthread_mutex_t     mutex;
+    pthread_cond_t      read;           /* wait for read */
+    pthread_cond_t      write;          /* wait for write */
+    pthread_cond_t      drain;          /* wait for readers to leave */
+    int                 r_wait;         /* readers waiting */
+    int                 w_wait;         /* writers waiting */
+} brlock_t;
+
+#define BRLOCK_VALID    0xb1ade
+
+/*
+ * Support static initialization of big reader locks
+ */
+#define BRL_INITIALIZER \
+    {{{0}}, 0, BRLOCK_VALID, PTHREAD_MUTEX_INITIALIZER, \
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, \
+    PTHREAD_COND_INITIALIZER, 0, 0}
+
+/*
+ * Define big reader lock functions
+ */
+extern int brl_init (brlock_t *brlock);
+extern int brl_destroy (brlock_t *brlock);
+extern int brl_readlock (brlock_t *brlock);
+extern int brl_readtrylock (brlock_t *brlock);
+extern int brl_readunlock (brlock_t *brlock);
+extern int brl_writelock (brlock_t *brlock);
+extern int brl_writetrylock (brlock_t *brlock);
+extern int brl_writeunlock (brlock_t *brlock);
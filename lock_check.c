@@ -0,0 +1,837 @@
+/*
+ * lock_check.c
+ *
+ * Check the behavior of the read-write lock and RCU packages, one
+ * case for each feature that lock_main's workload can't show. Each
+ * case sets up locks of its own, and threads that lock them while
+ * the case holds them, prints what it measured, and then "ok", or
+ * "FAILED" and why. Cases that wait for a thread give up after a
+ * few seconds, so that a lost wakeup fails the case rather than
+ * hanging the program.
+ *
+ * The cases are:
+ *
+ *      timed       A lock held for write, and then for read, by
+ *                  the case: rwl_readtimedlock, and then
+ *                  rwl_writetimedlock, with a 50ms deadline should
+ *                  return ETIMEDOUT, not early and no more than
+ *                  100ms late, and leave the lock free once the
+ *                  case unlocks it. This is done with a lock set
+ *                  up by RWL_INITIALIZER, whose condition variables
+ *                  use CLOCK_REALTIME (so that the deadline must be
+ *                  converted), and with one set up by rwl_init.
+ *                  Reports how long each call waited.
+ *
+ *      prefer      A RWL_PREFER_WRITER lock held for read by the
+ *                  case, a writer waiting for it with a deadline,
+ *                  and readers waiting behind the writer: the
+ *                  readers should get in once the writer times
+ *                  out. With a second writer waiting as well, a
+ *                  reader should wait for that one instead, which
+ *                  should get the lock when the case unlocks it.
+ *                  Finally, rounds in which the case unlocks the
+ *                  lock around the first writer's deadline: the
+ *                  second writer should always get the lock, even
+ *                  if the first timed out just as the lock was
+ *                  handed to it. Reports how long the readers took
+ *                  to get in, and how often the first writer got
+ *                  the lock before its deadline.
+ *
+ *      downgrade   A lock held for read by a reader, and in upgrade
+ *                  mode by the case, with a writer waiting: the
+ *                  case's rwl_upgrade should wait until the reader
+ *                  unlocks, and the writer shouldn't get in first,
+ *                  so the record the case read in upgrade mode is
+ *                  unchanged. Then, with readers waiting behind
+ *                  the case and the writer, rwl_downgrade should
+ *                  let the readers in (seeing the case's update)
+ *                  while the case still holds the lock for read,
+ *                  and the writer should get it once all of them
+ *                  unlock. This is done under RWL_PREFER_READER and
+ *                  RWL_PHASE_FAIR. Reports how long the upgrade
+ *                  waited, and how soon the readers got in.
+ *
+ *      rcu         An RCU reader inside rcu_read_lock, using a
+ *                  record, while another thread switches to a new
+ *                  record and calls rcu_synchronize (and then
+ *                  scribbles on the old record): rcu_synchronize
+ *                  shouldn't return until the reader has called
+ *                  rcu_read_unlock, and the reader should never
+ *                  see the scribble. Meanwhile, rcu_destroy should
+ *                  fail with EBUSY, leaving the domain usable; and
+ *                  rcu_synchronize from inside a read-side critical
+ *                  section should fail with EDEADLK. Reports how
+ *                  soon rcu_synchronize returned after the reader
+ *                  left.
+ *
+ * Usage: lock_check [case ...]
+ *
+ * With no arguments, every case is run. A case that fails may leave
+ * threads waiting, so the program stops there, with an exit status
+ * of 1.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "rwlock.h"
+#include "rcu.h"
+#include "errors.h"
+
+#define WAIT_SECONDS    10              /* longest wait for a thread */
+#define TIMEOUT_MS      50              /* timed lock deadline */
+#define LATE_MS         100             /* ... most it may be late */
+#define READERS         3               /* readers behind a writer */
+#define ROUNDS          200             /* handoffs around a deadline */
+
+/*
+ * A thread that locks a lock, and holds it until it's told to
+ * unlock it. If it's given a record, it adds 1 to it (if it locked
+ * for write), and notes what it holds, once it has the lock.
+ */
+typedef struct locker_tag {
+    pthread_t   thread_id;
+    rwlock_t    *rwlock;
+    int         write;                  /* lock for write, not read */
+    long        timeout;                /* ms to wait, or -1 forever */
+    int         *record;                /* record to update, or NULL */
+    int         seen;                   /* ... what it held */
+    int         status;                 /* from the lock call */
+    uint64_t    begin;                  /* time it called (ns) */
+    uint64_t    end;                    /* ... and returned */
+    atomic_int  returned;               /* set when it returned */
+    atomic_int  release;                /* set to let it unlock */
+} locker_t;
+
+/*
+ * One case: "run" returns 0 if the case passed.
+ */
+typedef struct check_tag {
+    const char  *name;
+    int         (*run) (void);
+} check_t;
+
+const char *current;                    /* name of running case */
+rwlock_t static_lock = RWL_INITIALIZER;
+rcu_t rcu;                              /* domain of the rcu case */
+int * _Atomic rcu_record;               /* ... record its reader uses */
+atomic_int reading, leave, synced;      /* ... its threads' progress */
+int read_before, read_after;            /* ... what the reader saw */
+uint64_t unlocked, synchronized;        /* ... and when */
+
+/*
+ * Return the time, in nanoseconds, measured by CLOCK_MONOTONIC.
+ */
+uint64_t now_ns (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Spin for "ns" nanoseconds.
+ */
+void spin_ns (uint64_t ns)
+{
+    uint64_t begin = now_ns ();
+
+    while (now_ns () - begin < ns)
+        ;
+}
+
+/*
+ * Sleep for "ms" milliseconds.
+ */
+void sleep_ms (long ms)
+{
+    struct timespec delay;
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep (&delay, NULL);
+}
+
+/*
+ * Set "abstime" to "ms" milliseconds from now, measured by
+ * CLOCK_MONOTONIC, as the timed locks expect.
+ */
+void deadline_ms (struct timespec *abstime, long ms)
+{
+    clock_gettime (CLOCK_MONOTONIC, abstime);
+    abstime->tv_sec += ms / 1000;
+    abstime->tv_nsec += (ms % 1000) * 1000000;
+    if (abstime->tv_nsec >= 1000000000) {
+        abstime->tv_sec++;
+        abstime->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Print a line of results, labelled with the name of the case.
+ */
+void report (const char *format, ...)
+{
+    va_list ap;
+
+    printf ("%s: ", current);
+    va_start (ap, format);
+    vprintf (format, ap);
+    va_end (ap);
+    printf ("\n");
+}
+
+/*
+ * Report why a case failed, and return 1 (for the case to
+ * return).
+ */
+int fail (const char *format, ...)
+{
+    va_list ap;
+
+    printf ("%s: FAILED: ", current);
+    va_start (ap, format);
+    vprintf (format, ap);
+    va_end (ap);
+    printf ("\n");
+    return 1;
+}
+
+/*
+ * Thread start routine for a locker: lock the lock (giving up
+ * after "timeout" ms, unless it's -1), and, if that worked, look
+ * at the record and hold the lock until "release" is set.
+ */
+void *locker_routine (void *arg)
+{
+    locker_t *self = (locker_t*)arg;
+    struct timespec abstime;
+    int status;
+
+    self->begin = now_ns ();
+    if (self->timeout < 0)
+        status = self->write
+            ? rwl_writelock (self->rwlock) : rwl_readlock (self->rwlock);
+    else {
+        deadline_ms (&abstime, self->timeout);
+        status = self->write
+            ? rwl_writetimedlock (self->rwlock, &abstime)
+            : rwl_readtimedlock (self->rwlock, &abstime);
+    }
+    self->end = now_ns ();
+    self->status = status;
+    if (status == 0 && self->record != NULL) {
+        if (self->write)
+            (*self->record)++;
+        self->seen = *self->record;
+    }
+    atomic_store (&self->returned, 1);
+    if (status != 0)
+        return NULL;
+    while (!atomic_load (&self->release))
+        sleep_ms (1);
+    status = self->write
+        ? rwl_writeunlock (self->rwlock) : rwl_readunlock (self->rwlock);
+    if (status != 0)
+        err_abort (status, "Unlock");
+    return NULL;
+}
+
+/*
+ * Start a locker.
+ */
+void locker_start (locker_t *locker,
+    rwlock_t *rwlock, int write, long timeout, int *record)
+{
+    int status;
+
+    locker->rwlock = rwlock;
+    locker->write = write;
+    locker->timeout = timeout;
+    locker->record = record;
+    atomic_init (&locker->returned, 0);
+    atomic_init (&locker->release, 0);
+    status = pthread_create (
+        &locker->thread_id, NULL, locker_routine, (void*)locker);
+    if (status != 0)
+        err_abort (status, "Create locker");
+}
+
+/*
+ * Let a locker unlock its lock (if it has it), and wait for it
+ * to finish.
+ */
+void locker_join (locker_t *locker)
+{
+    int status;
+
+    atomic_store (&locker->release, 1);
+    status = pthread_join (locker->thread_id, NULL);
+    if (status != 0)
+        err_abort (status, "Join locker");
+}
+
+/*
+ * Wait until "flag" is set, for at most WAIT_SECONDS; return
+ * ETIMEDOUT if it isn't.
+ */
+int flag_wait (atomic_int *flag)
+{
+    int ms;
+
+    for (ms = 0; ms < WAIT_SECONDS * 1000; ms++) {
+        if (atomic_load (flag))
+            return 0;
+        sleep_ms (1);
+    }
+    return ETIMEDOUT;
+}
+
+/*
+ * Wait until a locker's lock call has returned, for at most
+ * WAIT_SECONDS; return ETIMEDOUT if it hasn't.
+ */
+int locker_wait (locker_t *locker)
+{
+    return flag_wait (&locker->returned);
+}
+
+/*
+ * Wait until "readers" readers and "writers" writers are waiting
+ * for a lock (as it counts them), for at most WAIT_SECONDS; return
+ * ETIMEDOUT if they aren't.
+ */
+int waiters_wait (rwlock_t *rwlock, int readers, int writers)
+{
+    int ms, found, status;
+
+    for (ms = 0; ms < WAIT_SECONDS * 1000; ms++) {
+        status = pthread_mutex_lock (&rwlock->mutex);
+        if (status != 0)
+            err_abort (status, "Lock rw mutex");
+        found = (rwlock->r_wait == readers && rwlock->w_wait == writers);
+        status = pthread_mutex_unlock (&rwlock->mutex);
+        if (status != 0)
+            err_abort (status, "Unlock rw mutex");
+        if (found)
+            return 0;
+        sleep_ms (1);
+    }
+    return ETIMEDOUT;
+}
+
+/*
+ * Check that a timed lock call gave up, in time.
+ */
+int timed_out (const char *name, const char *mode, locker_t *locker)
+{
+    uint64_t waited = locker->end - locker->begin;
+
+    if (locker->status != ETIMEDOUT)
+        return fail ("%s lock: timed %s lock returned %d, not ETIMEDOUT",
+            name, mode, locker->status);
+    if (waited < (uint64_t)TIMEOUT_MS * 1000000
+            || waited > (uint64_t)(TIMEOUT_MS + LATE_MS) * 1000000)
+        return fail ("%s lock: timed %s lock gave up after %.1f ms, not %d",
+            name, mode, waited / 1e6, TIMEOUT_MS);
+    return 0;
+}
+
+/*
+ * Time out a read lock and a write lock on "rwlock", and check
+ * that it's free afterwards.
+ */
+int timed_lock (const char *name, rwlock_t *rwlock)
+{
+    struct timespec abstime;
+    locker_t reader, writer;
+    int status;
+
+    status = rwl_writelock (rwlock);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    locker_start (&reader, rwlock, 0, TIMEOUT_MS, NULL);
+    locker_join (&reader);
+    status = rwl_writeunlock (rwlock);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    if (timed_out (name, "read", &reader) != 0)
+        return 1;
+
+    status = rwl_readlock (rwlock);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    locker_start (&writer, rwlock, 1, TIMEOUT_MS, NULL);
+    locker_join (&writer);
+    status = rwl_readunlock (rwlock);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    if (timed_out (name, "write", &writer) != 0)
+        return 1;
+
+    /*
+     * Nothing should be left waiting: the lock should be free,
+     * and a timed lock should get it at once.
+     */
+    if (rwl_writetrylock (rwlock) != 0)
+        return fail ("%s lock: not free after the timeouts", name);
+    status = rwl_writeunlock (rwlock);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    deadline_ms (&abstime, TIMEOUT_MS);
+    status = rwl_readtimedlock (rwlock, &abstime);
+    if (status != 0)
+        return fail ("%s lock: timed read lock of a free lock returned %d",
+            name, status);
+    status = rwl_readunlock (rwlock);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+
+    report ("%s lock (%s condition variables): read lock timed out after"
+        " %.1f ms, write lock after %.1f ms, of %d",
+        name, rwlock->monotonic ? "CLOCK_MONOTONIC" : "CLOCK_REALTIME",
+        (reader.end - reader.begin) / 1e6,
+        (writer.end - writer.begin) / 1e6, TIMEOUT_MS);
+    return 0;
+}
+
+/*
+ * timed: check that timed locks give up at their deadline, with
+ * static and dynamic locks.
+ */
+int check_timed (void)
+{
+    rwlock_t init_lock;
+    int status;
+
+    status = rwl_init (&init_lock);
+    if (status != 0)
+        err_abort (status, "Init rw lock");
+    if (timed_lock ("static", &static_lock) != 0)
+        return 1;
+    if (timed_lock ("rwl_init", &init_lock) != 0)
+        return 1;
+    status = rwl_destroy (&init_lock);
+    if (status != 0)
+        err_abort (status, "Destroy rw lock");
+    return 0;
+}
+
+/*
+ * prefer: check that, under RWL_PREFER_WRITER, a writer that times
+ * out doesn't leave readers or other writers waiting for it.
+ */
+int check_prefer (void)
+{
+    rwl_attr_t attr;
+    rwlock_t rwlock;
+    locker_t writer, other, readers[READERS];
+    uint64_t last = 0;
+    int round, got = 0, i, status;
+
+    rwl_attr_init (&attr);
+    rwl_attr_setpolicy (&attr, RWL_PREFER_WRITER);
+    status = rwl_init_attr (&rwlock, &attr);
+    if (status != 0)
+        err_abort (status, "Init rw lock");
+    rwl_attr_destroy (&attr);
+
+    /*
+     * Readers behind a writer that times out.
+     */
+    status = rwl_readlock (&rwlock);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    locker_start (&writer, &rwlock, 1, TIMEOUT_MS, NULL);
+    if (waiters_wait (&rwlock, 0, 1) != 0)
+        return fail ("the writer never waited");
+    for (i = 0; i < READERS; i++)
+        locker_start (&readers[i], &rwlock, 0, -1, NULL);
+    if (waiters_wait (&rwlock, READERS, 1) != 0)
+        return fail ("readers didn't wait behind the writer");
+    locker_join (&writer);
+    if (writer.status != ETIMEDOUT)
+        return fail ("the writer's timed lock returned %d, not ETIMEDOUT",
+            writer.status);
+    for (i = 0; i < READERS; i++) {
+        if (locker_wait (&readers[i]) != 0)
+            return fail ("reader %d still waiting after the writer"
+                " timed out", i);
+        if (readers[i].status != 0)
+            err_abort (readers[i].status, "Read lock");
+        if (readers[i].end > last)
+            last = readers[i].end;
+    }
+    for (i = 0; i < READERS; i++)
+        locker_join (&readers[i]);
+    status = rwl_readunlock (&rwlock);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    report ("writer timed out after %.1f ms; the %d readers behind it"
+        " were in %.3f ms after its deadline",
+        (writer.end - writer.begin) / 1e6, READERS,
+        (last - writer.begin) / 1e6 - TIMEOUT_MS);
+
+    /*
+     * With another writer waiting, a reader should still wait.
+     */
+    status = rwl_readlock (&rwlock);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    locker_start (&writer, &rwlock, 1, TIMEOUT_MS, NULL);
+    if (waiters_wait (&rwlock, 0, 1) != 0)
+        return fail ("the writer never waited");
+    locker_start (&other, &rwlock, 1, WAIT_SECONDS * 1000, NULL);
+    if (waiters_wait (&rwlock, 0, 2) != 0)
+        return fail ("the other writer never waited");
+    locker_start (&readers[0], &rwlock, 0, -1, NULL);
+    if (waiters_wait (&rwlock, 1, 2) != 0)
+        return fail ("the reader didn't wait behind the writers");
+    locker_join (&writer);
+    if (writer.status != ETIMEDOUT)
+        return fail ("the writer's timed lock returned %d, not ETIMEDOUT",
+            writer.status);
+    sleep_ms (TIMEOUT_MS);
+    if (atomic_load (&readers[0].returned))
+        return fail ("the reader passed the other waiting writer");
+    status = rwl_readunlock (&rwlock);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    if (locker_wait (&other) != 0 || other.status != 0)
+        return fail ("the other writer didn't get the lock");
+    if (atomic_load (&readers[0].returned))
+        return fail ("the reader got in with the other writer");
+    locker_join (&other);
+    if (locker_wait (&readers[0]) != 0 || readers[0].status != 0)
+        return fail ("the reader didn't get in after the writers");
+    locker_join (&readers[0]);
+    report ("with another writer waiting: the reader waited for it");
+
+    /*
+     * With the other writer waiting, start a writer with a 1ms
+     * deadline and unlock at times spread over the next 2ms, so
+     * that the lock is sometimes handed to a writer that has just
+     * timed out: the other writer must get it anyway.
+     */
+    for (round = 0; round < ROUNDS; round++) {
+        status = rwl_readlock (&rwlock);
+        if (status != 0)
+            err_abort (status, "Read lock");
+        locker_start (&other, &rwlock, 1, WAIT_SECONDS * 1000, NULL);
+        if (waiters_wait (&rwlock, 0, 1) != 0)
+            return fail ("round %d: the other writer never waited", round);
+        locker_start (&writer, &rwlock, 1, 1, NULL);
+        spin_ns ((uint64_t)(round % 20) * 100000);
+        status = rwl_readunlock (&rwlock);
+        if (status != 0)
+            err_abort (status, "Read unlock");
+        if (locker_wait (&writer) != 0)
+            return fail ("round %d: the writer never returned", round);
+        if (writer.status == 0)
+            got++;
+        else if (writer.status != ETIMEDOUT)
+            err_abort (writer.status, "Timed write lock");
+        locker_join (&writer);
+        if (locker_wait (&other) != 0 || other.status != 0)
+            return fail ("round %d: the other writer didn't get the lock",
+                round);
+        locker_join (&other);
+    }
+    report ("%d rounds: the first writer got the lock in %d, timed out"
+        " in %d; the other always got it", ROUNDS, got, ROUNDS - got);
+
+    status = rwl_destroy (&rwlock);
+    if (status != 0)
+        err_abort (status, "Destroy rw lock");
+    return 0;
+}
+
+/*
+ * Thread start routine that lets a locker unlock its lock after
+ * TIMEOUT_MS, while the case is waiting for something else.
+ */
+void *release_routine (void *arg)
+{
+    sleep_ms (TIMEOUT_MS);
+    locker_join ((locker_t*)arg);
+    return NULL;
+}
+
+/*
+ * Check upgrade mode, and then downgrading, on a lock with the
+ * given policy.
+ */
+int downgrade_lock (const char *name, int policy)
+{
+    rwl_attr_t attr;
+    rwlock_t rwlock;
+    locker_t reader, writer, readers[READERS];
+    pthread_t releaser;
+    uint64_t begin, upgraded, downgraded, last = 0;
+    int record = 0, seen, i, status;
+
+    rwl_attr_init (&attr);
+    rwl_attr_setpolicy (&attr, policy);
+    status = rwl_init_attr (&rwlock, &attr);
+    if (status != 0)
+        err_abort (status, "Init rw lock");
+    rwl_attr_destroy (&attr);
+
+    /*
+     * With a reader in, take upgrade mode, and look at the record;
+     * then, with a writer waiting, upgrade, which must wait for the
+     * reader but not let the writer in first.
+     */
+    locker_start (&reader, &rwlock, 0, -1, &record);
+    if (locker_wait (&reader) != 0 || reader.status != 0)
+        return fail ("%s: the first reader didn't get in", name);
+    status = rwl_upgradelock (&rwlock);
+    if (status != 0)
+        err_abort (status, "Upgrade lock");
+    seen = record;
+    locker_start (&writer, &rwlock, 1, -1, &record);
+    if (waiters_wait (&rwlock, 0, 1) != 0)
+        return fail ("%s: the writer never waited", name);
+    status = pthread_create (
+        &releaser, NULL, release_routine, (void*)&reader);
+    if (status != 0)
+        err_abort (status, "Create releaser");
+    begin = now_ns ();
+    status = rwl_upgrade (&rwlock);
+    if (status != 0)
+        err_abort (status, "Upgrade");
+    upgraded = now_ns ();
+    status = pthread_join (releaser, NULL);
+    if (status != 0)
+        err_abort (status, "Join releaser");
+    if (upgraded - begin < (uint64_t)(TIMEOUT_MS - 1) * 1000000)
+        return fail ("%s: upgraded after %.1f ms, with the reader still"
+            " in", name, (upgraded - begin) / 1e6);
+    if (record != seen || atomic_load (&writer.returned))
+        return fail ("%s: the writer got in before the upgrade", name);
+
+    /*
+     * Update the record, and downgrade, with readers waiting
+     * behind this thread (and the writer): they should get in,
+     * and see the update, while this thread still holds the lock
+     * for read.
+     */
+    record = seen + 100;
+    for (i = 0; i < READERS; i++)
+        locker_start (&readers[i], &rwlock, 0, -1, &record);
+    if (waiters_wait (&rwlock, READERS, 1) != 0)
+        return fail ("%s: readers didn't wait for the upgrader", name);
+    downgraded = now_ns ();
+    status = rwl_downgrade (&rwlock);
+    if (status != 0)
+        err_abort (status, "Downgrade");
+    for (i = 0; i < READERS; i++) {
+        if (locker_wait (&readers[i]) != 0 || readers[i].status != 0)
+            return fail ("%s: reader %d didn't get in after the"
+                " downgrade", name, i);
+        if (readers[i].seen != seen + 100)
+            return fail ("%s: reader %d saw %d, not %d", name, i,
+                readers[i].seen, seen + 100);
+        if (readers[i].end > last)
+            last = readers[i].end;
+    }
+    if (record != seen + 100 || atomic_load (&writer.returned))
+        return fail ("%s: the writer got in after the downgrade", name);
+    for (i = 0; i < READERS; i++)
+        locker_join (&readers[i]);
+    status = rwl_readunlock (&rwlock);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    if (locker_wait (&writer) != 0 || writer.status != 0)
+        return fail ("%s: the writer didn't get the lock at last", name);
+    if (writer.seen != seen + 101)
+        return fail ("%s: the writer saw %d, not %d", name,
+            writer.seen, seen + 101);
+    locker_join (&writer);
+    report ("%s: upgrade waited %.1f ms for a reader, ahead of a writer;"
+        " %d readers in %.3f ms after the downgrade", name,
+        (upgraded - begin) / 1e6, READERS, (last - downgraded) / 1e6);
+
+    status = rwl_destroy (&rwlock);
+    if (status != 0)
+        err_abort (status, "Destroy rw lock");
+    return 0;
+}
+
+/*
+ * downgrade: check that upgrade mode keeps writers out until the
+ * upgrade, and that a downgrade lets readers in.
+ */
+int check_downgrade (void)
+{
+    if (downgrade_lock ("prefer reader", RWL_PREFER_READER) != 0)
+        return 1;
+    if (downgrade_lock ("phase fair", RWL_PHASE_FAIR) != 0)
+        return 1;
+    return 0;
+}
+
+/*
+ * Thread start routine for the rcu case's reader: find the record,
+ * and keep using it until told to leave.
+ */
+void *rcu_reader (void *arg)
+{
+    int *record;
+    int status;
+
+    status = rcu_read_lock (&rcu);
+    if (status != 0)
+        err_abort (status, "RCU read lock");
+    record = RCU_DEREFERENCE (rcu_record);
+    read_before = *record;
+    atomic_store (&reading, 1);
+    while (!atomic_load (&leave))
+        sleep_ms (1);
+    read_after = *record;
+    unlocked = now_ns ();
+    status = rcu_read_unlock (&rcu);
+    if (status != 0)
+        err_abort (status, "RCU read unlock");
+    return NULL;
+}
+
+/*
+ * Thread start routine for the rcu case's writer: wait for a grace
+ * period, and then scribble on the record the reader was using (as
+ * if freeing it).
+ */
+void *rcu_writer (void *arg)
+{
+    int *old = (int*)arg;
+    int status;
+
+    status = rcu_synchronize (&rcu);
+    if (status != 0)
+        err_abort (status, "Synchronize");
+    synchronized = now_ns ();
+    *old = -1;
+    atomic_store (&synced, 1);
+    return NULL;
+}
+
+/*
+ * rcu: check that rcu_synchronize waits for a reader, and that the
+ * domain can't be destroyed under one.
+ */
+int check_rcu (void)
+{
+    pthread_t reader, writer;
+    int old = 1, new = 2, status;
+
+    status = rcu_init (&rcu);
+    if (status != 0)
+        err_abort (status, "Init RCU");
+    atomic_init (&rcu_record, &old);
+    atomic_store (&reading, 0);
+    atomic_store (&leave, 0);
+    atomic_store (&synced, 0);
+
+    /*
+     * A thread can't wait for a grace period from inside a
+     * read-side critical section: it would wait for itself.
+     */
+    status = rcu_read_lock (&rcu);
+    if (status != 0)
+        err_abort (status, "RCU read lock");
+    status = rcu_synchronize (&rcu);
+    if (status != EDEADLK)
+        return fail ("rcu_synchronize by a reader returned %d, not EDEADLK",
+            status);
+    status = rcu_read_unlock (&rcu);
+    if (status != 0)
+        err_abort (status, "RCU read unlock");
+
+    /*
+     * With a reader using the old record, switch to a new one,
+     * and wait for a grace period in another thread: it shouldn't
+     * end until the reader leaves.
+     */
+    status = pthread_create (&reader, NULL, rcu_reader, NULL);
+    if (status != 0)
+        err_abort (status, "Create reader");
+    if (flag_wait (&reading) != 0)
+        return fail ("the reader never started reading");
+    status = rcu_destroy (&rcu);
+    if (status != EBUSY)
+        return fail ("rcu_destroy with a reader returned %d, not EBUSY",
+            status);
+    RCU_ASSIGN (rcu_record, &new);
+    status = pthread_create (&writer, NULL, rcu_writer, (void*)&old);
+    if (status != 0)
+        err_abort (status, "Create writer");
+    sleep_ms (TIMEOUT_MS);
+    if (atomic_load (&synced))
+        return fail ("rcu_synchronize returned with the reader inside");
+    atomic_store (&leave, 1);
+    if (flag_wait (&synced) != 0)
+        return fail ("rcu_synchronize didn't return after the reader left");
+    status = pthread_join (reader, NULL);
+    if (status != 0)
+        err_abort (status, "Join reader");
+    status = pthread_join (writer, NULL);
+    if (status != 0)
+        err_abort (status, "Join writer");
+    if (read_before != 1 || read_after != 1)
+        return fail ("the reader saw %d, and then %d, not 1",
+            read_before, read_after);
+    if (synchronized < unlocked)
+        return fail ("rcu_synchronize returned before the reader left");
+    report ("rcu_synchronize was still waiting after %d ms; it returned"
+        " %.3f ms after the reader left", TIMEOUT_MS,
+        (synchronized - unlocked) / 1e6);
+
+    status = rcu_destroy (&rcu);
+    if (status != 0)
+        return fail ("rcu_destroy with no reader returned %d", status);
+    return 0;
+}
+
+check_t checks[] = {
+    {"timed", check_timed},
+    {"prefer", check_prefer},
+    {"downgrade", check_downgrade},
+    {"rcu", check_rcu},
+    {NULL}
+};
+
+int main (int argc, char *argv[])
+{
+    int count, arg;
+
+    for (arg = 1; arg < argc; arg++) {
+        for (count = 0; checks[count].name != NULL; count++)
+            if (strcmp (argv[arg], checks[count].name) == 0)
+                break;
+        if (checks[count].name == NULL) {
+            fprintf (stderr, "Usage: %s [case ...]\ncase is", argv[0]);
+            for (count = 0; checks[count].name != NULL; count++)
+                fprintf (stderr, " %s", checks[count].name);
+            fprintf (stderr, "\n");
+            return 1;
+        }
+    }
+
+    for (count = 0; checks[count].name != NULL; count++) {
+        for (arg = 1; arg < argc; arg++)
+            if (strcmp (argv[arg], checks[count].name) == 0)
+                break;
+        if (argc > 1 && arg == argc)
+            continue;
+        current = checks[count].name;
+        if (checks[count].run () != 0)
+            return 1;
+        report ("ok");
+        fflush (stdout);
+    }
+    return 0;
+}
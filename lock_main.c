@@ -0,0 +1,603 @@
+/*
+ * lock_main.c
+ *
+ * Compare the kinds of read-write lock in this directory by running
+ * the workload of rwlock_main.c (a set of threads working through
+ * an array of records, each updating a record every "interval"
+ * iterations and reading one the rest of the time) with each of
+ * them in turn, and reporting how long each run took. Every run
+ * uses the same threads, intervals and records, so the times can
+ * be compared line by line.
+ *
+ * Each kind of lock is described by a lock_ops_t: functions to set
+ * up the records and their locks, to copy a record for a reader,
+ * to update a record, and to clean up. Adding a kind of lock to the
+ * comparison means writing those four functions.
+ *
+ * Each record carries a "check" field that writers keep equal to
+ * the sum of the other two, so that readers can tell whether they
+ * ever see a record that's partly changed; and the updates the
+ * threads count must add up to the updates the records count.
+ *
+ * Usage: lock_main [lock [threads [iterations]]]
+ *
+ * where "lock" names one kind of lock, or is "all" (the default).
+ */
+#include <pthread.h>
+#include <time.h>
+#include "rwlock.h"
+#include "brlock.h"
+#include "seqlock.h"
+#include "rcu.h"
+#include "errors.h"
+
+#define MAX_THREADS     64
+#define DATASIZE        15
+
+/*
+ * Keep statistics for each thread.
+ */
+typedef struct thread_tag {
+    int         thread_num;
+    pthread_t   thread_id;
+    int         updates;
+    long        reads;
+    long        broken;                 /* inconsistent reads */
+    long        stale;                  /* checks changed before update */
+    int         interval;
+} thread_t;
+
+/*
+ * The contents of a record.
+ */
+typedef struct value_tag {
+    int         data;                   /* last thread to update */
+    int         updates;
+    int         check;                  /* data + updates */
+} value_t;
+
+/*
+ * A copy of a record, for readers that lock nothing (with RCU).
+ */
+typedef struct copy_tag {
+    value_t     value;
+    rcu_head_t  head;
+} copy_t;
+
+/*
+ * One kind of lock. "update" returns the number of updates it made
+ * (which may be 0, if it decides the record needn't change).
+ */
+typedef struct lock_ops_tag {
+    const char  *name;
+    void        (*setup) (void);
+    void        (*read) (int element, value_t *value);
+    int         (*update) (thread_t *self, int element);
+    void        (*cleanup) (void);
+} lock_ops_t;
+
+thread_t threads[MAX_THREADS];
+value_t values[DATASIZE];               /* records, for the locks */
+rwlock_t rwlocks[DATASIZE];
+brlock_t brlocks[DATASIZE];
+seqlock_t seqlocks[DATASIZE];
+copy_t * _Atomic copies[DATASIZE];      /* records, for RCU */
+pthread_mutex_t copy_mutex[DATASIZE];   /* keep RCU writers out */
+rcu_t rcu;
+atomic_long frees;                      /* old copies freed */
+int thread_count = 5;
+int iterations = 1000000;
+lock_ops_t *ops;                        /* lock for this run */
+
+/*
+ * Change a record (which the caller has locked for write).
+ */
+void value_update (value_t *value, thread_t *self)
+{
+    value->data = self->thread_num;
+    value->updates++;
+    value->check = value->data + value->updates;
+}
+
+/*
+ * Read-write locks (rwlock.c), one for each record.
+ */
+void setup_rwlock (void)
+{
+    int count, status;
+
+    memset (values, 0, sizeof (values));
+    for (count = 0; count < DATASIZE; count++) {
+        status = rwl_init (&rwlocks[count]);
+        if (status != 0)
+            err_abort (status, "Init rw lock");
+    }
+}
+
+void read_rwlock (int element, value_t *value)
+{
+    int status;
+
+    status = rwl_readlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    *value = values[element];
+    status = rwl_readunlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+}
+
+int update_rwlock (thread_t *self, int element)
+{
+    int status;
+
+    status = rwl_writelock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    value_update (&values[element], self);
+    status = rwl_writeunlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    return 1;
+}
+
+void cleanup_rwlock (void)
+{
+    int count, status;
+
+    for (count = 0; count < DATASIZE; count++) {
+        status = rwl_destroy (&rwlocks[count]);
+        if (status != 0)
+            err_abort (status, "Destroy rw lock");
+    }
+}
+
+/*
+ * Read-write locks again, but with a check-then-update: a thread
+ * updates the record only if it wasn't the last to do so. "relock"
+ * checks under a read lock, and unlocks it to lock for write, so
+ * another thread may update the record in between and the check
+ * must be made again (the thread counts a "stale" check). "upgrade"
+ * checks in upgrade mode and upgrades to update, so the check still
+ * holds, and no check should ever be stale.
+ */
+int update_relock (thread_t *self, int element)
+{
+    int status, updates, mine;
+
+    status = rwl_readlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    updates = values[element].updates;
+    mine = (values[element].data == self->thread_num);
+    status = rwl_readunlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    if (mine)
+        return 0;
+
+    status = rwl_writelock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    if (values[element].updates != updates) {
+        /*
+         * Another thread got in first: check again.
+         */
+        self->stale++;
+        mine = (values[element].data == self->thread_num);
+    }
+    if (!mine)
+        value_update (&values[element], self);
+    status = rwl_writeunlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    return !mine;
+}
+
+int update_upgrade (thread_t *self, int element)
+{
+    int status, updates;
+
+    status = rwl_upgradelock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Upgrade lock");
+    if (values[element].data == self->thread_num) {
+        status = rwl_upgradeunlock (&rwlocks[element]);
+        if (status != 0)
+            err_abort (status, "Upgrade unlock");
+        return 0;
+    }
+
+    updates = values[element].updates;
+    status = rwl_upgrade (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Upgrade");
+    if (values[element].updates != updates)
+        self->stale++;
+    value_update (&values[element], self);
+    status = rwl_writeunlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    return 1;
+}
+
+/*
+ * Upgrade mode again, downgrading to read access after the update,
+ * and reading the record back before unlocking: no other writer can
+ * have come between, so the thread should still see its own update
+ * (or it counts an inconsistent read).
+ */
+int update_downgrade (thread_t *self, int element)
+{
+    value_t value;
+    int status, updates;
+
+    status = rwl_upgradelock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Upgrade lock");
+    if (values[element].data == self->thread_num) {
+        status = rwl_upgradeunlock (&rwlocks[element]);
+        if (status != 0)
+            err_abort (status, "Upgrade unlock");
+        return 0;
+    }
+
+    updates = values[element].updates;
+    status = rwl_upgrade (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Upgrade");
+    if (values[element].updates != updates)
+        self->stale++;
+    value_update (&values[element], self);
+    value = values[element];
+    status = rwl_downgrade (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Downgrade");
+    if (values[element].data != value.data
+            || values[element].updates != value.updates
+            || values[element].check != value.check)
+        self->broken++;
+    status = rwl_readunlock (&rwlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    return 1;
+}
+
+/*
+ * Big reader locks (brlock.c), one for each record.
+ */
+void setup_brlock (void)
+{
+    int count, status;
+
+    memset (values, 0, sizeof (values));
+    for (count = 0; count < DATASIZE; count++) {
+        status = brl_init (&brlocks[count]);
+        if (status != 0)
+            err_abort (status, "Init br lock");
+    }
+}
+
+void read_brlock (int element, value_t *value)
+{
+    int status;
+
+    status = brl_readlock (&brlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    *value = values[element];
+    status = brl_readunlock (&brlocks[element]);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+}
+
+int update_brlock (thread_t *self, int element)
+{
+    int status;
+
+    status = brl_writelock (&brlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    value_update (&values[element], self);
+    status = brl_writeunlock (&brlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    return 1;
+}
+
+void cleanup_brlock (void)
+{
+    int count, status;
+
+    for (count = 0; count < DATASIZE; count++) {
+        status = brl_destroy (&brlocks[count]);
+        if (status != 0)
+            err_abort (status, "Destroy br lock");
+    }
+}
+
+/*
+ * Sequence locks (seqlock.c), one for each record. Readers take no
+ * lock; they copy the record, and copy it again if a writer changed
+ * it meanwhile.
+ */
+void setup_seqlock (void)
+{
+    int count, status;
+
+    memset (values, 0, sizeof (values));
+    for (count = 0; count < DATASIZE; count++) {
+        status = seq_init (&seqlocks[count]);
+        if (status != 0)
+            err_abort (status, "Init seq lock");
+    }
+}
+
+void read_seqlock (int element, value_t *value)
+{
+    SEQ_READ (&seqlocks[element], *value, values[element]);
+}
+
+int update_seqlock (thread_t *self, int element)
+{
+    int status;
+
+    status = seq_writelock (&seqlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    value_update (&values[element], self);
+    status = seq_writeunlock (&seqlocks[element]);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    return 1;
+}
+
+void cleanup_seqlock (void)
+{
+    int count, status;
+
+    for (count = 0; count < DATASIZE; count++) {
+        status = seq_destroy (&seqlocks[count]);
+        if (status != 0)
+            err_abort (status, "Destroy seq lock");
+    }
+}
+
+/*
+ * RCU (rcu.c): each record is a pointer to a copy. Readers lock
+ * nothing but the RCU domain; a writer (which keeps out other
+ * writers with a mutex) changes a new copy, switches the pointer to
+ * it, and passes the old copy to rcu_call() to be freed after a
+ * grace period. copy_free() scribbles on the old copy first, so
+ * that a reader that was still using it would see an inconsistent
+ * record.
+ */
+void copy_free (void *arg)
+{
+    copy_t *copy = (copy_t*)arg;
+
+    copy->value.check = -1;
+    free (copy);
+    atomic_fetch_add (&frees, 1);
+}
+
+void setup_rcu (void)
+{
+    copy_t *copy;
+    int count, status;
+
+    status = rcu_init (&rcu);
+    if (status != 0)
+        err_abort (status, "Init RCU");
+    atomic_init (&frees, 0);
+    for (count = 0; count < DATASIZE; count++) {
+        status = pthread_mutex_init (&copy_mutex[count], NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        copy = (copy_t*)calloc (1, sizeof (copy_t));
+        if (copy == NULL)
+            errno_abort ("Allocate copy");
+        atomic_init (&copies[count], copy);
+    }
+}
+
+void read_rcu (int element, value_t *value)
+{
+    int status;
+
+    status = rcu_read_lock (&rcu);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    *value = RCU_DEREFERENCE (copies[element])->value;
+    status = rcu_read_unlock (&rcu);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+}
+
+int update_rcu (thread_t *self, int element)
+{
+    copy_t *old, *new;
+    int status;
+
+    new = (copy_t*)malloc (sizeof (copy_t));
+    if (new == NULL)
+        errno_abort ("Allocate copy");
+    status = pthread_mutex_lock (&copy_mutex[element]);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    old = atomic_load_explicit (&copies[element], memory_order_relaxed);
+    new->value = old->value;
+    value_update (&new->value, self);
+    RCU_ASSIGN (copies[element], new);
+    status = pthread_mutex_unlock (&copy_mutex[element]);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    status = rcu_call (&rcu, &old->head, copy_free, old);
+    if (status != 0)
+        err_abort (status, "Call after grace period");
+    return 1;
+}
+
+/*
+ * Destroying the domain runs the frees still waiting for a grace
+ * period; after that, every update's old copy should have been
+ * freed.
+ */
+void cleanup_rcu (void)
+{
+    long updates = 0;
+    int count, status;
+
+    status = rcu_destroy (&rcu);
+    if (status != 0)
+        err_abort (status, "Destroy RCU");
+    for (count = 0; count < DATASIZE; count++) {
+        updates += copies[count]->value.updates;
+        free (copies[count]);
+        status = pthread_mutex_destroy (&copy_mutex[count]);
+        if (status != 0)
+            err_abort (status, "Destroy mutex");
+    }
+    if (atomic_load (&frees) != updates)
+        printf ("rcu: %ld updates, but %ld old copies freed!\n",
+            updates, atomic_load (&frees));
+}
+
+lock_ops_t lock_ops[] = {
+    {"rwlock", setup_rwlock, read_rwlock, update_rwlock, cleanup_rwlock},
+    {"relock", setup_rwlock, read_rwlock, update_relock, cleanup_rwlock},
+    {"upgrade", setup_rwlock, read_rwlock, update_upgrade, cleanup_rwlock},
+    {"downgrade", setup_rwlock, read_rwlock, update_downgrade,
+        cleanup_rwlock},
+    {"brlock", setup_brlock, read_brlock, update_brlock, cleanup_brlock},
+    {"seqlock", setup_seqlock, read_seqlock, update_seqlock,
+        cleanup_seqlock},
+    {"rcu", setup_rcu, read_rcu, update_rcu, cleanup_rcu},
+    {NULL}
+};
+
+/*
+ * Thread start routine that uses the locks
+ */
+void *thread_routine (void *arg)
+{
+    thread_t *self = (thread_t*)arg;
+    value_t value;
+    int iteration;
+    int element = 0;
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        /*
+         * Each "self->interval" iterations, perform an
+         * update operation instead of a read.
+         */
+        if ((iteration % self->interval) == 0)
+            self->updates += ops->update (self, element);
+        else {
+            ops->read (element, &value);
+            self->reads++;
+            if (value.check != value.data + value.updates)
+                self->broken++;
+        }
+        element++;
+        if (element >= DATASIZE)
+            element = 0;
+    }
+    return NULL;
+}
+
+/*
+ * Run the workload once, with the lock "ops", and report the
+ * results.
+ */
+void run (void)
+{
+    struct timespec begin, end;
+    unsigned int seed = 1;
+    int thread_updates = 0, data_updates = 0, count, status;
+    long reads = 0, broken = 0, stale = 0;
+    value_t value;
+    double seconds;
+
+    ops->setup ();
+    clock_gettime (CLOCK_MONOTONIC, &begin);
+    for (count = 0; count < thread_count; count++) {
+        threads[count].thread_num = count;
+        threads[count].updates = 0;
+        threads[count].reads = 0;
+        threads[count].broken = 0;
+        threads[count].stale = 0;
+        threads[count].interval = rand_r (&seed) % 71 + 1;
+        status = pthread_create (&threads[count].thread_id,
+            NULL, thread_routine, (void*)&threads[count]);
+        if (status != 0)
+            err_abort (status, "Create thread");
+    }
+    for (count = 0; count < thread_count; count++) {
+        status = pthread_join (threads[count].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join thread");
+        thread_updates += threads[count].updates;
+        reads += threads[count].reads;
+        broken += threads[count].broken;
+        stale += threads[count].stale;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    for (count = 0; count < DATASIZE; count++) {
+        ops->read (count, &value);
+        data_updates += value.updates;
+    }
+    seconds = (end.tv_sec - begin.tv_sec)
+        + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf ("%s: %ld reads (%ld inconsistent), %d updates (%d counted)"
+        " in %.3f seconds, %.1f ns per iteration\n",
+        ops->name, reads, broken, thread_updates, data_updates, seconds,
+        seconds * 1e9 / ((double)thread_count * iterations));
+    if (stale != 0)
+        printf ("%s: %ld checks were stale by the time of the update\n",
+            ops->name, stale);
+    if (thread_updates != data_updates)
+        printf ("%s: lost updates!\n", ops->name);
+    ops->cleanup ();
+}
+
+int main (int argc, char *argv[])
+{
+    const char *name = "all";
+    int count, found = 0;
+
+    if (argc > 1)
+        name = argv[1];
+    if (argc > 2)
+        thread_count = atoi (argv[2]);
+    if (argc > 3)
+        iterations = atoi (argv[3]);
+    for (count = 0; lock_ops[count].name != NULL; count++)
+        if (strcmp (name, "all") == 0
+                || strcmp (name, lock_ops[count].name) == 0)
+            found++;
+    if (found == 0 || thread_count < 1 || thread_count > MAX_THREADS
+            || iterations < 1) {
+        fprintf (stderr, "Usage: %s [lock [threads [iterations]]]"
+            " (1 to %d threads)\nlock is all", argv[0], MAX_THREADS);
+        for (count = 0; lock_ops[count].name != NULL; count++)
+            fprintf (stderr, ", %s", lock_ops[count].name);
+        fprintf (stderr, "\n");
+        return 1;
+    }
+
+#ifdef sun
+    /*
+     * On Solaris 2.5, threads are not timesliced. To ensure
+     * that our threads can run concurrently, we need to
+     * increase the concurrency level.
+     */
+    DPRINTF (("Setting concurrency level to %d\n", thread_count));
+    thr_setconcurrency (thread_count);
+#endif
+
+    for (ops = lock_ops; ops->name != NULL; ops++)
+        if (strcmp (name, "all") == 0 || strcmp (name, ops->name) == 0)
+            run ();
+    return 0;
+}
@@ -0,0 +1,424 @@
+/*
+ * rcu.c
+ *
+ * This file implements the "RCU" domain, using epoch-based
+ * reclamation.
+ *
+ * The domain has an epoch number, which only grows (and starts at
+ * 1, since 0 in a thread's slot means that it isn't reading). A
+ * reader stores the epoch it finds in its slot, and then issues a
+ * full (sequentially consistent) fence before it follows any
+ * pointers; when it's done, it stores 0. Nothing else is shared, so
+ * readers on different processors never touch each other's cache
+ * lines, or the domain's, except to read the epoch.
+ *
+ * The epoch may only be advanced (always with the mutex locked) by
+ * one when no reader has announced an older epoch: that is, when
+ * every slot holds either 0 or the current epoch. Before it checks
+ * the slots, rcu_advance() issues a full fence of its own. Either a
+ * reader's fence came first, in which case the check sees its
+ * announcement (or a later one), or rcu_advance()'s did, in which
+ * case the reader will see every pointer switched before the
+ * mutex was locked.
+ *
+ * So suppose a writer switches a pointer, and then (with the mutex
+ * locked) queues a function with rcu_call(), tagging it with the
+ * current epoch, E. A reader that might still see the old pointer
+ * must have announced E or earlier (if it announced E+1, it read
+ * the epoch after the advance to E+1, and so sees the switch), and
+ * will have been seen by both of the advances from E to E+1 and
+ * from E+1 to E+2; and the second can't happen until every slot
+ * holds 0 or E+1. Once the epoch reaches E+2, then, no reader can
+ * still be using the old pointer, and the function can run.
+ *
+ * Functions queued with rcu_call() are run by the domain's
+ * reclaimer thread, in the order they were queued, with the mutex
+ * unlocked. The reclaimer sleeps on the "work" condition variable
+ * while nothing is queued. When it can't advance the epoch because
+ * of a slow reader, it backs off: a few sched_yield() calls, and
+ * then sleeps that double from a microsecond to a millisecond.
+ * rcu_synchronize() advances the epoch itself, backing off the same
+ * way.
+ *
+ * Slots are allocated by a thread's first rcu_read_lock(), and
+ * found again through thread-specific data. When a thread
+ * terminates, the key's destructor marks its slot free, and the
+ * next thread to register takes it over, so a domain never has more
+ * slots than it's had readers at once.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "errors.h"
+#include "rcu.h"
+
+#define RCU_YIELDS      4               /* yields before sleeping */
+#define RCU_MAX_SHIFT   10              /* sleep at most 1000 << 10 ns */
+
+/*
+ * Wait a while before trying again to advance the epoch, longer
+ * each time: "tries" counts the attempts since the last success.
+ */
+static void rcu_backoff (int *tries)
+{
+    struct timespec delay;
+    int shift;
+
+    if (*tries < RCU_YIELDS) {
+        (*tries)++;
+        sched_yield ();
+        return;
+    }
+    shift = *tries - RCU_YIELDS;
+    if (shift < RCU_MAX_SHIFT)
+        (*tries)++;
+    else
+        shift = RCU_MAX_SHIFT;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 1000L << shift;
+    nanosleep (&delay, NULL);
+}
+
+/*
+ * Thread-specific data destructor: when a thread terminates, free
+ * its slot for another thread. (If it terminated in a read-side
+ * critical section, that ends it.)
+ */
+static void rcu_slot_release (void *arg)
+{
+    rcu_slot_t *slot = (rcu_slot_t*)arg;
+
+    slot->nesting = 0;
+    atomic_store_explicit (&slot->epoch, 0, memory_order_release);
+    atomic_store_explicit (&slot->in_use, 0, memory_order_release);
+}
+
+/*
+ * Find a slot for the calling thread, the first time it reads:
+ * take over one whose thread has terminated, or allocate a new one.
+ */
+static int rcu_register (rcu_t *rcu, rcu_slot_t **slotp)
+{
+    rcu_slot_t *slot;
+    void *memory;
+    int status, status1;
+
+    status = pthread_mutex_lock (&rcu->mutex);
+    if (status != 0)
+        return status;
+    for (slot = rcu->slots; slot != NULL; slot = slot->next)
+        if (atomic_load_explicit (&slot->in_use, memory_order_acquire) == 0)
+            break;
+    if (slot == NULL) {
+        status = posix_memalign (&memory, RCU_CACHE_LINE, sizeof (rcu_slot_t));
+        if (status != 0) {
+            pthread_mutex_unlock (&rcu->mutex);
+            return status;
+        }
+        slot = (rcu_slot_t*)memory;
+        atomic_init (&slot->epoch, 0);
+        atomic_init (&slot->in_use, 0);
+        slot->next = rcu->slots;
+        rcu->slots = slot;
+    }
+    slot->nesting = 0;
+    status = pthread_setspecific (rcu->key, slot);
+    if (status == 0)
+        atomic_store_explicit (&slot->in_use, 1, memory_order_relaxed);
+    status1 = pthread_mutex_unlock (&rcu->mutex);
+    if (status == 0)
+        status = status1;
+    *slotp = slot;
+    return status;
+}
+
+/*
+ * Advance the epoch by one, if no reader has announced an older
+ * one; return 1 if it was advanced. The caller must have the mutex
+ * locked.
+ */
+static int rcu_advance (rcu_t *rcu)
+{
+    rcu_slot_t *slot;
+    unsigned long epoch, announced;
+
+    epoch = atomic_load_explicit (&rcu->epoch, memory_order_relaxed);
+    atomic_thread_fence (memory_order_seq_cst);
+    for (slot = rcu->slots; slot != NULL; slot = slot->next) {
+        announced = atomic_load_explicit (&slot->epoch, memory_order_acquire);
+        if (announced != 0 && announced != epoch)
+            return 0;
+    }
+    atomic_store_explicit (&rcu->epoch, epoch + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Remove, and return, the functions whose grace period has ended.
+ * The caller must have the mutex locked.
+ */
+static rcu_head_t *rcu_ready (rcu_t *rcu)
+{
+    rcu_head_t *ready, **last;
+    unsigned long epoch;
+
+    epoch = atomic_load_explicit (&rcu->epoch, memory_order_relaxed);
+    ready = rcu->first;
+    last = &ready;
+    while (*last != NULL && (*last)->epoch + 2 <= epoch)
+        last = &(*last)->next;
+    rcu->first = *last;
+    if (rcu->first == NULL)
+        rcu->last = NULL;
+    *last = NULL;
+    return ready;
+}
+
+/*
+ * Call a list of functions, in order. (Each may free the
+ * rcu_head_t it was queued with, so find the next one first.)
+ */
+static void rcu_run (rcu_head_t *head)
+{
+    rcu_head_t *next;
+
+    while (head != NULL) {
+        next = head->next;
+        head->func (head->arg);
+        head = next;
+    }
+}
+
+/*
+ * Thread start routine for the reclaimer: advance the epoch while
+ * any functions are queued, and call them as their grace periods
+ * end. When told to stop, finish those already queued first.
+ */
+static void *rcu_reclaimer (void *arg)
+{
+    rcu_t *rcu = (rcu_t*)arg;
+    rcu_head_t *ready;
+    int advanced, tries = 0, status;
+
+    status = pthread_mutex_lock (&rcu->mutex);
+    if (status != 0)
+        return NULL;
+    while (1) {
+        while (rcu->first == NULL && !rcu->stop) {
+            status = pthread_cond_wait (&rcu->work, &rcu->mutex);
+            if (status != 0) {
+                pthread_mutex_unlock (&rcu->mutex);
+                return NULL;
+            }
+        }
+        if (rcu->first == NULL)
+            break;
+        advanced = rcu_advance (rcu);
+        ready = rcu_ready (rcu);
+        pthread_mutex_unlock (&rcu->mutex);
+        if (ready != NULL) {
+            rcu_run (ready);
+            tries = 0;
+        } else if (!advanced)
+            rcu_backoff (&tries);
+        status = pthread_mutex_lock (&rcu->mutex);
+        if (status != 0)
+            return NULL;
+    }
+    pthread_mutex_unlock (&rcu->mutex);
+    return NULL;
+}
+
+/*
+ * Initialize an RCU domain, and start its reclaimer thread.
+ */
+int rcu_init (rcu_t *rcu)
+{
+    int status;
+
+    atomic_init (&rcu->epoch, 1);
+    rcu->stop = 0;
+    rcu->slots = NULL;
+    rcu->first = rcu->last = NULL;
+    status = pthread_mutex_init (&rcu->mutex, NULL);
+    if (status != 0)
+        return status;
+    status = pthread_cond_init (&rcu->work, NULL);
+    if (status != 0) {
+        pthread_mutex_destroy (&rcu->mutex);
+        return status;
+    }
+    status = pthread_key_create (&rcu->key, rcu_slot_release);
+    if (status != 0) {
+        pthread_cond_destroy (&rcu->work);
+        pthread_mutex_destroy (&rcu->mutex);
+        return status;
+    }
+    status = pthread_create (&rcu->reclaimer, NULL, rcu_reclaimer, rcu);
+    if (status != 0) {
+        pthread_key_delete (rcu->key);
+        pthread_cond_destroy (&rcu->work);
+        pthread_mutex_destroy (&rcu->mutex);
+        return status;
+    }
+    rcu->valid = RCU_VALID;
+    return 0;
+}
+
+/*
+ * Destroy an RCU domain: wait for the reclaimer to call every
+ * function still queued, and free the slots. Report "BUSY" if any
+ * thread is reading.
+ */
+int rcu_destroy (rcu_t *rcu)
+{
+    rcu_slot_t *slot;
+    int status, status1;
+
+    if (rcu->valid != RCU_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&rcu->mutex);
+    if (status != 0)
+        return status;
+    for (slot = rcu->slots; slot != NULL; slot = slot->next) {
+        if (atomic_load_explicit (&slot->epoch, memory_order_acquire) != 0) {
+            pthread_mutex_unlock (&rcu->mutex);
+            return EBUSY;
+        }
+    }
+    rcu->valid = 0;
+    rcu->stop = 1;
+    status = pthread_cond_signal (&rcu->work);
+    if (status != 0) {
+        pthread_mutex_unlock (&rcu->mutex);
+        return status;
+    }
+    status = pthread_mutex_unlock (&rcu->mutex);
+    if (status != 0)
+        return status;
+    status = pthread_join (rcu->reclaimer, NULL);
+    if (status != 0)
+        return status;
+
+    /*
+     * Delete the key first, so that no thread's destructor will
+     * touch a slot after it's freed.
+     */
+    pthread_key_delete (rcu->key);
+    while (rcu->slots != NULL) {
+        slot = rcu->slots;
+        rcu->slots = slot->next;
+        free (slot);
+    }
+    status = pthread_mutex_destroy (&rcu->mutex);
+    status1 = pthread_cond_destroy (&rcu->work);
+    return (status != 0 ? status : status1);
+}
+
+/*
+ * Begin a read-side critical section: announce the epoch the
+ * calling thread is reading in (unless it's already reading).
+ */
+int rcu_read_lock (rcu_t *rcu)
+{
+    rcu_slot_t *slot;
+    unsigned long epoch;
+    int status;
+
+    if (rcu->valid != RCU_VALID)
+        return EINVAL;
+    slot = (rcu_slot_t*)pthread_getspecific (rcu->key);
+    if (slot == NULL) {
+        status = rcu_register (rcu, &slot);
+        if (status != 0)
+            return status;
+    }
+    if (slot->nesting++ == 0) {
+        epoch = atomic_load_explicit (&rcu->epoch, memory_order_acquire);
+        atomic_store_explicit (&slot->epoch, epoch, memory_order_relaxed);
+        atomic_thread_fence (memory_order_seq_cst);
+    }
+    return 0;
+}
+
+/*
+ * End a read-side critical section. Once the outermost one ends,
+ * the calling thread mustn't use anything it found inside.
+ */
+int rcu_read_unlock (rcu_t *rcu)
+{
+    rcu_slot_t *slot;
+
+    if (rcu->valid != RCU_VALID)
+        return EINVAL;
+    slot = (rcu_slot_t*)pthread_getspecific (rcu->key);
+    if (slot == NULL || slot->nesting == 0)
+        return EPERM;
+    if (--slot->nesting == 0)
+        atomic_store_explicit (&slot->epoch, 0, memory_order_release);
+    return 0;
+}
+
+/*
+ * Wait for a grace period: until every thread that was in a
+ * read-side critical section when this was called has left it. A
+ * thread that's reading would wait for itself, so report
+ * "DEADLK" instead.
+ */
+int rcu_synchronize (rcu_t *rcu)
+{
+    rcu_slot_t *slot;
+    unsigned long target;
+    int tries = 0, status;
+
+    if (rcu->valid != RCU_VALID)
+        return EINVAL;
+    slot = (rcu_slot_t*)pthread_getspecific (rcu->key);
+    if (slot != NULL && slot->nesting > 0)
+        return EDEADLK;
+    status = pthread_mutex_lock (&rcu->mutex);
+    if (status != 0)
+        return status;
+    target = atomic_load_explicit (&rcu->epoch, memory_order_relaxed) + 2;
+    while (atomic_load_explicit (&rcu->epoch, memory_order_relaxed) < target) {
+        if (rcu_advance (rcu))
+            continue;
+        status = pthread_mutex_unlock (&rcu->mutex);
+        if (status != 0)
+            return status;
+        rcu_backoff (&tries);
+        status = pthread_mutex_lock (&rcu->mutex);
+        if (status != 0)
+            return status;
+    }
+    return pthread_mutex_unlock (&rcu->mutex);
+}
+
+/*
+ * Arrange for "func" to be called with "arg", by the reclaimer,
+ * after a grace period. The caller must already have made whatever
+ * "func" will free unreachable by readers.
+ */
+int rcu_call (
+    rcu_t *rcu, rcu_head_t *head, void (*func)(void *arg), void *arg)
+{
+    int status, status1 = 0;
+
+    if (rcu->valid != RCU_VALID)
+        return EINVAL;
+    head->next = NULL;
+    head->func = func;
+    head->arg = arg;
+    status = pthread_mutex_lock (&rcu->mutex);
+    if (status != 0)
+        return status;
+    head->epoch = atomic_load_explicit (&rcu->epoch, memory_order_relaxed);
+    if (rcu->last == NULL) {
+        rcu->first = head;
+        status1 = pthread_cond_signal (&rcu->work);
+    } else
+        rcu->last->next = head;
+    rcu->last = head;
+    status = pthread_mutex_unlock (&rcu->mutex);
+    return (status1 != 0 ? status1 : status);
+}
@@ -0,0 +1,104 @@
+/*
+ * rcu.h
+ *
+ * This header file describes an "RCU" (read-copy-update) domain,
+ * using epoch-based reclamation: a way for threads to read shared,
+ * pointer-linked data without locking anything, while other
+ * threads change it. The type rcu_t describes the full state of the
+ * domain including the POSIX 1003.1c synchronization objects
+ * necessary.
+ *
+ * A reader brackets its use of the data with rcu_read_lock() and
+ * rcu_read_unlock(), which don't wait, or write to anything but
+ * the calling thread's own "slot" (a cache line to itself): they
+ * just announce which epoch of the domain the thread is reading in,
+ * or that it isn't reading. Readers may nest. Inside, it follows
+ * pointers with RCU_DEREFERENCE, and may use what it finds until it
+ * calls rcu_read_unlock().
+ *
+ * A writer (which must keep out other writers itself, with a mutex
+ * or a read-write lock) never changes what a reader may be looking
+ * at. Instead, it makes a changed copy, and switches the pointer to
+ * it with RCU_ASSIGN. The old copy can't be freed at once, since
+ * readers may still be using it. rcu_synchronize() waits until every
+ * reader that was reading when it was called has finished (a "grace
+ * period"), after which the old copy can be freed; or rcu_call()
+ * arranges for a function (such as one that frees it) to be called
+ * after a grace period, by the domain's reclaimer thread, and
+ * returns at once.
+ *
+ * The rcu_init() and rcu_destroy() functions, respectively, allow
+ * you to initialize/create and destroy/free the domain. Destroying
+ * a domain runs any functions still waiting for a grace period.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define RCU_CACHE_LINE  64
+
+/*
+ * A thread's announcement of the epoch it's reading in (or 0, if it
+ * isn't reading), padded so that it has a cache line to itself.
+ */
+typedef struct rcu_slot_tag {
+    _Alignas (RCU_CACHE_LINE) atomic_ulong epoch;
+    int                 nesting;        /* read lock depth */
+    atomic_int          in_use;         /* owned by a thread */
+    struct rcu_slot_tag *next;          /* all of the domain's slots */
+} rcu_slot_t;
+
+/*
+ * A function to be called after a grace period, by rcu_call. The
+ * caller provides the storage, usually within the structure that
+ * will be freed, and mustn't touch it again until the function is
+ * called.
+ */
+typedef struct rcu_head_tag {
+    struct rcu_head_tag *next;
+    unsigned long       epoch;          /* epoch when it was queued */
+    void                (*func)(void *arg);
+    void                *arg;
+} rcu_head_t;
+
+/*
+ * Structure describing an RCU domain.
+ */
+typedef struct rcu_tag {
+    atomic_ulong        epoch;          /* current epoch */
+    int                 valid;          /* set when valid */
+    pthread_key_t       key;            /* thread's slot */
+    pthread_mutex_t     mutex;
+    pthread_cond_t      work;           /* wake the reclaimer */
+    pthread_t           reclaimer;
+    int                 stop;           /* reclaimer should exit */
+    rcu_slot_t          *slots;         /* every thread's slot */
+    rcu_head_t          *first, *last;  /* waiting for grace period */
+} rcu_t;
+
+#define RCU_VALID       0x4c0de
+
+/*
+ * Read a pointer (which must be declared _Atomic) that a writer may
+ * switch with RCU_ASSIGN, so that what it points to is seen as the
+ * writer left it.
+ */
+#define RCU_DEREFERENCE(pointer) \
+    atomic_load_explicit (&(pointer), memory_order_acquire)
+
+/*
+ * Switch a pointer (which must be declared _Atomic) to a new copy,
+ * once the copy is complete.
+ */
+#define RCU_ASSIGN(pointer, value) \
+    atomic_store_explicit (&(pointer), (value), memory_order_release)
+
+/*
+ * Define RCU functions
+ */
+extern int rcu_init (rcu_t *rcu);
+extern int rcu_destroy (rcu_t *rcu);
+extern int rcu_read_lock (rcu_t *rcu);
+extern int rcu_read_unlock (rcu_t *rcu);
+extern int rcu_synchronize (rcu_t *rcu);
+extern int rcu_call (
+    rcu_t *rcu, rcu_head_t *head, void (*func)(void *arg), void *arg);
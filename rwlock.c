@@ -20,33 +20,263 @@
  * exclusive write access, and rwl_writeunlock() releases the
  * lock. rwl_writetrylock() attempts to lock a read-write lock
  * for write access, and returns EBUSY instead of blocking.
+ *
+ * The rwl_upgradelock() function locks a read-write lock in upgrade
+ * mode, and rwl_upgradeunlock() releases it; rwl_upgrade() turns
+ * upgrade mode into write access, and rwl_downgrade() turns write
+ * access into read access.
+ *
+ * The lock's state word holds the number of readers (counted in
+ * units of RWL_READER), the RWL_WRITER bit, the RWL_UPGRADER bit
+ * (set while a thread holds the lock in upgrade mode), and the
+ * RWL_WAITING bit, which is set while any thread is waiting. A reader that
+ * finds neither bit set, or a writer that finds the word zero,
+ * takes the lock with a single compare-and-swap, and (unless
+ * RWL_WAITING is set by then) releases it with one more atomic
+ * operation, without touching the mutex.
+ *
+ * A thread that can't take the lock locks the mutex, counts
+ * itself as waiting, and sets RWL_WAITING -- which sends every
+ * later locker to the mutex as well -- before trying again for
+ * the last time and waiting. A thread that releases the lock
+ * while RWL_WAITING is set locks the mutex to wake the waiters.
+ * Since the waiter sets the bit before its last try, and holds
+ * the mutex from then until it waits, either it sees the lock
+ * released or the releaser sees the bit, and can't wake it until
+ * it's waiting. The last waiter to leave clears the bit.
+ *
+ * The lock's policy only matters to threads that reach the mutex.
+ * Under RWL_PREFER_WRITER and RWL_PHASE_FAIR, a reader waits while
+ * any writer is waiting (since a writer that waits has set
+ * RWL_WAITING, no reader can slip past it on the fast path either).
+ * When a writer unlocks, RWL_PREFER_WRITER wakes another writer
+ * if there is one, and RWL_PHASE_FAIR, if readers are waiting,
+ * hands the lock to all of them at once: it adds them to the
+ * reader count itself, before any thread can take the lock, and
+ * advances the "phase" so that each can tell, when it wakes, that
+ * it already holds the lock.
+ *
+ * Before going to the mutex, a thread that can't take the lock
+ * spins, checking the state word (with a "pause" instruction in
+ * between). On a uniprocessor, where the holder can't release the
+ * lock while we spin, threads don't spin at all. (Yielding the
+ * processor instead doesn't help: while a writer yields, it isn't
+ * yet waiting, so readers keep taking the lock in front of it.) The
+ * lock keeps a running average ("spun", scaled by 8) of how many
+ * checks it took threads that got the lock this way, which
+ * follows how long the lock is usually held, and a thread spins
+ * for at most twice that (plus RWL_SPIN_MIN), and never more than
+ * the "spin" attribute: so a lock held for long periods, which
+ * spinning won't get, soon stops spinning. A thread stops spinning
+ * as soon as it sees RWL_WAITING, so that it doesn't pass threads
+ * that are already waiting (and the policy, which only waiting
+ * threads see, still applies).
+ *
+ * A thread in upgrade mode counts as a reader for everyone but
+ * writers and other upgraders, which it keeps out with RWL_UPGRADER.
+ * To upgrade, it swaps RWL_UPGRADER for RWL_WRITER once no readers
+ * remain. If there are readers, it waits as any other waiter does,
+ * setting "upgrading" so that readers which reach the mutex wait for
+ * it whatever the policy (and RWL_WAITING sends all new readers
+ * there), and the last reader to unlock wakes it. So an upgrade waits
+ * only for the readers that held the lock when it began.
+ *
+ * Locks initialized by rwl_init or rwl_init_attr wait on condition
+ * variables that use CLOCK_MONOTONIC, so that the timed lock
+ * functions can use their absolute time as it is; statically
+ * initialized locks use CLOCK_REALTIME, and convert the time.
+ *
+ * With RWL_PROFILE, each thread keeps (in thread-specific data) a
+ * list of the locks it holds and when it locked them, so that it
+ * can tell how long it held each one when it unlocks it, and the
+ * time it began to spin or wait for a lock. Threads add to a lock's
+ * counts with relaxed atomic operations, so profiling a busy lock
+ * adds some contention of its own; without RWL_PROFILE, the
+ * RWL_PROF_ macros that do all this expand to nothing.
  */
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 #include "errors.h"
 #include "rwlock.h"
 
+#define RWL_WRITER      0x1             /* a writer holds the lock */
+#define RWL_WAITING     0x2             /* threads are waiting */
+#define RWL_UPGRADER    0x4             /* an upgrader holds the lock */
+#define RWL_READER      0x8             /* one reader */
+
+#define RWL_SPIN_MIN    16              /* checks, however short holds are */
+
+#if defined (__i386__) || defined (__x86_64__)
+# define RWL_PAUSE()    __builtin_ia32_pause ()
+#else
+# define RWL_PAUSE()    atomic_signal_fence (memory_order_seq_cst)
+#endif
+
+static pthread_once_t rwl_once = PTHREAD_ONCE_INIT;
+static int rwl_uniprocessor;            /* spinning can't help */
+
+#ifdef RWL_PROFILE
+# define RWL_PROF_HELD  16              /* locks a thread can track */
+
+/*
+ * The locks a thread holds (up to RWL_PROF_HELD of them), and when
+ * it began to spin or wait for the one it's locking.
+ */
+typedef struct rwl_held_tag {
+    uint64_t            waiting;        /* when it began to wait */
+    int                 count;
+    struct {
+        rwlock_t        *rwl;
+        int             mode;           /* RWL_PROF_READ, ... */
+        uint64_t        since;          /* when it was locked */
+    } lock[RWL_PROF_HELD];
+} rwl_held_t;
+
+static pthread_key_t rwl_held_key;
+static int rwl_held_status;             /* error creating rwl_held_key */
+static pthread_mutex_t rwl_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rwlock_t *rwl_registry;          /* live locks */
+
+static void rwl_prof_wait (void);
+static void rwl_prof_locked (rwlock_t *rwl, int mode, int contended);
+static void rwl_prof_unlocked (rwlock_t *rwl, int mode);
+static void rwl_prof_destroy (rwlock_t *rwl);
+
+# define RWL_PROF_WAIT()                rwl_prof_wait ()
+# define RWL_PROF_LOCKED(rwl, mode, contended) \
+    rwl_prof_locked ((rwl), (mode), (contended))
+# define RWL_PROF_UNLOCKED(rwl, mode)   rwl_prof_unlocked ((rwl), (mode))
+# define RWL_PROF_DESTROY(rwl)          rwl_prof_destroy (rwl)
+#else
+# define RWL_PROF_WAIT()                ((void)0)
+# define RWL_PROF_LOCKED(rwl, mode, contended) ((void)0)
+# define RWL_PROF_UNLOCKED(rwl, mode)   ((void)0)
+# define RWL_PROF_DESTROY(rwl)          ((void)0)
+#endif
+
+/*
+ * Keep track of a waiting reader, for its cleanup handler.
+ */
+typedef struct rwl_reader_tag {
+    rwlock_t            *rwl;
+    unsigned long       phase;          /* rwl->phase when it began */
+} rwl_reader_t;
+
+/*
+ * Initialize an attributes object to the defaults.
+ */
+int rwl_attr_init (rwl_attr_t *attr)
+{
+    attr->policy = RWL_PREFER_READER;
+    attr->spin = RWL_SPIN_DEFAULT;
+    return 0;
+}
+
+/*
+ * Destroy an attributes object.
+ */
+int rwl_attr_destroy (rwl_attr_t *attr)
+{
+    return 0;
+}
+
+/*
+ * Set the policy for choosing between waiting readers and
+ * writers: RWL_PREFER_READER, RWL_PREFER_WRITER, or
+ * RWL_PHASE_FAIR.
+ */
+int rwl_attr_setpolicy (rwl_attr_t *attr, int policy)
+{
+    if (policy != RWL_PREFER_READER && policy != RWL_PREFER_WRITER
+            && policy != RWL_PHASE_FAIR)
+        return EINVAL;
+    attr->policy = policy;
+    return 0;
+}
+
+int rwl_attr_getpolicy (const rwl_attr_t *attr, int *policy)
+{
+    *policy = attr->policy;
+    return 0;
+}
+
+/*
+ * Set the most times a thread checks the lock before waiting
+ * (0 to wait immediately).
+ */
+int rwl_attr_setspin (rwl_attr_t *attr, int spin)
+{
+    if (spin < 0)
+        return EINVAL;
+    attr->spin = spin;
+    return 0;
+}
+
+int rwl_attr_getspin (const rwl_attr_t *attr, int *spin)
+{
+    *spin = attr->spin;
+    return 0;
+}
+
 /*
  * Initialize a read-write lock
  */
 int rwl_init (rwlock_t *rwl)
 {
+    return rwl_init_attr (rwl, NULL);
+}
+
+/*
+ * Initialize a read-write lock, with optional attributes
+ */
+int rwl_init_attr (rwlock_t *rwl, const rwl_attr_t *attr)
+{
+    pthread_condattr_t cvattr;
     int status;
 
-    rwl->r_active = 0;
-    rwl->r_wait = rwl->w_wait = 0;
-    rwl->w_active = 0;
-    status = pthread_mutex_init (&rwl->mutex, NULL);
+    atomic_init (&rwl->state, 0);
+    rwl->r_wait = rwl->w_wait = rwl->u_wait = 0;
+    rwl->upgrading = 0;
+    rwl->policy = (attr != NULL ? attr->policy : RWL_PREFER_READER);
+    rwl->phase = 0;
+    rwl->spin = (attr != NULL ? attr->spin : RWL_SPIN_DEFAULT);
+    atomic_init (&rwl->spun, 0);
+#ifdef RWL_PROFILE
+    memset (rwl->prof, 0, sizeof (rwl->prof));
+    rwl->name = NULL;
+    atomic_init (&rwl->registered, 0);
+#endif
+    status = pthread_condattr_init (&cvattr);
     if (status != 0)
         return status;
-    status = pthread_cond_init (&rwl->read, NULL);
+    rwl->monotonic =
+        (pthread_condattr_setclock (&cvattr, CLOCK_MONOTONIC) == 0);
+    status = pthread_mutex_init (&rwl->mutex, NULL);
+    if (status != 0) {
+        pthread_condattr_destroy (&cvattr);
+        return status;
+    }
+    status = pthread_cond_init (&rwl->read, &cvattr);
     if (status != 0) {
         /* if unable to create read CV, destroy mutex */
+        pthread_condattr_destroy (&cvattr);
         pthread_mutex_destroy (&rwl->mutex);
         return status;
     }
-    status = pthread_cond_init (&rwl->write, NULL);
+    status = pthread_cond_init (&rwl->write, &cvattr);
     if (status != 0) {
         /* if unable to create write CV, destroy read CV and mutex */
+        pthread_condattr_destroy (&cvattr);
+        pthread_cond_destroy (&rwl->read);
+        pthread_mutex_destroy (&rwl->mutex);
+        return status;
+    }
+    status = pthread_cond_init (&rwl->upgrade, &cvattr);
+    pthread_condattr_destroy (&cvattr);
+    if (status != 0) {
+        /* if unable to create upgrade CV, destroy the rest */
+        pthread_cond_destroy (&rwl->write);
         pthread_cond_destroy (&rwl->read);
         pthread_mutex_destroy (&rwl->mutex);
         return status;
@@ -60,7 +290,7 @@ int rwl_init (rwlock_t *rwl)
  */
 int rwl_destroy (rwlock_t *rwl)
 {
-    int status, status1, status2;
+    int status, status1, status2, status3;
 
     if (rwl->valid != RWLOCK_VALID)
         return EINVAL;
@@ -72,7 +302,7 @@ int rwl_destroy (rwlock_t *rwl)
      * Check whether any threads own the lock; report "BUSY" if
      * so.
      */
-    if (rwl->r_active > 0 || rwl->w_active) {
+    if (atomic_load (&rwl->state) & ~RWL_WAITING) {
         pthread_mutex_unlock (&rwl->mutex);
         return EBUSY;
     }
@@ -81,11 +311,12 @@ int rwl_destroy (rwlock_t *rwl)
      * Check whether any threads are known to be waiting; report
      * EBUSY if so.
      */
-    if (rwl->r_wait != 0 || rwl->w_wait != 0) {
+    if (rwl->r_wait != 0 || rwl->w_wait != 0 || rwl->u_wait != 0) {
         pthread_mutex_unlock (&rwl->mutex);
         return EBUSY;
     }
 
+    RWL_PROF_DESTROY (rwl);
     rwl->valid = 0;
     status = pthread_mutex_unlock (&rwl->mutex);
     if (status != 0)
@@ -93,72 +324,321 @@ int rwl_destroy (rwlock_t *rwl)
     status = pthread_mutex_destroy (&rwl->mutex);
     status1 = pthread_cond_destroy (&rwl->read);
     status2 = pthread_cond_destroy (&rwl->write);
-    return (status == 0 ? status : (status1 == 0 ? status1 : status2));
+    status3 = pthread_cond_destroy (&rwl->upgrade);
+    if (status == 0)
+        status = status1;
+    if (status == 0)
+        status = status2;
+    return (status == 0 ? status3 : status);
+}
+
+/*
+ * Count a thread as waiting (r_wait, w_wait or u_wait has just been
+ * incremented). Called with the mutex locked.
+ */
+static void rwl_waiting (rwlock_t *rwl)
+{
+    atomic_fetch_or (&rwl->state, RWL_WAITING);
+}
+
+/*
+ * A thread has stopped waiting (r_wait, w_wait or u_wait has just
+ * been decremented); if it was the last, let lockers and unlockers
+ * use the fast paths again. Called with the mutex locked.
+ */
+static void rwl_waited (rwlock_t *rwl)
+{
+    if (rwl->r_wait == 0 && rwl->w_wait == 0 && rwl->u_wait == 0)
+        atomic_fetch_and (&rwl->state, ~RWL_WAITING);
+}
+
+/*
+ * One-time initialization routine that finds whether there's
+ * more than one processor to spin on.
+ */
+static void rwl_once_init (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    rwl_uniprocessor = (sysconf (_SC_NPROCESSORS_ONLN) == 1);
+#endif
+#ifdef RWL_PROFILE
+    rwl_held_status = pthread_key_create (&rwl_held_key, free);
+#endif
+}
+
+/*
+ * Spin until no thread holds any of the "busy" bits, and then add
+ * "add" to the state word, returning 1; or give up, returning 0,
+ * after as many checks as recent holds suggest are worthwhile, or
+ * as soon as another thread is waiting.
+ */
+static int rwl_spin (rwlock_t *rwl, unsigned int busy, unsigned int add)
+{
+    unsigned int state;
+    int spun, limit, check;
+
+    if (rwl->spin <= 0)
+        return 0;
+    pthread_once (&rwl_once, rwl_once_init);
+    if (rwl_uniprocessor)
+        return 0;
+    spun = atomic_load_explicit (&rwl->spun, memory_order_relaxed);
+    limit = spun / 4 + RWL_SPIN_MIN;
+    if (limit > rwl->spin)
+        limit = rwl->spin;
+    for (check = 0; check < limit; check++) {
+        RWL_PAUSE ();
+        state = atomic_load_explicit (&rwl->state, memory_order_relaxed);
+        if (state & RWL_WAITING)
+            break;
+        if (!(state & busy) && atomic_compare_exchange_weak (
+                &rwl->state, &state, state + add)) {
+            atomic_store_explicit (
+                &rwl->spun, spun + check - spun / 8, memory_order_relaxed);
+            return 1;
+        }
+    }
+    atomic_store_explicit (
+        &rwl->spun, spun - spun / 8, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Wait on one of the condition variables, with the mutex locked,
+ * until it's signalled, or (if "abstime" isn't NULL) until the
+ * time "abstime", measured by CLOCK_MONOTONIC.
+ */
+static int rwl_condwait (
+    rwlock_t *rwl, pthread_cond_t *cond, const struct timespec *abstime)
+{
+    struct timespec now, realtime;
+
+    if (abstime == NULL)
+        return pthread_cond_wait (cond, &rwl->mutex);
+    if (rwl->monotonic)
+        return pthread_cond_timedwait (cond, &rwl->mutex, abstime);
+
+    /*
+     * The condition variable uses CLOCK_REALTIME: wait until the
+     * same distance from now by that clock.
+     */
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    clock_gettime (CLOCK_REALTIME, &realtime);
+    realtime.tv_sec += abstime->tv_sec - now.tv_sec;
+    realtime.tv_nsec += abstime->tv_nsec - now.tv_nsec;
+    if (realtime.tv_nsec < 0) {
+        realtime.tv_sec--;
+        realtime.tv_nsec += 1000000000;
+    } else if (realtime.tv_nsec >= 1000000000) {
+        realtime.tv_sec++;
+        realtime.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait (cond, &rwl->mutex, &realtime);
+}
+
+/*
+ * Try to add a reader, if no writer holds the lock.
+ */
+static int rwl_readtry (rwlock_t *rwl)
+{
+    unsigned int state = atomic_load (&rwl->state);
+
+    while (!(state & RWL_WRITER))
+        if (atomic_compare_exchange_weak (
+                &rwl->state, &state, state + RWL_READER))
+            return 1;
+    return 0;
+}
+
+/*
+ * Decide whether a waiting reader may try for the lock (which it
+ * may not while an upgrader waits for readers to leave, nor, except
+ * under RWL_PREFER_READER, while writers wait), and if so, try.
+ * Called with the mutex locked.
+ */
+static int rwl_readadmit (rwlock_t *rwl)
+{
+    if (rwl->upgrading)
+        return 0;
+    if (rwl->policy != RWL_PREFER_READER && rwl->w_wait > 0)
+        return 0;
+    return rwl_readtry (rwl);
+}
+
+/*
+ * Return nonzero if a writer has handed the lock to a waiting
+ * reader (under RWL_PHASE_FAIR) since the reader began to wait.
+ * Called with the mutex locked.
+ */
+static int rwl_readgranted (rwl_reader_t *reader)
+{
+    return (reader->rwl->policy == RWL_PHASE_FAIR
+        && reader->rwl->phase != reader->phase);
+}
+
+/*
+ * Try to take the lock for a writer, if no other thread holds it.
+ */
+static int rwl_writetry (rwlock_t *rwl)
+{
+    unsigned int state = atomic_load (&rwl->state);
+
+    while (!(state & ~RWL_WAITING))
+        if (atomic_compare_exchange_weak (
+                &rwl->state, &state, state | RWL_WRITER))
+            return 1;
+    return 0;
+}
+
+/*
+ * The last reader has just unlocked, leaving "state", with
+ * RWL_WAITING set: wake an upgrader waiting for readers to leave,
+ * or else a waiting writer, if no upgrader holds the lock. Called
+ * with the mutex locked.
+ */
+static int rwl_readgone (rwlock_t *rwl, unsigned int state)
+{
+    if (rwl->upgrading)
+        return pthread_cond_broadcast (&rwl->upgrade);
+    if (!(state & RWL_UPGRADER) && rwl->w_wait > 0)
+        return pthread_cond_signal (&rwl->write);
+    return 0;
 }
 
 /*
  * Handle cleanup when the read lock condition variable
  * wait is cancelled.
  *
- * Simply record that the thread is no longer waiting,
- * and unlock the mutex.
+ * Record that the thread is no longer waiting, give up the
+ * lock if a writer had already handed it over, and unlock the
+ * mutex.
  */
 static void rwl_readcleanup (void *arg)
 {
-    rwlock_t    *rwl = (rwlock_t *)arg;
+    rwl_reader_t *reader = (rwl_reader_t *)arg;
+    rwlock_t    *rwl = reader->rwl;
+    unsigned int state;
 
     rwl->r_wait--;
+    if (rwl_readgranted (reader)) {
+        state = atomic_fetch_sub (&rwl->state, RWL_READER) - RWL_READER;
+        if ((state & ~RWL_UPGRADER) == RWL_WAITING)
+            rwl_readgone (rwl, state);
+    }
+    rwl_waited (rwl);
     pthread_mutex_unlock (&rwl->mutex);
 }
 
 /*
- * Lock a read-write lock for read access.
+ * Wait to lock a read-write lock for read access, until "abstime"
+ * if it isn't NULL. (This is kept out of rwl_readlock, so that the
+ * fast path doesn't pay to set up the cleanup handler.)
  */
-int rwl_readlock (rwlock_t *rwl)
+static int rwl_readwait (rwlock_t *rwl, const struct timespec *abstime)
 {
+    rwl_reader_t reader;
     int status;
 
-    if (rwl->valid != RWLOCK_VALID)
-        return EINVAL;
     status = pthread_mutex_lock (&rwl->mutex);
     if (status != 0)
         return status;
-    if (rwl->w_active) {
-        rwl->r_wait++;
-        pthread_cleanup_push (rwl_readcleanup, (void*)rwl);
-        while (rwl->w_active) {
-            status = pthread_cond_wait (&rwl->read, &rwl->mutex);
-            if (status != 0)
-                break;
+    reader.rwl = rwl;
+    reader.phase = rwl->phase;
+    rwl->r_wait++;
+    rwl_waiting (rwl);
+    pthread_cleanup_push (rwl_readcleanup, (void*)&reader);
+    while (!rwl_readadmit (rwl)) {
+        status = rwl_condwait (rwl, &rwl->read, abstime);
+        if (rwl_readgranted (&reader)) {
+            status = 0;
+            break;
         }
-        pthread_cleanup_pop (0);
-        rwl->r_wait--;
+        if (status != 0)
+            break;
     }
-    if (status == 0)
-        rwl->r_active++;
+    pthread_cleanup_pop (0);
+    rwl->r_wait--;
+    rwl_waited (rwl);
     pthread_mutex_unlock (&rwl->mutex);
     return status;
 }
 
+/*
+ * Lock a read-write lock for read access, waiting until "abstime"
+ * if it isn't NULL.
+ */
+static int rwl_read (rwlock_t *rwl, const struct timespec *abstime)
+{
+    unsigned int state;
+    int status = 0;
+
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+
+    /*
+     * If no writer holds the lock, and no thread is waiting,
+     * just count another reader.
+     */
+    state = atomic_load (&rwl->state);
+    while (!(state & (RWL_WRITER | RWL_WAITING)))
+        if (atomic_compare_exchange_weak (
+                &rwl->state, &state, state + RWL_READER)) {
+            RWL_PROF_LOCKED (rwl, RWL_PROF_READ, 0);
+            return 0;
+        }
+    RWL_PROF_WAIT ();
+    if (!rwl_spin (rwl, RWL_WRITER, RWL_READER))
+        status = rwl_readwait (rwl, abstime);
+    if (status == 0)
+        RWL_PROF_LOCKED (rwl, RWL_PROF_READ, 1);
+    return status;
+}
+
+/*
+ * Lock a read-write lock for read access.
+ */
+int rwl_readlock (rwlock_t *rwl)
+{
+    return rwl_read (rwl, NULL);
+}
+
+/*
+ * Lock a read-write lock for read access, giving up at the
+ * absolute time "abstime", measured by CLOCK_MONOTONIC.
+ */
+int rwl_readtimedlock (rwlock_t *rwl, const struct timespec *abstime)
+{
+    return rwl_read (rwl, abstime);
+}
+
 /*
  * Attempt to lock a read-write lock for read access (don't
  * block if unavailable).
  */
 int rwl_readtrylock (rwlock_t *rwl)
 {
-    int status, status2;
+    unsigned int state;
 
     if (rwl->valid != RWLOCK_VALID)
         return EINVAL;
-    status = pthread_mutex_lock (&rwl->mutex);
-    if (status != 0)
-        return status;
-    if (rwl->w_active)
-        status = EBUSY;
-    else
-        rwl->r_active++;
-    status2 = pthread_mutex_unlock (&rwl->mutex);
-    return (status2 != 0 ? status2 : status);
+
+    /*
+     * Unless readers are preferred, don't pass a waiting writer;
+     * and never pass an upgrader waiting for readers to leave.
+     * (Without the mutex, it's not known which threads are
+     * waiting, so don't pass any waiter.)
+     */
+    state = atomic_load (&rwl->state);
+    if (rwl->policy != RWL_PREFER_READER
+            && (state & (RWL_WRITER | RWL_WAITING)))
+        return EBUSY;
+    if ((state & (RWL_UPGRADER | RWL_WAITING))
+            == (RWL_UPGRADER | RWL_WAITING))
+        return EBUSY;
+    if (!rwl_readtry (rwl))
+        return EBUSY;
+    RWL_PROF_LOCKED (rwl, RWL_PROF_READ, 0);
+    return 0;
 }
 
 /*
@@ -166,20 +646,58 @@ int rwl_readtrylock (rwlock_t *rwl)
  */
 int rwl_readunlock (rwlock_t *rwl)
 {
-    int status, status2;
+    unsigned int state;
+    int status = 0, status2;
 
     if (rwl->valid != RWLOCK_VALID)
         return EINVAL;
+    RWL_PROF_UNLOCKED (rwl, RWL_PROF_READ);
+    state = atomic_fetch_sub (&rwl->state, RWL_READER) - RWL_READER;
+
+    /*
+     * If that was the last reader, and threads are waiting, an
+     * upgrader or a writer may be able to go.
+     */
+    if ((state & ~RWL_UPGRADER) != RWL_WAITING)
+        return 0;
     status = pthread_mutex_lock (&rwl->mutex);
     if (status != 0)
         return status;
-    rwl->r_active--;
-    if (rwl->r_active == 0 && rwl->w_wait > 0)
-        status = pthread_cond_signal (&rwl->write);
+    status = rwl_readgone (rwl, state);
     status2 = pthread_mutex_unlock (&rwl->mutex);
     return (status2 == 0 ? status : status2);
 }
 
+/*
+ * Wake the waiting readers, and the threads waiting for upgrade
+ * mode. Called with the mutex locked.
+ */
+static int rwl_wakereaders (rwlock_t *rwl)
+{
+    int status = 0;
+
+    if (rwl->r_wait > 0)
+        status = pthread_cond_broadcast (&rwl->read);
+    if (status == 0 && rwl->u_wait > 0)
+        status = pthread_cond_broadcast (&rwl->upgrade);
+    return status;
+}
+
+/*
+ * A writer has stopped waiting without the lock (w_wait has just
+ * been decremented). Since a writer that times out may have taken a
+ * signal meant for another, pass it on if there are other writers;
+ * and if it was the last, readers that were waiting for it to go
+ * first needn't wait any longer. Called with the mutex locked.
+ */
+static void rwl_writegone (rwlock_t *rwl)
+{
+    if (rwl->w_wait > 0)
+        pthread_cond_signal (&rwl->write);
+    else if (rwl->policy != RWL_PREFER_READER)
+        rwl_wakereaders (rwl);
+}
+
 /*
  * Handle cleanup when the write lock condition variable
  * wait is cancelled.
@@ -192,57 +710,91 @@ static void rwl_writecleanup (void *arg)
     rwlock_t *rwl = (rwlock_t *)arg;
 
     rwl->w_wait--;
+    rwl_writegone (rwl);
+    rwl_waited (rwl);
     pthread_mutex_unlock (&rwl->mutex);
 }
 
 /*
- * Lock a read-write lock for write access.
+ * Wait to lock a read-write lock for write access, until "abstime"
+ * if it isn't NULL.
  */
-int rwl_writelock (rwlock_t *rwl)
+static int rwl_writewait (rwlock_t *rwl, const struct timespec *abstime)
 {
     int status;
 
-    if (rwl->valid != RWLOCK_VALID)
-        return EINVAL;
     status = pthread_mutex_lock (&rwl->mutex);
     if (status != 0)
         return status;
-    if (rwl->w_active || rwl->r_active > 0) {
-        rwl->w_wait++;
-        pthread_cleanup_push (rwl_writecleanup, (void*)rwl);
-        while (rwl->w_active || rwl->r_active > 0) {
-            status = pthread_cond_wait (&rwl->write, &rwl->mutex);
-            if (status != 0)
-                break;
-        }
-        pthread_cleanup_pop (0);
-        rwl->w_wait--;
+    rwl->w_wait++;
+    rwl_waiting (rwl);
+    pthread_cleanup_push (rwl_writecleanup, (void*)rwl);
+    while (!rwl_writetry (rwl)) {
+        status = rwl_condwait (rwl, &rwl->write, abstime);
+        if (status != 0)
+            break;
     }
-    if (status == 0)
-        rwl->w_active = 1;
+    pthread_cleanup_pop (0);
+    rwl->w_wait--;
+    if (status != 0)
+        rwl_writegone (rwl);
+    rwl_waited (rwl);
     pthread_mutex_unlock (&rwl->mutex);
     return status;
 }
 
+/*
+ * Lock a read-write lock for write access, waiting until "abstime"
+ * if it isn't NULL.
+ */
+static int rwl_write (rwlock_t *rwl, const struct timespec *abstime)
+{
+    unsigned int state = 0;
+    int status = 0;
+
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+    if (atomic_compare_exchange_strong (&rwl->state, &state, RWL_WRITER)) {
+        RWL_PROF_LOCKED (rwl, RWL_PROF_WRITE, 0);
+        return 0;
+    }
+    RWL_PROF_WAIT ();
+    if (!rwl_spin (rwl, ~0u, RWL_WRITER))
+        status = rwl_writewait (rwl, abstime);
+    if (status == 0)
+        RWL_PROF_LOCKED (rwl, RWL_PROF_WRITE, 1);
+    return status;
+}
+
+/*
+ * Lock a read-write lock for write access.
+ */
+int rwl_writelock (rwlock_t *rwl)
+{
+    return rwl_write (rwl, NULL);
+}
+
+/*
+ * Lock a read-write lock for write access, giving up at the
+ * absolute time "abstime", measured by CLOCK_MONOTONIC.
+ */
+int rwl_writetimedlock (rwlock_t *rwl, const struct timespec *abstime)
+{
+    return rwl_write (rwl, abstime);
+}
+
 /*
  * Attempt to lock a read-write lock for write access. Don't
  * block if unavailable.
  */
 int rwl_writetrylock (rwlock_t *rwl)
 {
-    int status, status2;
-
     if (rwl->valid != RWLOCK_VALID)
         return EINVAL;
-    status = pthread_mutex_lock (&rwl->mutex);
-    if (status != 0)
-        return status;
-    if (rwl->w_active || rwl->r_active > 0)
-        status = EBUSY;
-    else
-        rwl->w_active = 1;
-    status2 = pthread_mutex_unlock (&rwl->mutex);
-    return (status != 0 ? status : status2);
+    if (!rwl_writetry (rwl))
+        return EBUSY;
+    RWL_PROF_LOCKED (rwl, RWL_PROF_WRITE, 0);
+    return 0;
 }
 
 /*
@@ -250,16 +802,47 @@ int rwl_writetrylock (rwlock_t *rwl)
  */
 int rwl_writeunlock (rwlock_t *rwl)
 {
+    unsigned int state = RWL_WRITER;
     int status;
 
     if (rwl->valid != RWLOCK_VALID)
         return EINVAL;
+    RWL_PROF_UNLOCKED (rwl, RWL_PROF_WRITE);
+    if (atomic_compare_exchange_strong (&rwl->state, &state, 0))
+        return 0;
+
+    /*
+     * Threads are waiting. Under RWL_PHASE_FAIR, waiting readers
+     * get the lock together (adding them to the count and clearing
+     * RWL_WRITER in one step, so that no other thread can come
+     * between); under RWL_PREFER_WRITER, a waiting writer goes
+     * first; and otherwise waiting readers (and upgraders) go
+     * first.
+     */
     status = pthread_mutex_lock (&rwl->mutex);
     if (status != 0)
         return status;
-    rwl->w_active = 0;
-    if (rwl->r_wait > 0) {
-        status = pthread_cond_broadcast (&rwl->read);
+    if (rwl->policy == RWL_PHASE_FAIR && rwl->r_wait > 0) {
+        atomic_fetch_add (
+            &rwl->state, rwl->r_wait * RWL_READER - RWL_WRITER);
+        rwl->phase++;
+        status = rwl_wakereaders (rwl);
+        if (status != 0) {
+            pthread_mutex_unlock (&rwl->mutex);
+            return status;
+        }
+        status = pthread_mutex_unlock (&rwl->mutex);
+        return status;
+    }
+    atomic_fetch_and (&rwl->state, ~RWL_WRITER);
+    if (rwl->policy == RWL_PREFER_WRITER && rwl->w_wait > 0) {
+        status = pthread_cond_signal (&rwl->write);
+        if (status != 0) {
+            pthread_mutex_unlock (&rwl->mutex);
+            return status;
+        }
+    } else if (rwl->r_wait > 0 || rwl->u_wait > 0) {
+        status = rwl_wakereaders (rwl);
         if (status != 0) {
             pthread_mutex_unlock (&rwl->mutex);
             return status;
@@ -274,3 +857,479 @@ int rwl_writeunlock (rwlock_t *rwl)
     status = pthread_mutex_unlock (&rwl->mutex);
     return status;
 }
+
+/*
+ * Try to take the lock in upgrade mode, if no writer or other
+ * upgrader holds it.
+ */
+static int rwl_upgradetry (rwlock_t *rwl)
+{
+    unsigned int state = atomic_load (&rwl->state);
+
+    while (!(state & (RWL_WRITER | RWL_UPGRADER)))
+        if (atomic_compare_exchange_weak (
+                &rwl->state, &state, state | RWL_UPGRADER))
+            return 1;
+    return 0;
+}
+
+/*
+ * Handle cleanup when the upgrade mode condition variable
+ * wait is cancelled.
+ *
+ * Simply record that the thread is no longer waiting,
+ * and unlock the mutex.
+ */
+static void rwl_upgradecleanup (void *arg)
+{
+    rwlock_t *rwl = (rwlock_t *)arg;
+
+    rwl->u_wait--;
+    rwl_waited (rwl);
+    pthread_mutex_unlock (&rwl->mutex);
+}
+
+/*
+ * Wait to lock a read-write lock in upgrade mode.
+ */
+static int rwl_upgradewait (rwlock_t *rwl)
+{
+    int status;
+
+    status = pthread_mutex_lock (&rwl->mutex);
+    if (status != 0)
+        return status;
+    rwl->u_wait++;
+    rwl_waiting (rwl);
+    pthread_cleanup_push (rwl_upgradecleanup, (void*)rwl);
+    while (!rwl_upgradetry (rwl)) {
+        status = pthread_cond_wait (&rwl->upgrade, &rwl->mutex);
+        if (status != 0)
+            break;
+    }
+    pthread_cleanup_pop (0);
+    rwl->u_wait--;
+    rwl_waited (rwl);
+    pthread_mutex_unlock (&rwl->mutex);
+    return status;
+}
+
+/*
+ * Lock a read-write lock in upgrade mode: shared with readers, but
+ * not with writers or another upgrader.
+ */
+int rwl_upgradelock (rwlock_t *rwl)
+{
+    unsigned int state;
+    int status = 0;
+
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+
+    /*
+     * If no writer or upgrader holds the lock, and no thread is
+     * waiting, just set the upgrader bit.
+     */
+    state = atomic_load (&rwl->state);
+    while (!(state & (RWL_WRITER | RWL_UPGRADER | RWL_WAITING)))
+        if (atomic_compare_exchange_weak (
+                &rwl->state, &state, state | RWL_UPGRADER)) {
+            RWL_PROF_LOCKED (rwl, RWL_PROF_UPGRADE, 0);
+            return 0;
+        }
+    RWL_PROF_WAIT ();
+    if (!rwl_spin (rwl, RWL_WRITER | RWL_UPGRADER, RWL_UPGRADER))
+        status = rwl_upgradewait (rwl);
+    if (status == 0)
+        RWL_PROF_LOCKED (rwl, RWL_PROF_UPGRADE, 1);
+    return status;
+}
+
+/*
+ * Unlock a read-write lock from upgrade mode.
+ */
+int rwl_upgradeunlock (rwlock_t *rwl)
+{
+    unsigned int state;
+    int status = 0, status2;
+
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+    RWL_PROF_UNLOCKED (rwl, RWL_PROF_UPGRADE);
+    state = atomic_fetch_and (&rwl->state, ~RWL_UPGRADER) & ~RWL_UPGRADER;
+    if (!(state & RWL_WAITING))
+        return 0;
+
+    /*
+     * Threads are waiting: another upgrader may be able to go, and
+     * so may a writer, if no readers remain.
+     */
+    status = pthread_mutex_lock (&rwl->mutex);
+    if (status != 0)
+        return status;
+    if (rwl->u_wait > 0)
+        status = pthread_cond_broadcast (&rwl->upgrade);
+    if (status == 0 && state == RWL_WAITING && rwl->w_wait > 0)
+        status = pthread_cond_signal (&rwl->write);
+    status2 = pthread_mutex_unlock (&rwl->mutex);
+    return (status2 == 0 ? status : status2);
+}
+
+/*
+ * Turn upgrade mode into write access, if no readers remain.
+ */
+static int rwl_upgradewrite (rwlock_t *rwl)
+{
+    unsigned int state = atomic_load (&rwl->state);
+
+    while (state < RWL_READER)
+        if (atomic_compare_exchange_weak (
+                &rwl->state, &state, state - RWL_UPGRADER + RWL_WRITER))
+            return 1;
+    return 0;
+}
+
+/*
+ * Handle cleanup when the upgrade condition variable wait is
+ * cancelled.
+ *
+ * The thread still holds the lock in upgrade mode. Record that it's
+ * no longer waiting, let readers that were waiting for it to finish
+ * try again, and unlock the mutex.
+ */
+static void rwl_upgradingcleanup (void *arg)
+{
+    rwlock_t *rwl = (rwlock_t *)arg;
+
+    rwl->u_wait--;
+    rwl->upgrading = 0;
+    if (rwl->r_wait > 0)
+        pthread_cond_broadcast (&rwl->read);
+    rwl_waited (rwl);
+    pthread_mutex_unlock (&rwl->mutex);
+}
+
+/*
+ * Turn upgrade mode into write access, without unlocking: wait for
+ * the readers that hold the lock to unlock it, keeping new readers
+ * out meanwhile.
+ */
+int rwl_upgrade (rwlock_t *rwl)
+{
+    unsigned int state = RWL_UPGRADER;
+    int status;
+
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+    if (atomic_compare_exchange_strong (&rwl->state, &state, RWL_WRITER)) {
+        RWL_PROF_UNLOCKED (rwl, RWL_PROF_UPGRADE);
+        RWL_PROF_LOCKED (rwl, RWL_PROF_WRITE, 0);
+        return 0;
+    }
+
+    RWL_PROF_WAIT ();
+    status = pthread_mutex_lock (&rwl->mutex);
+    if (status != 0)
+        return status;
+    rwl->u_wait++;
+    rwl->upgrading = 1;
+    rwl_waiting (rwl);
+    pthread_cleanup_push (rwl_upgradingcleanup, (void*)rwl);
+    while (!rwl_upgradewrite (rwl)) {
+        status = pthread_cond_wait (&rwl->upgrade, &rwl->mutex);
+        if (status != 0)
+            break;
+    }
+    pthread_cleanup_pop (0);
+    rwl->u_wait--;
+    rwl->upgrading = 0;
+    if (status != 0 && rwl->r_wait > 0)
+        pthread_cond_broadcast (&rwl->read);
+    rwl_waited (rwl);
+    pthread_mutex_unlock (&rwl->mutex);
+    if (status == 0) {
+        RWL_PROF_UNLOCKED (rwl, RWL_PROF_UPGRADE);
+        RWL_PROF_LOCKED (rwl, RWL_PROF_WRITE, 1);
+    }
+    return status;
+}
+
+/*
+ * Turn write access into read access, without unlocking.
+ */
+int rwl_downgrade (rwlock_t *rwl)
+{
+    unsigned int state = RWL_WRITER;
+    int status, status2;
+
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+    RWL_PROF_UNLOCKED (rwl, RWL_PROF_WRITE);
+    RWL_PROF_LOCKED (rwl, RWL_PROF_READ, 0);
+    if (atomic_compare_exchange_strong (&rwl->state, &state, RWL_READER))
+        return 0;
+
+    /*
+     * Threads are waiting. Waiting readers may now join this one
+     * (and, under RWL_PHASE_FAIR, get the lock together, just as
+     * when a writer unlocks), and an upgrader may take upgrade mode.
+     */
+    status = pthread_mutex_lock (&rwl->mutex);
+    if (status != 0)
+        return status;
+    if (rwl->policy == RWL_PHASE_FAIR && rwl->r_wait > 0) {
+        atomic_fetch_add (&rwl->state,
+            (rwl->r_wait + 1) * RWL_READER - RWL_WRITER);
+        rwl->phase++;
+    } else
+        atomic_fetch_add (&rwl->state, RWL_READER - RWL_WRITER);
+    status = rwl_wakereaders (rwl);
+    status2 = pthread_mutex_unlock (&rwl->mutex);
+    return (status2 == 0 ? status : status2);
+}
+
+#ifdef RWL_PROFILE
+/*
+ * Return the time, in nanoseconds, measured by CLOCK_MONOTONIC.
+ */
+static uint64_t rwl_prof_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Return the calling thread's list of the locks it holds, creating
+ * it if need be; or NULL, if that isn't possible (in which case,
+ * the thread just isn't profiled).
+ */
+static rwl_held_t *rwl_prof_held (void)
+{
+    rwl_held_t *held;
+
+    if (pthread_once (&rwl_once, rwl_once_init) != 0
+            || rwl_held_status != 0)
+        return NULL;
+    held = (rwl_held_t*)pthread_getspecific (rwl_held_key);
+    if (held == NULL) {
+        held = (rwl_held_t*)calloc (1, sizeof (rwl_held_t));
+        if (held == NULL)
+            return NULL;
+        if (pthread_setspecific (rwl_held_key, held) != 0) {
+            free (held);
+            return NULL;
+        }
+    }
+    return held;
+}
+
+/*
+ * The calling thread couldn't lock a lock at once, and is about to
+ * spin, or wait, for it.
+ */
+static void rwl_prof_wait (void)
+{
+    rwl_held_t *held = rwl_prof_held ();
+
+    if (held != NULL)
+        held->waiting = rwl_prof_now ();
+}
+
+/*
+ * Put a lock on the list of live locks, if it isn't on it already.
+ */
+static void rwl_prof_register (rwlock_t *rwl)
+{
+    int registered = 0;
+
+    if (!atomic_compare_exchange_strong (&rwl->registered, &registered, 1))
+        return;
+    pthread_mutex_lock (&rwl_registry_mutex);
+    rwl->prof_prev = NULL;
+    rwl->prof_next = rwl_registry;
+    if (rwl_registry != NULL)
+        rwl_registry->prof_prev = rwl;
+    rwl_registry = rwl;
+    pthread_mutex_unlock (&rwl_registry_mutex);
+}
+
+/*
+ * The calling thread has locked a lock in "mode", after spinning or
+ * waiting if "contended" is nonzero.
+ */
+static void rwl_prof_locked (rwlock_t *rwl, int mode, int contended)
+{
+    rwl_prof_t *prof = &rwl->prof[mode];
+    rwl_held_t *held = rwl_prof_held ();
+    uint64_t now = rwl_prof_now ();
+
+    if (!atomic_load_explicit (&rwl->registered, memory_order_relaxed))
+        rwl_prof_register (rwl);
+    atomic_fetch_add_explicit (&prof->acquired, 1, memory_order_relaxed);
+    if (contended) {
+        atomic_fetch_add_explicit (
+            &prof->contended, 1, memory_order_relaxed);
+        if (held != NULL)
+            atomic_fetch_add_explicit (
+                &prof->wait, now - held->waiting, memory_order_relaxed);
+    }
+    if (held != NULL && held->count < RWL_PROF_HELD) {
+        held->lock[held->count].rwl = rwl;
+        held->lock[held->count].mode = mode;
+        held->lock[held->count].since = now;
+        held->count++;
+    }
+}
+
+/*
+ * The calling thread is about to unlock a lock it holds in "mode":
+ * note how long it held it. (A lock that doesn't appear on the
+ * thread's list, because the thread holds too many, or because it
+ * was locked by another thread, isn't counted.)
+ */
+static void rwl_prof_unlocked (rwlock_t *rwl, int mode)
+{
+    rwl_prof_t *prof = &rwl->prof[mode];
+    rwl_held_t *held = rwl_prof_held ();
+    unsigned long long hold, max;
+    int i;
+
+    if (held == NULL)
+        return;
+    for (i = held->count - 1; i >= 0; i--)
+        if (held->lock[i].rwl == rwl && held->lock[i].mode == mode)
+            break;
+    if (i < 0)
+        return;
+    hold = rwl_prof_now () - held->lock[i].since;
+    held->count--;
+    for (; i < held->count; i++)
+        held->lock[i] = held->lock[i + 1];
+    max = atomic_load_explicit (&prof->hold_max, memory_order_relaxed);
+    while (hold > max)
+        if (atomic_compare_exchange_weak_explicit (&prof->hold_max, &max,
+                hold, memory_order_relaxed, memory_order_relaxed))
+            break;
+}
+
+/*
+ * Take a lock that's being destroyed off the list of live locks.
+ */
+static void rwl_prof_destroy (rwlock_t *rwl)
+{
+    if (!atomic_load (&rwl->registered))
+        return;
+    pthread_mutex_lock (&rwl_registry_mutex);
+    if (rwl->prof_prev != NULL)
+        rwl->prof_prev->prof_next = rwl->prof_next;
+    else
+        rwl_registry = rwl->prof_next;
+    if (rwl->prof_next != NULL)
+        rwl->prof_next->prof_prev = rwl->prof_prev;
+    atomic_store (&rwl->registered, 0);
+    pthread_mutex_unlock (&rwl_registry_mutex);
+}
+
+/*
+ * Give a lock a name, by which rwl_profile_dump will report it
+ * (the string isn't copied, so it must last as long as the lock).
+ */
+int rwl_profile_name (rwlock_t *rwl, const char *name)
+{
+    if (rwl->valid != RWLOCK_VALID)
+        return EINVAL;
+    rwl->name = name;
+    return 0;
+}
+
+/*
+ * A copy of one lock's profile, for rwl_profile_dump.
+ */
+typedef struct rwl_snap_tag {
+    rwlock_t            *rwl;
+    const char          *name;
+    unsigned long long  wait;           /* in all modes */
+    unsigned long       acquired[RWL_PROF_MODES];
+    unsigned long       contended[RWL_PROF_MODES];
+    unsigned long long  mode_wait[RWL_PROF_MODES];
+    unsigned long long  hold_max[RWL_PROF_MODES];
+} rwl_snap_t;
+
+/*
+ * Compare function for qsort: longest wait first.
+ */
+static int rwl_prof_compare (const void *a, const void *b)
+{
+    const rwl_snap_t *x = (const rwl_snap_t*)a, *y = (const rwl_snap_t*)b;
+
+    return (x->wait < y->wait) - (x->wait > y->wait);
+}
+
+/*
+ * Write the profile of every live lock that has been locked to
+ * "file", one line for each mode in which it was locked, the locks
+ * that were waited for longest first. The counts are being added to
+ * as they're read, so they may not agree exactly with each other.
+ */
+int rwl_profile_dump (FILE *file)
+{
+    static const char *modes[RWL_PROF_MODES] = {"read", "write", "upgrade"};
+    rwl_snap_t *snap;
+    rwlock_t *rwl;
+    char address[32];
+    int count = 0, i, mode, status;
+
+    status = pthread_mutex_lock (&rwl_registry_mutex);
+    if (status != 0)
+        return status;
+    for (rwl = rwl_registry; rwl != NULL; rwl = rwl->prof_next)
+        count++;
+    snap = (rwl_snap_t*)calloc (count + 1, sizeof (rwl_snap_t));
+    if (snap == NULL) {
+        pthread_mutex_unlock (&rwl_registry_mutex);
+        return ENOMEM;
+    }
+    for (i = 0, rwl = rwl_registry; rwl != NULL; i++, rwl = rwl->prof_next) {
+        snap[i].rwl = rwl;
+        snap[i].name = rwl->name;
+        for (mode = 0; mode < RWL_PROF_MODES; mode++) {
+            snap[i].acquired[mode] = atomic_load_explicit (
+                &rwl->prof[mode].acquired, memory_order_relaxed);
+            snap[i].contended[mode] = atomic_load_explicit (
+                &rwl->prof[mode].contended, memory_order_relaxed);
+            snap[i].mode_wait[mode] = atomic_load_explicit (
+                &rwl->prof[mode].wait, memory_order_relaxed);
+            snap[i].hold_max[mode] = atomic_load_explicit (
+                &rwl->prof[mode].hold_max, memory_order_relaxed);
+            snap[i].wait += snap[i].mode_wait[mode];
+        }
+    }
+    pthread_mutex_unlock (&rwl_registry_mutex);
+
+    qsort (snap, count, sizeof (rwl_snap_t), rwl_prof_compare);
+    fprintf (file, "%-24s %-7s %12s %12s %12s %12s %12s\n",
+        "lock", "mode", "acquired", "contended", "wait_us",
+        "avg_wait_ns", "max_hold_us");
+    for (i = 0; i < count; i++) {
+        if (snap[i].name == NULL) {
+            snprintf (address, sizeof (address), "%p", (void*)snap[i].rwl);
+            snap[i].name = address;
+        }
+        for (mode = 0; mode < RWL_PROF_MODES; mode++) {
+            if (snap[i].acquired[mode] == 0)
+                continue;
+            fprintf (file, "%-24s %-7s %12lu %12lu %12.1f %12.0f %12.1f\n",
+                snap[i].name, modes[mode], snap[i].acquired[mode],
+                snap[i].contended[mode], snap[i].mode_wait[mode] / 1e3,
+                snap[i].contended[mode] == 0 ? 0.0
+                    : (double)snap[i].mode_wait[mode]
+                        / snap[i].contended[mode],
+                snap[i].hold_max[mode] / 1e3);
+        }
+    }
+    free (snap);
+    return 0;
+}
+#endif
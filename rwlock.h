@@ -10,8 +10,102 @@
  *
  * The rwl_init() and rwl_destroy() functions, respectively, allow you to
  * initialize/create and destroy/free the reader/writer lock.
+ *
+ * The state of the lock (the number of readers, whether a writer
+ * holds it, and whether any thread is waiting) is kept in a single
+ * atomic word, so that a thread can lock and unlock it with one
+ * atomic operation when no other thread is in the way. Only when a
+ * thread must wait does it lock the mutex and wait on one of the
+ * condition variables.
+ *
+ * The rwl_init_attr() function initializes a lock with an
+ * attributes object, which selects how the lock chooses between
+ * waiting readers and writers: RWL_PREFER_READER (the default, as
+ * with rwl_init) lets readers in whenever no writer holds the lock,
+ * even if writers are waiting, so a steady stream of readers can
+ * keep writers out indefinitely; RWL_PREFER_WRITER keeps new readers
+ * out while any writer is waiting, which can starve readers instead;
+ * and RWL_PHASE_FAIR alternates, so that when a writer unlocks, all
+ * of the readers that were waiting get the lock together, ahead of
+ * any waiting writer, while readers that arrive after a writer has
+ * begun to wait wait for it. Neither side then waits for more than
+ * one phase of the other.
+ *
+ * The rwl_readtimedlock() and rwl_writetimedlock() functions give
+ * up, returning ETIMEDOUT, if they can't lock the lock by an
+ * absolute time measured by CLOCK_MONOTONIC.
+ *
+ * Before a thread waits for a lock, it spins for a while, checking
+ * whether the lock has become free, since for a lock held only
+ * briefly that's much cheaper than waiting and being woken. How
+ * long it spins adapts to how long recent threads had to spin to
+ * get the lock, up to a limit set by the "spin" attribute (0 to
+ * wait immediately).
+ *
+ * The rwl_upgradelock() function locks a read-write lock in
+ * "upgrade" mode: like a read lock, it shares the lock with readers,
+ * but only one thread at a time may hold it, and no writer. The
+ * holder may then call rwl_upgrade() to turn it into a write lock
+ * without unlocking (waiting only for the readers that already hold
+ * the lock, since new readers wait for it), so that nothing it read
+ * can have changed; or rwl_upgradeunlock() to release it. The
+ * rwl_downgrade() function turns a write lock into a read lock,
+ * again without unlocking.
+ *
+ * When rwlock.c, and everything that includes this header, is
+ * compiled with RWL_PROFILE defined (for example, with "make
+ * DEBUGFLAGS=-DRWL_PROFILE"), each lock counts, for each mode (read,
+ * write and upgrade), how often it was locked, how often the locker
+ * had to spin or wait, how long it spent doing so, and the longest
+ * time a thread held it. Locks are put on a list of live locks when
+ * they're first locked, and rwl_profile_dump() writes the counts for
+ * every lock on the list, the locks that were waited for longest
+ * first. Without RWL_PROFILE, none of this is compiled at all.
  */
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef RWL_PROFILE
+# include <stdio.h>
+#endif
+
+/*
+ * Policies for choosing between readers and writers.
+ */
+#define RWL_PREFER_READER       0
+#define RWL_PREFER_WRITER       1
+#define RWL_PHASE_FAIR          2
+
+#define RWL_SPIN_DEFAULT        1000    /* most checks before waiting */
+
+/*
+ * Attributes object, used to specify optional behavior when a
+ * read-write lock is initialized.
+ */
+typedef struct rwl_attr_tag {
+    int                 policy;         /* RWL_PREFER_* or RWL_PHASE_FAIR */
+    int                 spin;           /* most checks before waiting */
+} rwl_attr_t;
+
+#ifdef RWL_PROFILE
+/*
+ * Modes for which a lock keeps a profile.
+ */
+# define RWL_PROF_READ          0
+# define RWL_PROF_WRITE         1
+# define RWL_PROF_UPGRADE       2
+# define RWL_PROF_MODES         3
+
+/*
+ * Profile of one mode of a read-write lock.
+ */
+typedef struct rwl_prof_tag {
+    atomic_ulong        acquired;       /* times locked */
+    atomic_ulong        contended;      /* ... after spinning or waiting */
+    atomic_ullong       wait;           /* total time to lock (ns) */
+    atomic_ullong       hold_max;       /* longest time held (ns) */
+} rwl_prof_t;
+#endif
 
 /*
  * Structure describing a read-write lock.
@@ -20,11 +114,25 @@ typedef struct rwlock_tag {
     pthread_mutex_t     mutex;
     pthread_cond_t      read;           /* wait for read */
     pthread_cond_t      write;          /* wait for write */
+    pthread_cond_t      upgrade;        /* wait for upgrade */
     int                 valid;          /* set when valid */
-    int                 r_active;       /* readers active */
-    int                 w_active;       /* writer active */
+    atomic_uint         state;          /* readers, writer, waiting */
     int                 r_wait;         /* readers waiting */
     int                 w_wait;         /* writers waiting */
+    int                 u_wait;         /* upgraders waiting */
+    int                 upgrading;      /* upgrader waits for readers */
+    int                 policy;         /* reader/writer policy */
+    unsigned long       phase;          /* writer unlocks (phase-fair) */
+    int                 spin;           /* most checks before waiting */
+    atomic_int          spun;           /* average checks that worked */
+    int                 monotonic;      /* CVs use CLOCK_MONOTONIC */
+#ifdef RWL_PROFILE
+    rwl_prof_t          prof[RWL_PROF_MODES];
+    const char          *name;          /* name to dump it by */
+    atomic_int          registered;     /* on the list of live locks */
+    struct rwlock_tag   *prof_next;     /* ... */
+    struct rwlock_tag   *prof_prev;
+#endif
 } rwlock_t;
 
 #define RWLOCK_VALID    0xfacade
@@ -34,16 +142,37 @@ typedef struct rwlock_tag {
  */
 #define RWL_INITIALIZER \
     {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, \
-    PTHREAD_COND_INITIALIZER, RWLOCK_VALID, 0, 0, 0, 0}
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, \
+    RWLOCK_VALID, 0, 0, 0, 0, 0, RWL_PREFER_READER, 0, \
+    RWL_SPIN_DEFAULT, 0, 0}
 
 /*
  * Define read-write lock functions
  */
+extern int rwl_attr_init (rwl_attr_t *attr);
+extern int rwl_attr_destroy (rwl_attr_t *attr);
+extern int rwl_attr_setpolicy (rwl_attr_t *attr, int policy);
+extern int rwl_attr_getpolicy (const rwl_attr_t *attr, int *policy);
+extern int rwl_attr_setspin (rwl_attr_t *attr, int spin);
+extern int rwl_attr_getspin (const rwl_attr_t *attr, int *spin);
 extern int rwl_init (rwlock_t *rwlock);
+extern int rwl_init_attr (rwlock_t *rwlock, const rwl_attr_t *attr);
 extern int rwl_destroy (rwlock_t *rwlock);
 extern int rwl_readlock (rwlock_t *rwlock);
+extern int rwl_readtimedlock (
+    rwlock_t *rwlock, const struct timespec *abstime);
 extern int rwl_readtrylock (rwlock_t *rwlock);
 extern int rwl_readunlock (rwlock_t *rwlock);
 extern int rwl_writelock (rwlock_t *rwlock);
+extern int rwl_writetimedlock (
+    rwlock_t *rwlock, const struct timespec *abstime);
 extern int rwl_writetrylock (rwlock_t *rwlock);
 extern int rwl_writeunlock (rwlock_t *rwlock);
+extern int rwl_upgradelock (rwlock_t *rwlock);
+extern int rwl_upgradeunlock (rwlock_t *rwlock);
+extern int rwl_upgrade (rwlock_t *rwlock);
+extern int rwl_downgrade (rwlock_t *rwlock);
+#ifdef RWL_PROFILE
+extern int rwl_profile_name (rwlock_t *rwlock, const char *name);
+extern int rwl_profile_dump (FILE *file);
+#endif
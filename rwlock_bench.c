@@ -0,0 +1,373 @@
+/*
+ * rwlock_bench.c
+ *
+ * Measure how long writers wait for a read-write lock (rwlock.c)
+ * under each of its policies, while a set of reader threads keep
+ * it busy. Each reader repeatedly locks for read, holds the lock
+ * for a given time (spinning, without giving up the processor),
+ * and unlocks; each writer sleeps for a given interval (if it isn't
+ * 0), then locks for write, holds the lock, and unlocks. For each
+ * of a list of values of the lock's "spin" attribute, the program
+ * runs for a given time under RWL_PREFER_READER, RWL_PREFER_WRITER
+ * and RWL_PHASE_FAIR in turn, and writes one line of
+ * comma-separated values for each run:
+ *
+ *      policy,spin,readers,writers,read_hold_ns,write_hold_ns,
+ *      interval_us,seconds,reads_per_sec,writes,
+ *      write_wait_p50_ns,write_wait_p99_ns,write_wait_max_ns,
+ *      read_wait_p50_ns,read_wait_p99_ns,read_wait_max_ns
+ *
+ * A "wait" is the time from just before a thread calls
+ * rwl_readlock or rwl_writelock until it returns. Every write
+ * lock wait is kept, but only the last READ_SAMPLES read lock
+ * waits of each reader go into the read percentiles (all of them
+ * go into the maximum).
+ *
+ * Usage: rwlock_bench [-r readers] [-w writers] [-h read_hold_ns]
+ *          [-W write_hold_ns] [-i interval_us] [-s spin] [-t seconds]
+ *          [-H]
+ *
+ * where spin is a comma-separated list (by default, only
+ * RWL_SPIN_DEFAULT), and -H omits the header line.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "barrier.h"
+#include "rwlock.h"
+#include "errors.h"
+
+#define MAX_LIST        16
+#define READ_SAMPLES    65536           /* read waits kept per reader */
+
+typedef struct reader_tag {
+    pthread_t   thread_id;
+    long        reads;
+    uint64_t    wait_max;               /* longest read lock wait */
+    uint64_t    *wait;                  /* recent read lock waits */
+} reader_t;
+
+typedef struct writer_tag {
+    pthread_t   thread_id;
+    long        writes, size;
+    uint64_t    *wait;                  /* each write lock wait */
+} writer_t;
+
+rwlock_t lock;
+atomic_int stop;                        /* set when the run is over */
+barrier_t start;
+uint64_t read_hold, write_hold;         /* time to hold the lock */
+long interval;                          /* writer sleep (usec) */
+int spin;                               /* lock's spin attribute */
+int data;                               /* the protected "data" */
+
+/*
+ * Return the time, in nanoseconds, measured by CLOCK_MONOTONIC.
+ */
+uint64_t bench_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Spin for "ns" nanoseconds, standing in for work done while
+ * holding the lock.
+ */
+void hold (uint64_t ns)
+{
+    uint64_t begin = bench_now ();
+
+    while (ns > 0 && bench_now () - begin < ns)
+        ;
+}
+
+/*
+ * Thread start routine for readers.
+ */
+void *reader_routine (void *arg)
+{
+    reader_t *self = (reader_t*)arg;
+    uint64_t begin, wait;
+    int status, value;
+
+    barrier_wait (&start);
+    while (!atomic_load (&stop)) {
+        begin = bench_now ();
+        status = rwl_readlock (&lock);
+        if (status != 0)
+            err_abort (status, "Read lock");
+        wait = bench_now () - begin;
+        if (wait > self->wait_max)
+            self->wait_max = wait;
+        self->wait[self->reads % READ_SAMPLES] = wait;
+        value = data;
+        hold (read_hold);
+        if (data != value)
+            err_abort (EINVAL, "Data changed under read lock");
+        status = rwl_readunlock (&lock);
+        if (status != 0)
+            err_abort (status, "Read unlock");
+        self->reads++;
+    }
+    return NULL;
+}
+
+/*
+ * Thread start routine for writers.
+ */
+void *writer_routine (void *arg)
+{
+    writer_t *self = (writer_t*)arg;
+    struct timespec delay;
+    uint64_t begin;
+    int status;
+
+    delay.tv_sec = interval / 1000000;
+    delay.tv_nsec = (interval % 1000000) * 1000;
+    barrier_wait (&start);
+    while (!atomic_load (&stop)) {
+        if (interval > 0)
+            nanosleep (&delay, NULL);
+        begin = bench_now ();
+        status = rwl_writelock (&lock);
+        if (status != 0)
+            err_abort (status, "Write lock");
+        if (self->writes >= self->size) {
+            self->size = self->size * 2 + 1024;
+            self->wait = (uint64_t*)realloc (
+                self->wait, self->size * sizeof (uint64_t));
+            if (self->wait == NULL)
+                errno_abort ("Allocate waits");
+        }
+        self->wait[self->writes++] = bench_now () - begin;
+        data++;
+        hold (write_hold);
+        status = rwl_writeunlock (&lock);
+        if (status != 0)
+            err_abort (status, "Write unlock");
+    }
+    return NULL;
+}
+
+/*
+ * Compare function for qsort.
+ */
+int compare (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the "pct" percentile of a sorted array.
+ */
+uint64_t percentile (uint64_t *sorted, long count, double pct)
+{
+    long index = (long)(pct / 100.0 * count + 0.999999) - 1;
+
+    if (count == 0)
+        return 0;
+    if (index < 0)
+        index = 0;
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+/*
+ * Run the benchmark once under "policy", and write a line of
+ * results.
+ */
+void run (const char *name, int policy, int readers, int writers,
+    double seconds)
+{
+    rwl_attr_t attr;
+    reader_t *reader;
+    writer_t *writer;
+    struct timespec length;
+    uint64_t *wait, *read_wait, read_max = 0, begin, end;
+    long reads = 0, writes = 0, samples = 0, i;
+    int status, t;
+
+    rwl_attr_init (&attr);
+    rwl_attr_setpolicy (&attr, policy);
+    rwl_attr_setspin (&attr, spin);
+    status = rwl_init_attr (&lock, &attr);
+    if (status != 0)
+        err_abort (status, "Init rw lock");
+    rwl_attr_destroy (&attr);
+    status = barrier_init (&start, readers + writers + 1);
+    if (status != 0)
+        err_abort (status, "Init barrier");
+    atomic_store (&stop, 0);
+
+    reader = (reader_t*)calloc (readers, sizeof (reader_t));
+    writer = (writer_t*)calloc (writers, sizeof (writer_t));
+    read_wait = (uint64_t*)malloc (
+        ((long)readers * READ_SAMPLES + 1) * sizeof (uint64_t));
+    if (reader == NULL || writer == NULL || read_wait == NULL)
+        errno_abort ("Allocate threads");
+    for (t = 0; t < readers; t++) {
+        reader[t].wait = read_wait + (long)t * READ_SAMPLES;
+        status = pthread_create (
+            &reader[t].thread_id, NULL, reader_routine, (void*)&reader[t]);
+        if (status != 0)
+            err_abort (status, "Create reader");
+    }
+    for (t = 0; t < writers; t++) {
+        status = pthread_create (
+            &writer[t].thread_id, NULL, writer_routine, (void*)&writer[t]);
+        if (status != 0)
+            err_abort (status, "Create writer");
+    }
+
+    /*
+     * Release the threads together, let them run, and then tell
+     * them to stop.
+     */
+    length.tv_sec = (time_t)seconds;
+    length.tv_nsec = (long)((seconds - length.tv_sec) * 1e9);
+    barrier_wait (&start);
+    begin = bench_now ();
+    nanosleep (&length, NULL);
+    atomic_store (&stop, 1);
+    for (t = 0; t < readers; t++) {
+        status = pthread_join (reader[t].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join reader");
+        reads += reader[t].reads;
+        if (reader[t].wait_max > read_max)
+            read_max = reader[t].wait_max;
+        for (i = 0; i < reader[t].reads && i < READ_SAMPLES; i++)
+            read_wait[samples++] = reader[t].wait[i];
+    }
+    for (t = 0; t < writers; t++) {
+        status = pthread_join (writer[t].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join writer");
+        writes += writer[t].writes;
+    }
+    end = bench_now ();
+    status = rwl_destroy (&lock);
+    if (status != 0)
+        err_abort (status, "Destroy rw lock");
+    barrier_destroy (&start);
+
+    wait = (uint64_t*)malloc ((writes + 1) * sizeof (uint64_t));
+    if (wait == NULL)
+        errno_abort ("Allocate waits");
+    writes = 0;
+    for (t = 0; t < writers; t++) {
+        for (i = 0; i < writer[t].writes; i++)
+            wait[writes++] = writer[t].wait[i];
+        free (writer[t].wait);
+    }
+    qsort (wait, writes, sizeof (uint64_t), compare);
+    qsort (read_wait, samples, sizeof (uint64_t), compare);
+    printf ("%s,%d,%d,%d,%lu,%lu,%ld,%.3f,%.0f,%ld,%lu,%lu,%lu,%lu,%lu,%lu\n",
+        name, spin, readers, writers, (unsigned long)read_hold,
+        (unsigned long)write_hold, interval, (end - begin) / 1e9,
+        reads / ((end - begin) / 1e9), writes,
+        (unsigned long)percentile (wait, writes, 50.0),
+        (unsigned long)percentile (wait, writes, 99.0),
+        (unsigned long)(writes > 0 ? wait[writes - 1] : 0),
+        (unsigned long)percentile (read_wait, samples, 50.0),
+        (unsigned long)percentile (read_wait, samples, 99.0),
+        (unsigned long)read_max);
+    fflush (stdout);
+    free (wait);
+    free (read_wait);
+    free (reader);
+    free (writer);
+}
+
+/*
+ * Parse a comma-separated list of non-negative integers.
+ */
+int parse_list (char *arg, int *list)
+{
+    char *end;
+    int count = 0;
+
+    while (count < MAX_LIST) {
+        list[count] = (int)strtol (arg, &end, 10);
+        if (end == arg || list[count] < 0) {
+            fprintf (stderr, "Bad list \"%s\"\n", arg);
+            exit (1);
+        }
+        count++;
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+    return count;
+}
+
+int main (int argc, char *argv[])
+{
+    int readers = 4, writers = 1, header = 1, option;
+    int spins[MAX_LIST] = {RWL_SPIN_DEFAULT}, nspins = 1, s;
+    double seconds = 2.0;
+
+    read_hold = 1000;
+    write_hold = 1000;
+    interval = 1000;
+    while ((option = getopt (argc, argv, "r:w:h:W:i:s:t:H")) != -1) {
+        switch (option) {
+        case 'r':
+            readers = atoi (optarg);
+            break;
+        case 'w':
+            writers = atoi (optarg);
+            break;
+        case 'h':
+            read_hold = strtoul (optarg, NULL, 10);
+            break;
+        case 'W':
+            write_hold = strtoul (optarg, NULL, 10);
+            break;
+        case 'i':
+            interval = atol (optarg);
+            break;
+        case 's':
+            nspins = parse_list (optarg, spins);
+            break;
+        case 't':
+            seconds = atof (optarg);
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            fprintf (stderr,
+                "Usage: %s [-r readers] [-w writers] [-h read_hold_ns]"
+                " [-W write_hold_ns] [-i interval_us] [-s spin]"
+                " [-t seconds] [-H]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (readers < 0 || writers < 1 || interval < 0 || seconds <= 0) {
+        fprintf (stderr, "Need at least one writer, and a run time\n");
+        return 1;
+    }
+
+    if (header)
+        printf ("policy,spin,readers,writers,read_hold_ns,write_hold_ns,"
+            "interval_us,seconds,reads_per_sec,writes,"
+            "write_wait_p50_ns,write_wait_p99_ns,write_wait_max_ns,"
+            "read_wait_p50_ns,read_wait_p99_ns,read_wait_max_ns\n");
+    for (s = 0; s < nspins; s++) {
+        spin = spins[s];
+        run ("reader", RWL_PREFER_READER, readers, writers, seconds);
+        run ("writer", RWL_PREFER_WRITER, readers, writers, seconds);
+        run ("phase-fair", RWL_PHASE_FAIR, readers, writers, seconds);
+    }
+    return 0;
+}
@@ -151,6 +151,15 @@ int main (int argc, char *argv[])
             threads[count].updates, threads[count].reads);
     }
 
+#ifdef RWL_PROFILE
+    /*
+     * Report which locks the threads waited for longest.
+     */
+    status = rwl_profile_dump (stdout);
+    if (status != 0)
+        err_abort (status, "Dump profile");
+#endif
+
     /*
      * Collect statistics for the data.
      */
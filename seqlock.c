@@ -0,0 +1,117 @@
+/*
+ * seqlock.c
+ *
+ * This file implements the writer's side of the "sequence lock"
+ * synchronization construct. (The reader's side, seq_readbegin
+ * and seq_readretry, is inline in seqlock.h, since it's only a
+ * few loads.)
+ *
+ * A writer locks the mutex, which keeps other writers out, and
+ * then makes the sequence number odd. The release fence after that
+ * store keeps the writer's changes to the record from becoming
+ * visible before the sequence number does, and the release store
+ * that makes the number even again keeps them from becoming
+ * visible after it; so a reader that finds the same even number
+ * before and after its copy (with the acquire fence in
+ * seq_readretry ordering the copy before the second check) can't
+ * have seen any part of a change.
+ */
+#include <pthread.h>
+#include "errors.h"
+#include "seqlock.h"
+
+/*
+ * Initialize a sequence lock
+ */
+int seq_init (seqlock_t *seq)
+{
+    int status;
+
+    atomic_init (&seq->sequence, 0);
+    status = pthread_mutex_init (&seq->mutex, NULL);
+    if (status != 0)
+        return status;
+    seq->valid = SEQLOCK_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a sequence lock
+ */
+int seq_destroy (seqlock_t *seq)
+{
+    int status;
+
+    if (seq->valid != SEQLOCK_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&seq->mutex);
+    if (status != 0)
+        return status;
+
+    /*
+     * Check whether a writer owns the lock; report "BUSY" if so.
+     * (The mutex is locked, so no writer can, unless it's this
+     * thread.)
+     */
+    if (atomic_load (&seq->sequence) & 1) {
+        pthread_mutex_unlock (&seq->mutex);
+        return EBUSY;
+    }
+
+    seq->valid = 0;
+    status = pthread_mutex_unlock (&seq->mutex);
+    if (status != 0)
+        return status;
+    return pthread_mutex_destroy (&seq->mutex);
+}
+
+/*
+ * Lock a sequence lock for write access.
+ */
+int seq_writelock (seqlock_t *seq)
+{
+    unsigned int sequence;
+    int status;
+
+    if (seq->valid != SEQLOCK_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&seq->mutex);
+    if (status != 0)
+        return status;
+    sequence = atomic_load_explicit (&seq->sequence, memory_order_relaxed);
+    atomic_store_explicit (
+        &seq->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    return 0;
+}
+
+/*
+ * Unlock a sequence lock from write access.
+ */
+int seq_writeunlock (seqlock_t *seq)
+{
+    unsigned int sequence;
+
+    if (seq->valid != SEQLOCK_VALID)
+        return EINVAL;
+    sequence = atomic_load_explicit (&seq->sequence, memory_order_relaxed);
+    atomic_store_explicit (
+        &seq->sequence, sequence + 1, memory_order_release);
+    return pthread_mutex_unlock (&seq->mutex);
+}
+
+/*
+ * Copy a private record into one protected by a sequence lock (for
+ * SEQ_WRITE).
+ */
+int seq_writecopy (
+    seqlock_t *seq, void *dest, const void *src, size_t size)
+{
+    int status;
+
+    status = seq_writelock (seq);
+    if (status != 0)
+        return status;
+    memcpy (dest, src, size);
+    return seq_writeunlock (seq);
+}
@@ -0,0 +1,113 @@
+/*
+ * seqlock.h
+ *
+ * This header file describes the "sequence lock" synchronization
+ * construct, for small records that are read far more often than
+ * they're written. The type seqlock_t describes the full state of
+ * the lock including the POSIX 1003.1c synchronization objects
+ * necessary.
+ *
+ * Readers don't lock anything, and don't write to shared memory at
+ * all. Instead, a reader notes the lock's sequence number, copies
+ * the record, and then checks the sequence number again: writers
+ * (which lock a mutex to keep out other writers) make the sequence
+ * number odd while they change the record, and even again when
+ * they're done, so if the number was odd, or has changed, the copy
+ * may be inconsistent, and the reader must try again. Readers thus
+ * never wait for each other, or slow each other down, though they
+ * may have to retry (and spin, if a writer has been preempted) while
+ * a writer is busy. A reader must not follow pointers it finds in a
+ * copy until it knows the copy is good.
+ *
+ * Since a reader may copy a record while it's being changed, the
+ * record must be copied (out, by readers, and in, by writers) as a
+ * whole, rather than examined in place: SEQ_READ and SEQ_WRITE do
+ * this for a record of any type.
+ *
+ * The seq_init() and seq_destroy() functions, respectively, allow
+ * you to initialize/create and destroy/free the sequence lock.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+ * Structure describing a sequence lock.
+ */
+typedef struct seqlock_tag {
+    atomic_uint         sequence;       /* odd while writing */
+    int                 valid;          /* set when valid */
+    pthread_mutex_t     mutex;          /* serialize writers */
+} seqlock_t;
+
+#define SEQLOCK_VALID   0x5e9ace
+
+/*
+ * Support static initialization of sequence locks
+ */
+#define SEQ_INITIALIZER \
+    {0, SEQLOCK_VALID, PTHREAD_MUTEX_INITIALIZER}
+
+/*
+ * Define sequence lock functions
+ */
+extern int seq_init (seqlock_t *seqlock);
+extern int seq_destroy (seqlock_t *seqlock);
+extern int seq_writelock (seqlock_t *seqlock);
+extern int seq_writeunlock (seqlock_t *seqlock);
+
+/*
+ * Begin a read, returning the sequence number to give to
+ * seq_readretry. If a writer is busy, wait (yielding the
+ * processor, in case it's the writer that needs it) until it's
+ * done.
+ */
+static inline unsigned int seq_readbegin (seqlock_t *seqlock)
+{
+    unsigned int sequence;
+
+    while ((sequence = atomic_load_explicit (
+            &seqlock->sequence, memory_order_acquire)) & 1)
+        sched_yield ();
+    return sequence;
+}
+
+/*
+ * End a read, returning nonzero if a writer has changed the record
+ * since seq_readbegin returned "sequence" (so that the reader must
+ * try again).
+ */
+static inline int seq_readretry (seqlock_t *seqlock, unsigned int sequence)
+{
+    atomic_thread_fence (memory_order_acquire);
+    return atomic_load_explicit (
+        &seqlock->sequence, memory_order_relaxed) != sequence;
+}
+
+/*
+ * Copy the record "src", protected by "seqlock", to the private
+ * variable "dest", retrying until the copy is consistent. The two
+ * must be of the same type (the pointer comparison draws a warning
+ * if they aren't).
+ */
+#define SEQ_READ(seqlock, dest, src) \
+    do { \
+        unsigned int _sequence; \
+        (void)sizeof (&(dest) == &(src)); \
+        do { \
+            _sequence = seq_readbegin (seqlock); \
+            memcpy (&(dest), (const void*)&(src), sizeof (dest)); \
+        } while (seq_readretry ((seqlock), _sequence)); \
+    } while (0)
+
+/*
+ * Copy the private variable "src" to the record "dest", protected
+ * by "seqlock", evaluating to 0 or an error number.
+ */
+#define SEQ_WRITE(seqlock, dest, src) \
+    ((void)sizeof (&(dest) == &(src)), \
+    seq_writecopy ((seqlock), (void*)&(dest), &(src), sizeof (dest)))
+
+extern int seq_writecopy (
+    seqlock_t *seqlock, void *dest, const void *src, size_t size);
@@ -0,0 +1,332 @@
+/*
+ * stripe.c
+ *
+ * This file implements the "lock striping" table, a power-of-two
+ * array of read-write locks to which keys are hashed.
+ *
+ * Keys are hashed by multiplying them by 2^64 divided by the golden
+ * ratio, and taking the top log2(stripes) bits of the low 64 bits
+ * of the product ("Fibonacci hashing"), which spreads consecutive
+ * keys, or keys that differ only in their high bits, across the
+ * stripes. (Any bit of the key changes the top bits of the product;
+ * bits below the top can't see the key's high bits at all.)
+ *
+ * Each stripe is aligned on a cache line, and padded to a whole
+ * number of them (by the alignment of stripe_slot_t); the array is
+ * allocated with posix_memalign() so that the first stripe is
+ * aligned, too.
+ *
+ * To lock a set of keys, stripe_readlock_keys() and
+ * stripe_writelock_keys() first turn the keys into a sorted list
+ * of distinct stripe numbers, and then lock the stripes in that
+ * order. Since every thread that locks more than one stripe at a
+ * time does so in increasing order, no thread can hold one stripe
+ * while waiting for a lower one that another thread holds while
+ * waiting for the first: so there's no deadlock. If locking a
+ * stripe fails (or the thread is cancelled while it waits), the
+ * stripes it has already locked are unlocked again.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "errors.h"
+#include "stripe.h"
+
+#define STRIPE_HASH     0x9e3779b97f4a7c15ull   /* 2^64 / golden ratio */
+#define STRIPE_MAX      (1 << 24)               /* most stripes */
+
+/*
+ * Keep track of the stripes a multi-key lock has locked, for its
+ * cleanup handler.
+ */
+typedef struct stripe_taken_tag {
+    stripe_t            *stripe;
+    unsigned int        *index;         /* sorted stripe numbers */
+    int                 taken;          /* ... that are locked */
+    int                 write;          /* locked for write */
+} stripe_taken_t;
+
+/*
+ * Return the number of the stripe that protects "key".
+ */
+static unsigned int stripe_index (stripe_t *stripe, uint64_t key)
+{
+    return (unsigned int)((key * STRIPE_HASH) >> stripe->shift)
+        & stripe->mask;
+}
+
+/*
+ * Initialize a lock striping table, with "count" stripes (rounded
+ * up to a power of two), each a read-write lock initialized with
+ * the attributes object "attr" (or the defaults, if it's NULL).
+ */
+int stripe_init (stripe_t *stripe, int count, const rwl_attr_t *attr)
+{
+    void *slot;
+    int stripes = 1, bits = 0, i, status;
+
+    if (count < 1 || count > STRIPE_MAX)
+        return EINVAL;
+    while (stripes < count) {
+        stripes <<= 1;
+        bits++;
+    }
+    status = posix_memalign (
+        &slot, STRIPE_ALIGN, stripes * sizeof (stripe_slot_t));
+    if (status != 0)
+        return status;
+    stripe->slot = (stripe_slot_t*)slot;
+    for (i = 0; i < stripes; i++) {
+        status = rwl_init_attr (&stripe->slot[i].lock, attr);
+        if (status != 0) {
+            /* if unable to create a lock, destroy the others */
+            while (--i >= 0)
+                rwl_destroy (&stripe->slot[i].lock);
+            free (stripe->slot);
+            return status;
+        }
+    }
+    /*
+     * With one stripe, shift by 63 rather than 64 (which C doesn't
+     * define); the mask of 0 then picks stripe 0 anyway.
+     */
+    stripe->shift = bits > 0 ? 64 - bits : 63;
+    stripe->mask = stripes - 1;
+    stripe->valid = STRIPE_VALID;
+    return 0;
+}
+
+/*
+ * Destroy a lock striping table. First make sure that no stripe is
+ * in use, by locking each for write without waiting; if one is
+ * busy, unlock the ones already locked and report the error (EBUSY)
+ * from rwl_writetrylock, leaving the table as it was, so that
+ * threads holding stripes can still unlock them. (As with any other
+ * lock, no thread may start to use the table while it's being
+ * destroyed.)
+ */
+int stripe_destroy (stripe_t *stripe)
+{
+    unsigned int i;
+    int status, status1;
+
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    for (i = 0; i <= stripe->mask; i++) {
+        status = rwl_writetrylock (&stripe->slot[i].lock);
+        if (status != 0) {
+            while (i-- > 0)
+                rwl_writeunlock (&stripe->slot[i].lock);
+            return status;
+        }
+    }
+    stripe->valid = 0;
+    status = 0;
+    for (i = 0; i <= stripe->mask; i++) {
+        status1 = rwl_writeunlock (&stripe->slot[i].lock);
+        if (status1 == 0)
+            status1 = rwl_destroy (&stripe->slot[i].lock);
+        if (status == 0)
+            status = status1;
+    }
+    if (status != 0)
+        return status;
+    free (stripe->slot);
+    return 0;
+}
+
+/*
+ * Return the read-write lock that protects "key" (or NULL, if the
+ * table isn't valid).
+ */
+rwlock_t *stripe_rwlock (stripe_t *stripe, uint64_t key)
+{
+    if (stripe->valid != STRIPE_VALID)
+        return NULL;
+    return &stripe->slot[stripe_index (stripe, key)].lock;
+}
+
+/*
+ * Lock the stripe for "key" for read access.
+ */
+int stripe_readlock (stripe_t *stripe, uint64_t key)
+{
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    return rwl_readlock (&stripe->slot[stripe_index (stripe, key)].lock);
+}
+
+/*
+ * Unlock the stripe for "key" from read access.
+ */
+int stripe_readunlock (stripe_t *stripe, uint64_t key)
+{
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    return rwl_readunlock (&stripe->slot[stripe_index (stripe, key)].lock);
+}
+
+/*
+ * Lock the stripe for "key" for write access.
+ */
+int stripe_writelock (stripe_t *stripe, uint64_t key)
+{
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    return rwl_writelock (&stripe->slot[stripe_index (stripe, key)].lock);
+}
+
+/*
+ * Unlock the stripe for "key" from write access.
+ */
+int stripe_writeunlock (stripe_t *stripe, uint64_t key)
+{
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    return rwl_writeunlock (&stripe->slot[stripe_index (stripe, key)].lock);
+}
+
+/*
+ * Find the distinct stripes that protect "count" keys, storing
+ * their numbers in "index" in increasing order, and return how many
+ * there are; or -1 if there are too many keys.
+ */
+static int stripe_sort (
+    stripe_t *stripe, const uint64_t *keys, int count, unsigned int *index)
+{
+    unsigned int x;
+    int i, j, n = 0;
+
+    if (count < 0 || count > STRIPE_MAX_KEYS)
+        return -1;
+    for (i = 0; i < count; i++) {
+        x = stripe_index (stripe, keys[i]);
+        for (j = n; j > 0 && index[j - 1] > x; j--)
+            ;
+        if (j > 0 && index[j - 1] == x)
+            continue;                   /* already have it */
+        memmove (&index[j + 1], &index[j], (n - j) * sizeof (unsigned int));
+        index[j] = x;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Unlock the stripes a multi-key lock has locked, in reverse order,
+ * returning the first error. This is also the cleanup handler for a
+ * multi-key lock that's cancelled while it waits.
+ */
+static int stripe_release (stripe_taken_t *taken)
+{
+    rwlock_t *lock;
+    int status = 0, status1;
+
+    while (taken->taken > 0) {
+        taken->taken--;
+        lock = &taken->stripe->slot[taken->index[taken->taken]].lock;
+        if (taken->write)
+            status1 = rwl_writeunlock (lock);
+        else
+            status1 = rwl_readunlock (lock);
+        if (status == 0)
+            status = status1;
+    }
+    return status;
+}
+
+static void stripe_cleanup (void *arg)
+{
+    stripe_release ((stripe_taken_t*)arg);
+}
+
+/*
+ * Lock the stripes for a set of keys, in increasing order. (The
+ * status is volatile because it's set between
+ * pthread_cleanup_push and pthread_cleanup_pop, which may be built
+ * on setjmp.)
+ */
+static int stripe_lock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count, int write)
+{
+    unsigned int index[STRIPE_MAX_KEYS];
+    stripe_taken_t taken;
+    rwlock_t *lock;
+    volatile int status = 0;
+    int n;
+
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    n = stripe_sort (stripe, keys, count, index);
+    if (n < 0)
+        return EINVAL;
+    taken.stripe = stripe;
+    taken.index = index;
+    taken.taken = 0;
+    taken.write = write;
+    pthread_cleanup_push (stripe_cleanup, (void*)&taken);
+    while (taken.taken < n) {
+        lock = &stripe->slot[index[taken.taken]].lock;
+        status = write ? rwl_writelock (lock) : rwl_readlock (lock);
+        if (status != 0)
+            break;
+        taken.taken++;
+    }
+    pthread_cleanup_pop (taken.taken < n);
+    return status;
+}
+
+/*
+ * Unlock the stripes for a set of keys.
+ */
+static int stripe_unlock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count, int write)
+{
+    unsigned int index[STRIPE_MAX_KEYS];
+    stripe_taken_t taken;
+
+    if (stripe->valid != STRIPE_VALID)
+        return EINVAL;
+    taken.taken = stripe_sort (stripe, keys, count, index);
+    if (taken.taken < 0)
+        return EINVAL;
+    taken.stripe = stripe;
+    taken.index = index;
+    taken.write = write;
+    return stripe_release (&taken);
+}
+
+/*
+ * Lock the stripes for "count" keys (at most STRIPE_MAX_KEYS) for
+ * read access.
+ */
+int stripe_readlock_keys (stripe_t *stripe, const uint64_t *keys, int count)
+{
+    return stripe_lock_keys (stripe, keys, count, 0);
+}
+
+/*
+ * Unlock the stripes for "count" keys from read access.
+ */
+int stripe_readunlock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count)
+{
+    return stripe_unlock_keys (stripe, keys, count, 0);
+}
+
+/*
+ * Lock the stripes for "count" keys (at most STRIPE_MAX_KEYS) for
+ * write access.
+ */
+int stripe_writelock_keys (stripe_t *stripe, const uint64_t *keys, int count)
+{
+    return stripe_lock_keys (stripe, keys, count, 1);
+}
+
+/*
+ * Unlock the stripes for "count" keys from write access.
+ */
+int stripe_writeunlock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count)
+{
+    return stripe_unlock_keys (stripe, keys, count, 1);
+}
@@ -0,0 +1,75 @@
+/*
+ * stripe.h
+ *
+ * This header file describes a "lock striping" table: a fixed set
+ * of read-write locks (rwlock.c) shared by any number of records,
+ * each record being protected by the lock its key hashes to. The
+ * memory the locks take is set by the number of stripes, not the
+ * number of records, and each lock has a cache line (or more) to
+ * itself, so that threads using locks that happen to be adjacent
+ * don't slow each other down. The price is that records whose keys
+ * hash to the same stripe share a lock, so more stripes mean less
+ * contention between unrelated records.
+ *
+ * The stripe_init() and stripe_destroy() functions, respectively,
+ * allow you to initialize/create and destroy/free a table. The
+ * number of stripes is rounded up to a power of two.
+ *
+ * The stripe_readlock() and stripe_writelock() functions lock the
+ * stripe for a single key, and stripe_readunlock() and
+ * stripe_writeunlock() unlock it; stripe_rwlock() returns the
+ * stripe's read-write lock itself, for the other rwl_ functions.
+ *
+ * A thread that must lock several keys at once should use
+ * stripe_readlock_keys() or stripe_writelock_keys() (and the
+ * matching unlock functions), which lock the keys' stripes in order
+ * of stripe number, and each stripe only once however many of the
+ * keys hash to it, so that two threads locking overlapping sets of
+ * keys can't deadlock. (A thread that already holds a stripe
+ * mustn't lock another with stripe_readlock() or
+ * stripe_writelock(), for the same reason.)
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include "rwlock.h"
+
+#define STRIPE_ALIGN    64              /* cache line size */
+#define STRIPE_MAX_KEYS 64              /* keys per multi-key lock */
+
+/*
+ * One stripe, padded out to a whole number of cache lines.
+ */
+typedef struct stripe_slot_tag {
+    _Alignas (STRIPE_ALIGN) rwlock_t lock;
+} stripe_slot_t;
+
+/*
+ * Structure describing a lock striping table.
+ */
+typedef struct stripe_tag {
+    stripe_slot_t       *slot;          /* array of stripes */
+    unsigned int        mask;           /* stripes - 1 */
+    unsigned int        shift;          /* 64 - log2(stripes) */
+    int                 valid;          /* set when valid */
+} stripe_t;
+
+#define STRIPE_VALID    0x5791be
+
+/*
+ * Define lock striping functions
+ */
+extern int stripe_init (stripe_t *stripe, int count, const rwl_attr_t *attr);
+extern int stripe_destroy (stripe_t *stripe);
+extern rwlock_t *stripe_rwlock (stripe_t *stripe, uint64_t key);
+extern int stripe_readlock (stripe_t *stripe, uint64_t key);
+extern int stripe_readunlock (stripe_t *stripe, uint64_t key);
+extern int stripe_writelock (stripe_t *stripe, uint64_t key);
+extern int stripe_writeunlock (stripe_t *stripe, uint64_t key);
+extern int stripe_readlock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count);
+extern int stripe_readunlock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count);
+extern int stripe_writelock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count);
+extern int stripe_writeunlock_keys (
+    stripe_t *stripe, const uint64_t *keys, int count);
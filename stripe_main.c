@@ -0,0 +1,629 @@
+/*
+ * stripe_main.c
+ *
+ * Demonstrate use of a lock striping table, as implemented by
+ * stripe.c, by running a workload like that of rwlock_main.c over a
+ * large array of records: each thread reads a random record each
+ * iteration, except that every "interval" iterations it moves one
+ * unit from one random record to another, locking both records for
+ * write. The workload runs once with a read-write lock in each
+ * record (taking the two locks in order of record number, so that
+ * transfers can't deadlock), and once with a table of striped
+ * locks, using stripe_writelock_keys. Each run reports how much
+ * memory the locks took and how long it took, and checks that the
+ * records still add up to what they started with.
+ *
+ * Before the runs, it also checks how keys that differ only in
+ * their high bits (i << 40, for as many i as there are stripes)
+ * spread across the stripes, and reports how many stripes they use.
+ *
+ * Before the runs, too, it checks the multi-key locks on their own
+ * (so that a deadlock is reported rather than hanging a run). 32
+ * threads share a table of just 2 stripes, locking sets of keys
+ * for write (to transfer between them) or for read (checking that
+ * the records don't change while they're locked), with each set
+ * listing its keys in random order, and including a key twice and
+ * two keys that hash to the same stripe; if the stripes weren't
+ * sorted and de-duplicated, the threads would deadlock, so the
+ * stress run is given a time limit. Then a thread waiting in
+ * stripe_writelock_keys, and one waiting in stripe_readlock_keys,
+ * for a stripe held by the main thread, is cancelled: each should
+ * leave the stripe it had already locked unlocked.
+ *
+ * Usage: stripe_main [threads [iterations [records [stripes]]]]
+ */
+#include <pthread.h>
+#include <time.h>
+#include "stripe.h"
+#include "errors.h"
+
+#define MAX_THREADS     64
+#define VALUE           100             /* starting value of a record */
+#define TIGHT_THREADS   32              /* threads for the stress run */
+#define TIGHT_STRIPES   2               /* ... stripes */
+#define TIGHT_RECORDS   16              /* ... records */
+#define TIGHT_KEYS      6               /* ... most keys locked at once */
+#define TIGHT_ITERATIONS 10000          /* ... iterations per thread */
+#define TIGHT_LIMIT     60              /* ... most seconds it may take */
+
+/*
+ * Keep statistics for each thread.
+ */
+typedef struct thread_tag {
+    int         thread_num;
+    pthread_t   thread_id;
+    int         transfers;
+    long        reads;
+    long        changed;                /* records changed while locked */
+    int         interval;
+} thread_t;
+
+/*
+ * A record with a read-write lock of its own.
+ */
+typedef struct data_tag {
+    rwlock_t    lock;
+    long        value;
+} data_t;
+
+thread_t threads[MAX_THREADS];
+data_t *data;                           /* records with locks */
+long *values;                           /* records for stripes */
+stripe_t stripe;
+stripe_t tight;                         /* 2 stripes, for the stress run */
+long tight_values[TIGHT_RECORDS];       /* ... its records */
+int mate[TIGHT_RECORDS];                /* ... another on each stripe */
+pthread_mutex_t finished_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+int finished;                           /* stress threads finished */
+uint64_t cancel_keys[2];                /* keys on each stripe of tight */
+int thread_count = 5;
+int iterations = 1000000;
+int records = 100000;
+int stripes = 256;
+
+/*
+ * The locking for one run: functions to read a record, and to move
+ * one unit from one record to another.
+ */
+typedef struct lock_ops_tag {
+    const char  *name;
+    long        (*read) (int element);
+    void        (*transfer) (int from, int to);
+} lock_ops_t;
+
+lock_ops_t *ops;                        /* locking for this run */
+
+/*
+ * Read a record, with a lock in each record.
+ */
+long read_locks (int element)
+{
+    long value;
+    int status;
+
+    status = rwl_readlock (&data[element].lock);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    value = data[element].value;
+    status = rwl_readunlock (&data[element].lock);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    return value;
+}
+
+/*
+ * Move one unit from record "from" to record "to", with a lock in
+ * each record.
+ */
+void transfer_locks (int from, int to)
+{
+    int first = from < to ? from : to, second = from < to ? to : from;
+    int status;
+
+    status = rwl_writelock (&data[first].lock);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    if (second != first) {
+        status = rwl_writelock (&data[second].lock);
+        if (status != 0)
+            err_abort (status, "Write lock");
+    }
+    if (data[from].value > 0) {
+        data[from].value--;
+        data[to].value++;
+    }
+    if (second != first) {
+        status = rwl_writeunlock (&data[second].lock);
+        if (status != 0)
+            err_abort (status, "Write unlock");
+    }
+    status = rwl_writeunlock (&data[first].lock);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+}
+
+/*
+ * Read a record, with striped locks.
+ */
+long read_stripes (int element)
+{
+    long value;
+    int status;
+
+    status = stripe_readlock (&stripe, element);
+    if (status != 0)
+        err_abort (status, "Read lock");
+    value = values[element];
+    status = stripe_readunlock (&stripe, element);
+    if (status != 0)
+        err_abort (status, "Read unlock");
+    return value;
+}
+
+/*
+ * Move one unit from record "from" to record "to", with striped
+ * locks.
+ */
+void transfer_stripes (int from, int to)
+{
+    uint64_t keys[2];
+    int status;
+
+    keys[0] = from;
+    keys[1] = to;
+    status = stripe_writelock_keys (&stripe, keys, 2);
+    if (status != 0)
+        err_abort (status, "Write lock keys");
+    if (values[from] > 0) {
+        values[from]--;
+        values[to]++;
+    }
+    status = stripe_writeunlock_keys (&stripe, keys, 2);
+    if (status != 0)
+        err_abort (status, "Write unlock keys");
+}
+
+/*
+ * Thread start routine that uses the locks
+ */
+void *thread_routine (void *arg)
+{
+    thread_t *self = (thread_t*)arg;
+    unsigned int seed = self->thread_num;
+    int iteration, element;
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        element = rand_r (&seed) % records;
+
+        /*
+         * Each "self->interval" iterations, perform a transfer
+         * (write locks on two records instead of a read lock on
+         * one).
+         */
+        if ((iteration % self->interval) == 0) {
+            ops->transfer (element, rand_r (&seed) % records);
+            self->transfers++;
+        } else {
+            if (ops->read (element) < 0)
+                err_abort (EINVAL, "Negative value");
+            self->reads++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Report how many distinct stripes the keys i << 40 map to, for i
+ * from 0 to one less than the number of stripes. (A hash that only
+ * looked at the low bits of the keys would put them all on one.)
+ */
+void spread (void)
+{
+    unsigned int size = stripe.mask + 1, index, used = 0;
+    uint64_t key;
+    char *seen;
+
+    seen = (char*)calloc (size, 1);
+    if (seen == NULL)
+        errno_abort ("Allocate seen");
+    for (key = 0; key < size; key++) {
+        index = (stripe_slot_t*)stripe_rwlock (&stripe, key << 40)
+            - stripe.slot;
+        if (!seen[index]) {
+            seen[index] = 1;
+            used++;
+        }
+    }
+    printf ("high-bit keys: %u keys use %u of %u stripes\n",
+        size, used, size);
+    free (seen);
+}
+
+/*
+ * Run the workload once, with the locking "ops", and report the
+ * results.
+ */
+void run (size_t lock_bytes)
+{
+    struct timespec begin, end;
+    unsigned int seed = 1;
+    int transfers = 0, count, status;
+    long reads = 0, total = 0;
+    double seconds;
+
+    clock_gettime (CLOCK_MONOTONIC, &begin);
+    for (count = 0; count < thread_count; count++) {
+        threads[count].thread_num = count;
+        threads[count].transfers = 0;
+        threads[count].reads = 0;
+        threads[count].interval = rand_r (&seed) % 71 + 1;
+        status = pthread_create (&threads[count].thread_id,
+            NULL, thread_routine, (void*)&threads[count]);
+        if (status != 0)
+            err_abort (status, "Create thread");
+    }
+    for (count = 0; count < thread_count; count++) {
+        status = pthread_join (threads[count].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join thread");
+        transfers += threads[count].transfers;
+        reads += threads[count].reads;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    for (count = 0; count < records; count++)
+        total += ops->read (count);
+    seconds = (end.tv_sec - begin.tv_sec)
+        + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf ("%s: %lu bytes of locks, %ld reads, %d transfers"
+        " in %.3f seconds, %.1f ns per iteration\n",
+        ops->name, (unsigned long)lock_bytes, reads, transfers, seconds,
+        seconds * 1e9 / ((double)thread_count * iterations));
+    if (total != (long)records * VALUE)
+        printf ("%s: total is %ld, not %ld!\n",
+            ops->name, total, (long)records * VALUE);
+}
+
+/*
+ * Choose a set of keys for the stress run, in random order: a key,
+ * the same key again, another key on the same stripe (if there is
+ * one), and up to TIGHT_KEYS - 3 more. Return the number of keys.
+ */
+int tight_keys (uint64_t *keys, unsigned int *seed)
+{
+    int count = 3 + rand_r (seed) % (TIGHT_KEYS - 2), i, j;
+    uint64_t swap;
+
+    keys[0] = rand_r (seed) % TIGHT_RECORDS;
+    keys[1] = keys[0];
+    keys[2] = mate[keys[0]];
+    for (i = 3; i < count; i++)
+        keys[i] = rand_r (seed) % TIGHT_RECORDS;
+    for (i = count - 1; i > 0; i--) {
+        j = rand_r (seed) % (i + 1);
+        swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+    return count;
+}
+
+/*
+ * Thread start routine for the stress run: lock sets of keys that
+ * overlap other threads' sets, and stripes, in every order.
+ */
+void *tight_routine (void *arg)
+{
+    thread_t *self = (thread_t*)arg;
+    unsigned int seed = self->thread_num;
+    uint64_t keys[TIGHT_KEYS];
+    long before[TIGHT_KEYS];
+    int iteration, count, i, status;
+
+    for (iteration = 0; iteration < TIGHT_ITERATIONS; iteration++) {
+        count = tight_keys (keys, &seed);
+        if ((iteration % self->interval) == 0) {
+            /*
+             * Move one unit from the first key to the last.
+             */
+            status = stripe_writelock_keys (&tight, keys, count);
+            if (status != 0)
+                err_abort (status, "Write lock keys");
+            if (tight_values[keys[0]] > 0) {
+                tight_values[keys[0]]--;
+                tight_values[keys[count - 1]]++;
+            }
+            status = stripe_writeunlock_keys (&tight, keys, count);
+            if (status != 0)
+                err_abort (status, "Write unlock keys");
+            self->transfers++;
+        } else {
+            /*
+             * Read the records twice, letting other threads run in
+             * between: with the stripes locked for read, they
+             * mustn't change.
+             */
+            status = stripe_readlock_keys (&tight, keys, count);
+            if (status != 0)
+                err_abort (status, "Read lock keys");
+            for (i = 0; i < count; i++)
+                before[i] = tight_values[keys[i]];
+            sched_yield ();
+            for (i = 0; i < count; i++)
+                if (tight_values[keys[i]] != before[i])
+                    self->changed++;
+            status = stripe_readunlock_keys (&tight, keys, count);
+            if (status != 0)
+                err_abort (status, "Read unlock keys");
+            self->reads++;
+        }
+    }
+    status = pthread_mutex_lock (&finished_mutex);
+    if (status != 0)
+        err_abort (status, "Lock finished mutex");
+    finished++;
+    status = pthread_cond_signal (&finished_cond);
+    if (status != 0)
+        err_abort (status, "Signal finished");
+    status = pthread_mutex_unlock (&finished_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock finished mutex");
+    return NULL;
+}
+
+/*
+ * Run TIGHT_THREADS threads locking sets of keys on a table of
+ * TIGHT_STRIPES stripes. If they haven't all finished within
+ * TIGHT_LIMIT seconds, they must have deadlocked: report that,
+ * and return 1 (the threads can't be joined).
+ */
+int stress (void)
+{
+    struct timespec begin, end, limit;
+    unsigned int seed = 1;
+    int transfers = 0, count, other, status;
+    long reads = 0, changed = 0, total = 0;
+    double seconds;
+
+    status = stripe_init (&tight, TIGHT_STRIPES, NULL);
+    if (status != 0)
+        err_abort (status, "Init stripes");
+    for (count = 0; count < TIGHT_RECORDS; count++) {
+        tight_values[count] = VALUE;
+        mate[count] = count;
+        for (other = 0; other < TIGHT_RECORDS; other++)
+            if (other != count && stripe_rwlock (&tight, other)
+                    == stripe_rwlock (&tight, count))
+                mate[count] = other;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &begin);
+    finished = 0;
+    for (count = 0; count < TIGHT_THREADS; count++) {
+        threads[count].thread_num = count;
+        threads[count].transfers = 0;
+        threads[count].reads = 0;
+        threads[count].changed = 0;
+        threads[count].interval = rand_r (&seed) % 4 + 1;
+        status = pthread_create (&threads[count].thread_id,
+            NULL, tight_routine, (void*)&threads[count]);
+        if (status != 0)
+            err_abort (status, "Create thread");
+    }
+    clock_gettime (CLOCK_REALTIME, &limit);
+    limit.tv_sec += TIGHT_LIMIT;
+    status = pthread_mutex_lock (&finished_mutex);
+    if (status != 0)
+        err_abort (status, "Lock finished mutex");
+    while (finished < TIGHT_THREADS) {
+        status = pthread_cond_timedwait (
+            &finished_cond, &finished_mutex, &limit);
+        if (status == ETIMEDOUT)
+            break;
+        if (status != 0)
+            err_abort (status, "Wait for finished");
+    }
+    count = finished;
+    status = pthread_mutex_unlock (&finished_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock finished mutex");
+    if (count < TIGHT_THREADS) {
+        printf ("stress: only %d of %d threads finished in %d seconds:"
+            " deadlocked!\n", count, TIGHT_THREADS, TIGHT_LIMIT);
+        return 1;
+    }
+    for (count = 0; count < TIGHT_THREADS; count++) {
+        status = pthread_join (threads[count].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join thread");
+        transfers += threads[count].transfers;
+        reads += threads[count].reads;
+        changed += threads[count].changed;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    for (count = 0; count < TIGHT_RECORDS; count++)
+        total += tight_values[count];
+    seconds = (end.tv_sec - begin.tv_sec)
+        + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf ("stress: %d threads on %d stripes: %ld reads, %d transfers"
+        " of up to %d keys in %.3f seconds\n", TIGHT_THREADS,
+        TIGHT_STRIPES, reads, transfers, TIGHT_KEYS, seconds);
+    if (changed != 0)
+        printf ("stress: %ld records changed while locked for read!\n",
+            changed);
+    if (total != (long)TIGHT_RECORDS * VALUE)
+        printf ("stress: total is %ld, not %ld!\n",
+            total, (long)TIGHT_RECORDS * VALUE);
+    return 0;
+}
+
+/*
+ * Thread start routine that locks the stripes for "cancel_keys",
+ * for write or for read, and should be cancelled while it waits.
+ */
+void *cancel_routine (void *arg)
+{
+    int write = *(int*)arg;
+    int status;
+
+    if (write)
+        status = stripe_writelock_keys (&tight, cancel_keys, 2);
+    else
+        status = stripe_readlock_keys (&tight, cancel_keys, 2);
+    if (status != 0)
+        err_abort (status, "Lock keys");
+    printf ("cancel: got both stripes while the other was held!\n");
+    return NULL;
+}
+
+/*
+ * With the second of two stripes locked for write, start a thread
+ * that locks both; once it has the first, cancel it while it waits
+ * for the second, and check that the first is free again. If it
+ * isn't, report that, and return 1 (the table can't be destroyed).
+ */
+int cancel (int write)
+{
+    const char *mode = write ? "write" : "read";
+    struct timespec delay;
+    rwlock_t *first, *second;
+    pthread_t thread_id;
+    void *result;
+    int count, status;
+
+    first = stripe_rwlock (&tight, cancel_keys[0]);
+    second = stripe_rwlock (&tight, cancel_keys[1]);
+    status = rwl_writelock (second);
+    if (status != 0)
+        err_abort (status, "Write lock");
+    status = pthread_create (
+        &thread_id, NULL, cancel_routine, (void*)&write);
+    if (status != 0)
+        err_abort (status, "Create thread");
+    for (count = 0; count < 10000; count++) {
+        status = rwl_writetrylock (first);
+        if (status == EBUSY)
+            break;
+        if (status != 0)
+            err_abort (status, "Write trylock");
+        status = rwl_writeunlock (first);
+        if (status != 0)
+            err_abort (status, "Write unlock");
+        delay.tv_sec = 0;
+        delay.tv_nsec = 1000000;
+        nanosleep (&delay, NULL);
+    }
+    if (count == 10000)
+        printf ("cancel: %s thread never locked the first stripe!\n",
+            mode);
+    status = pthread_cancel (thread_id);
+    if (status != 0)
+        err_abort (status, "Cancel thread");
+    status = pthread_join (thread_id, &result);
+    if (status != 0)
+        err_abort (status, "Join thread");
+    if (result != PTHREAD_CANCELED)
+        printf ("cancel: %s thread wasn't cancelled!\n", mode);
+    status = rwl_writetrylock (first);
+    if (status != 0) {
+        printf ("cancel: %s: first stripe still locked after the"
+            " cancel!\n", mode);
+        return 1;
+    }
+    status = rwl_writeunlock (first);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    status = rwl_writeunlock (second);
+    if (status != 0)
+        err_abort (status, "Write unlock");
+    printf ("cancel: %s: thread cancelled waiting for the second"
+        " stripe, holding the first; first stripe free again\n", mode);
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    lock_ops_t per_record = {"per-record", read_locks, transfer_locks};
+    lock_ops_t striped = {"striped", read_stripes, transfer_stripes};
+    int count, status;
+
+    if (argc > 1)
+        thread_count = atoi (argv[1]);
+    if (argc > 2)
+        iterations = atoi (argv[2]);
+    if (argc > 3)
+        records = atoi (argv[3]);
+    if (argc > 4)
+        stripes = atoi (argv[4]);
+    if (thread_count < 1 || thread_count > MAX_THREADS
+            || iterations < 1 || records < 1 || stripes < 1) {
+        fprintf (stderr, "Usage: %s [threads [iterations [records"
+            " [stripes]]]] (1 to %d threads)\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+#ifdef sun
+    /*
+     * On Solaris 2.5, threads are not timesliced. To ensure
+     * that our threads can run concurrently, we need to
+     * increase the concurrency level.
+     */
+    DPRINTF (("Setting concurrency level to %d\n", thread_count));
+    thr_setconcurrency (thread_count);
+#endif
+
+    data = (data_t*)calloc (records, sizeof (data_t));
+    values = (long*)calloc (records, sizeof (long));
+    if (data == NULL || values == NULL)
+        errno_abort ("Allocate records");
+    for (count = 0; count < records; count++) {
+        status = rwl_init (&data[count].lock);
+        if (status != 0)
+            err_abort (status, "Init rw lock");
+        data[count].value = VALUE;
+        values[count] = VALUE;
+    }
+    status = stripe_init (&stripe, stripes, NULL);
+    if (status != 0)
+        err_abort (status, "Init stripes");
+    spread ();
+
+    /*
+     * Check the multi-key locks on their own first, since a
+     * deadlock in the runs would hang the program.
+     */
+    if (stress () != 0)
+        return 1;
+    cancel_keys[0] = 0;
+    for (count = 1; count < TIGHT_RECORDS; count++)
+        if (stripe_rwlock (&tight, count) != stripe_rwlock (&tight, 0))
+            break;
+    cancel_keys[1] = count;
+    if (stripe_rwlock (&tight, cancel_keys[0])
+            > stripe_rwlock (&tight, cancel_keys[1])) {
+        cancel_keys[0] = count;
+        cancel_keys[1] = 0;
+    }
+    if (cancel (1) != 0 || cancel (0) != 0)
+        return 1;
+    status = stripe_destroy (&tight);
+    if (status != 0)
+        err_abort (status, "Destroy stripes");
+
+    ops = &per_record;
+    run ((size_t)records * sizeof (rwlock_t));
+    ops = &striped;
+    run ((size_t)(stripe.mask + 1) * sizeof (stripe_slot_t));
+
+    for (count = 0; count < records; count++) {
+        status = rwl_destroy (&data[count].lock);
+        if (status != 0)
+            err_abort (status, "Destroy rw lock");
+    }
+    status = stripe_destroy (&stripe);
+    if (status != 0)
+        err_abort (status, "Destroy stripes");
+    free (data);
+    free (values);
+    return 0;
+}
@@ -19,289 +19,3574 @@
  * processing engine until the queue is empty; at that point,
  * processing threads will begin to shut down. (They will be
  * restarted when work appears.)
+ *
+ * Each server thread owns a fixed-size deque (the "Chase-Lev"
+ * work-stealing deque). When an engine routine adds work, the
+ * item is pushed on the bottom of its server's deque, and that
+ * server pops it back off the bottom when the engine returns --
+ * no mutex is involved. A server that finds both its own deque
+ * and the shared queue empty picks a random victim and steals
+ * from the top of the victim's deque. Only the owner touches the
+ * bottom, so the owner and thieves contend (with a single
+ * compare-and-swap) only for the last remaining item.
+ *
+ * A bounded work queue replaces the shared list with a ring of
+ * preallocated cells (a multi-producer, multi-consumer queue in
+ * the style described by Dmitry Vyukov). Each cell carries a
+ * sequence number that tells a producer when the cell is free
+ * and a consumer when it has been filled, so producers and
+ * servers each claim a cell with one compare-and-swap, and the
+ * mutex is needed only to wait.
+ *
+ * Queue entries are recycled rather than freed. Each thread keeps
+ * a "magazine" (a private free list) of entries: a server's is
+ * part of its slot, and any other thread's is found through
+ * thread-specific data. Servers free entries into their own
+ * magazine, and when it fills, push the whole batch onto the
+ * queue's "returned" stack of batches with one compare-and-swap.
+ * A thread whose magazine is empty takes the entire stack with
+ * one atomic exchange (so there's no ABA problem), keeps the
+ * first batch, and pushes the rest back; it calls malloc only if
+ * the stack was empty. Because no thread holds more than one
+ * batch, the total number of entries settles at the queue's
+ * working size, after which adding and running requests makes no
+ * heap calls.
+ *
+ * The shared queue (or ring) is really one per priority, each
+ * called a "lane". Rather than contend for a shared round-robin
+ * position, each server keeps its own credits for the weighted
+ * policy. Every entry is stamped with the time it was queued, and
+ * a server records how long each request waited, just before
+ * running it, in a histogram of its own, and times each call of
+ * the engine the same way; workq_delay and workq_stats add up
+ * the servers' histograms.
+ *
+ * Keyed requests are queued on a "strand" for their key, found
+ * through a hash table. A strand with requests is either on the
+ * list of runnable strands, or being run by a server -- never
+ * both, so a key's requests can't run concurrently, or out of
+ * order. A server takes one turn of a strand (a single request,
+ * or as many as fit in a batch), and then puts it back at the end
+ * of the runnable list if more requests have arrived; a strand
+ * that's empty when its turn ends is removed from the table.
+ *
+ * A future handle is a one-shot event: its state goes from
+ * pending to done exactly once, when the server stores the
+ * result. A waiting thread doesn't need a condition variable of
+ * its own; it marks the handle "parked" and waits on one of a
+ * table of condition variables, chosen by hashing the handle's
+ * address. The server only has to lock that slot's mutex (and
+ * broadcast) if it finds the handle parked, so a caller that
+ * collects its result after it's ready never sleeps, and the
+ * server never touches a mutex.
+ *
+ * Delayed and periodic items wait in a binary heap, ordered by
+ * deadline and protected by the mutex. Rather than have every
+ * idle server wake at each deadline, one of them becomes the
+ * "keeper" and waits only until the earliest deadline (the
+ * condition variable uses CLOCK_MONOTONIC, so that changes to the
+ * time of day don't matter). When the keeper stops waiting, it
+ * wakes another idle server to take its place. Servers take due
+ * items from the heap in workq_get, so a busy server fires them
+ * without waiting at all; the earliest deadline is also kept in
+ * an atomic variable, so that they needn't lock the mutex (or,
+ * when nothing is pending, even read the clock) to find out.
+ *
+ * Server slots are allocated once, for the most threads the work
+ * queue may ever have; "parallelism" is only a limit on how many
+ * are in use. The autoscaler runs whenever a server or producer
+ * notices (by reading the clock it has already read, or is about
+ * to) that an interval has passed since the last adjustment. It
+ * compares the mean wait of the requests started in that interval
+ * with the target: above it, with requests waiting, counts as a
+ * vote to grow; well below it (a quarter), with threads to spare,
+ * as a vote to shrink. It takes WORKQ_SCALE_UP votes in a row to
+ * grow (by a quarter), and WORKQ_SCALE_DOWN to shrink (by one),
+ * so a short burst or lull doesn't change anything, and a pool
+ * that's just big enough doesn't flap.
+ *
+ * Placement is decided for each server slot when the work queue
+ * is initialized, from the processors the process may run on and
+ * the NUMA node of each (read from sysfs; without it, they're all
+ * on one node). A server binds itself to its slot's processor
+ * when it claims the slot. The processor-to-node map also tells
+ * a producer which node's queue to use (sched_getcpu is only a
+ * hint, since the thread may move, but a wrong guess only costs
+ * locality). Nodes without servers get no queue of their own, so
+ * their requests can't be left waiting for a remote server to run
+ * out of work.
  */
+#ifdef __linux__
+# define _GNU_SOURCE                    /* for CPU affinity */
+#endif
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <time.h>
 #include "errors.h"
 #include "workq.h"
 
+#define WORKQ_DEQUE_SIZE        256     /* must be a power of 2 */
+#define WORKQ_CACHE_LINE        64
+
 /*
- * Thread start routine to serve the work queue.
+ * A server's work-stealing deque. The owner pushes and takes at
+ * "bottom"; thieves steal at "top". Keep the two indices on
+ * separate cache lines, since they're written by different
+ * threads.
  */
-static void *workq_server (void *arg)
+typedef struct workq_deque_tag {
+    atomic_long         top;
+    char                pad1[WORKQ_CACHE_LINE - sizeof (atomic_long)];
+    atomic_long         bottom;
+    char                pad2[WORKQ_CACHE_LINE - sizeof (atomic_long)];
+    _Atomic (workq_ele_t *) slot[WORKQ_DEQUE_SIZE];
+} workq_deque_t;
+
+/*
+ * A per-thread cache of free queue entries. Magazines belonging
+ * to threads other than servers are linked on the work queue,
+ * so they can be reused (after the owner exits) and freed by
+ * workq_destroy.
+ */
+#define WORKQ_MAGAZINE          64      /* entries before returning */
+
+typedef struct workq_magazine_tag {
+    struct workq_magazine_tag *link;    /* all producer magazines */
+    workq_t             *wq;            /* owning work queue */
+    workq_ele_t         *first;         /* entries freed here */
+    int                 count;          /* number freed here */
+    workq_ele_t         *spare;         /* entries taken from returned */
+    int                 owned;          /* in use by a thread */
+} workq_magazine_t;
+
+/*
+ * A histogram that's written only by the server that owns it,
+ * but may be read at any time by workq_delay or workq_stats.
+ */
+typedef struct workq_histo_tag {
+    atomic_ullong       count;
+    atomic_ullong       sum;
+    atomic_ullong       max;
+    atomic_ullong       bucket[WORKQ_BUCKETS];
+} workq_histo_t;
+
+/*
+ * Per-server state. A slot is claimed by a server thread when it
+ * starts, and released (with an empty deque) when it exits.
+ */
+typedef struct workq_server_tag {
+    workq_deque_t       deque;
+    workq_magazine_t    magazine;       /* free entries */
+    int                 busy;           /* slot owned by a thread */
+    unsigned int        seed;           /* victim selection */
+    unsigned int        ticks;          /* requests taken */
+    workq_ele_t         *items;         /* requests being run */
+    void                **data;         /* ... for batch engine */
+    struct workq_strand_tag *strand;    /* key being run, if any */
+    int                 credit[WORKQ_PRIORITIES]; /* weighted dequeue */
+    workq_histo_t       delay[WORKQ_PRIORITIES];  /* time queued */
+    workq_histo_t       service;        /* time in engine */
+    atomic_ullong       steals;         /* requests stolen */
+    atomic_long         finished[2];    /* requests run, by epoch parity */
+    atomic_ullong       remote;         /* ... from another node */
+    int                 cpu;            /* processor (-1 if unbound) */
+    int                 node;           /* ... and its node */
+} workq_server_t;
+
+/*
+ * A cell of the bounded ring. Entries are copied in and out, so
+ * a bounded queue never allocates memory for a request.
+ */
+typedef struct workq_cell_tag {
+    atomic_size_t       seq;
+    workq_ele_t         ele;
+} workq_cell_t;
+
+typedef struct workq_ring_tag {
+    atomic_size_t       head;           /* next cell to dequeue */
+    char                pad1[WORKQ_CACHE_LINE - sizeof (atomic_size_t)];
+    atomic_size_t       tail;           /* next cell to enqueue */
+    char                pad2[WORKQ_CACHE_LINE - sizeof (atomic_size_t)];
+    size_t              mask;           /* number of cells - 1 */
+    workq_cell_t        cell[1];        /* (really mask + 1) */
+} workq_ring_t;
+
+/*
+ * One priority's part of the shared queue: a list, or a ring for
+ * a bounded work queue.
+ */
+typedef struct workq_lane_tag {
+    workq_ele_t         *first, *last;  /* queued requests */
+    workq_ring_t        *ring;          /* bounded queue */
+    int                 queued;         /* requests on the list */
+    int                 weight;         /* share, if WORKQ_WEIGHTED */
+} workq_lane_t;
+
+/*
+ * A NUMA node's queue, for requests of the lowest priority added
+ * by threads running on the node. Each has its own mutex, and is
+ * padded so that the nodes' queues don't share a cache line.
+ */
+#define WORKQ_MAX_NODES         64      /* node numbers we look for */
+
+typedef struct workq_node_tag {
+    pthread_mutex_t     mutex;
+    workq_ele_t         *first, *last;  /* queued requests */
+    atomic_int          queued;         /* requests on the list */
+    char                pad[WORKQ_CACHE_LINE];
+} workq_node_t;
+
+/*
+ * The requests queued for one key, and the table of keys. The
+ * table (and every strand) is protected by its own mutex, so
+ * that keyed requests don't contend with the shared queue.
+ */
+#define WORKQ_KEY_BUCKETS       256     /* must be a power of 2 */
+
+typedef struct workq_strand_tag {
+    struct workq_strand_tag *link;      /* hash chain, or free list */
+    struct workq_strand_tag *next;      /* runnable list */
+    unsigned long       key;
+    workq_ele_t         *first, *last;  /* queued requests */
+    int                 scheduled;      /* runnable, or running */
+} workq_strand_t;
+
+typedef struct workq_keys_tag {
+    pthread_mutex_t     mutex;
+    workq_strand_t      *bucket[WORKQ_KEY_BUCKETS];
+    workq_strand_t      *first, *last;  /* runnable strands */
+    workq_strand_t      *free;          /* unused strands */
+    int                 queued;         /* requests on all strands */
+} workq_keys_t;
+
+/*
+ * A future handle, and the work queue's pool of free handles.
+ */
+#define WORKQ_PENDING           0       /* function not yet run */
+#define WORKQ_PARKED            1       /* ... and a thread is waiting */
+#define WORKQ_DONE              2       /* result is ready */
+
+struct workq_future_tag {
+    struct workq_future_tag *link;      /* free list */
+    workq_t             *wq;            /* owning work queue */
+    void                *(*fn)(void *); /* function to call */
+    void                *arg;
+    void                *result;
+    atomic_int          state;          /* WORKQ_PENDING, etc. */
+};
+
+typedef struct workq_pool_tag {
+    pthread_mutex_t     mutex;
+    workq_future_t      *free;          /* free handles */
+} workq_pool_t;
+
+/*
+ * The "parking lot" of condition variables on which threads wait
+ * for futures, shared by all work queues. It's initialized (once)
+ * by the first workq_init_attr.
+ */
+#define WORKQ_PARK_SLOTS        64      /* must be a power of 2 */
+
+typedef struct workq_park_tag {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+} workq_park_t;
+
+static workq_park_t workq_park[WORKQ_PARK_SLOTS];
+static pthread_once_t workq_park_once = PTHREAD_ONCE_INIT;
+
+/*
+ * An item waiting in the timer heap. "period" is 0 for an item
+ * that's only queued once.
+ */
+typedef struct workq_timer_tag {
+    uint64_t            deadline;       /* when to queue it (ns) */
+    uint64_t            period;         /* interval, if periodic */
+    void                *data;
+    unsigned long       id;             /* for workq_cancel */
+} workq_timer_t;
+
+#define WORKQ_NEVER     (~(uint64_t)0)  /* no deadline */
+
+/*
+ * Autoscaling state, protected by the mutex (except "next", which
+ * is checked without it).
+ */
+#define WORKQ_SCALE_UP          2       /* intervals before growing */
+#define WORKQ_SCALE_DOWN        5       /* ... before shrinking */
+
+typedef struct workq_scale_tag {
+    int                 min, max;       /* limits on parallelism */
+    uint64_t            interval;       /* ns between adjustments */
+    uint64_t            target;         /* acceptable mean wait */
+    atomic_ullong       next;           /* time of next adjustment */
+    uint64_t            count, sum;     /* wait totals at last one */
+    int                 up, down;       /* votes in a row */
+} workq_scale_t;
+
+/*
+ * Returned by workq_deque_steal when it lost a race with another
+ * thread; the deque may still hold work.
+ */
+static workq_ele_t workq_abort;
+#define WORKQ_ABORT     (&workq_abort)
+
+/*
+ * Push an item on the bottom of a deque. Only the owning server
+ * may call this. Returns 0 if the deque is full.
+ */
+static int workq_deque_push (workq_deque_t *dq, workq_ele_t *we)
+{
+    long b, t;
+
+    b = atomic_load_explicit (&dq->bottom, memory_order_relaxed);
+    t = atomic_load_explicit (&dq->top, memory_order_acquire);
+    if (b - t >= WORKQ_DEQUE_SIZE)
+        return 0;
+    atomic_store_explicit (
+        &dq->slot[b & (WORKQ_DEQUE_SIZE - 1)], we,
+        memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    atomic_store_explicit (&dq->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+/*
+ * Determine how many more items the owner can push on a deque.
+ * Only the owner may call this; the result can only grow, as
+ * thieves remove items.
+ */
+static int workq_deque_room (workq_deque_t *dq)
+{
+    long b, t;
+
+    b = atomic_load_explicit (&dq->bottom, memory_order_relaxed);
+    t = atomic_load_explicit (&dq->top, memory_order_acquire);
+    return WORKQ_DEQUE_SIZE - (int)(b - t);
+}
+
+/*
+ * Take an item from the bottom of a deque (most recently pushed
+ * first). Only the owning server may call this. Returns NULL if
+ * the deque is empty.
+ */
+static workq_ele_t *workq_deque_take (workq_deque_t *dq)
 {
-    struct timespec timeout;
-    workq_t *wq = (workq_t *)arg;
     workq_ele_t *we;
-    int status, timedout;
+    long b, t;
 
-    /*
-     * We don't need to validate the workq_t here... we don't
-     * create server threads until requests are queued (the
-     * queue has been initialized by then!) and we wait for all
-     * server threads to terminate before destroying a work
-     * queue.
-     */
-    DPRINTF (("A worker is starting\n"));
-    status = pthread_mutex_lock (&wq->mutex);
-    if (status != 0)
+    b = atomic_load_explicit (&dq->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit (&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence (memory_order_seq_cst);
+    t = atomic_load_explicit (&dq->top, memory_order_relaxed);
+    if (t > b) {
+        /* Empty: restore bottom */
+        atomic_store_explicit (&dq->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    we = atomic_load_explicit (
+        &dq->slot[b & (WORKQ_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (t == b) {
+        /*
+         * This is the last item, so we have to race any thieves
+         * for it, on "top".
+         */
+        if (!atomic_compare_exchange_strong_explicit (
+                &dq->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            we = NULL;
+        atomic_store_explicit (&dq->bottom, b + 1, memory_order_relaxed);
+    }
+    return we;
+}
+
+/*
+ * Steal an item from the top of a deque (least recently pushed
+ * first). May be called by any thread. Returns NULL if the deque
+ * is empty, or WORKQ_ABORT if another thread got there first.
+ */
+static workq_ele_t *workq_deque_steal (workq_deque_t *dq)
+{
+    workq_ele_t *we;
+    long b, t;
+
+    t = atomic_load_explicit (&dq->top, memory_order_acquire);
+    atomic_thread_fence (memory_order_seq_cst);
+    b = atomic_load_explicit (&dq->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    we = atomic_load_explicit (
+        &dq->slot[t & (WORKQ_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit (
+            &dq->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return WORKQ_ABORT;
+    return we;
+}
+
+/*
+ * Allocate a ring with at least "capacity" cells.
+ */
+static workq_ring_t *workq_ring_alloc (int capacity)
+{
+    workq_ring_t *ring;
+    size_t size, i;
+
+    for (size = 1; size < (size_t)capacity; size <<= 1)
+        ;
+    ring = (workq_ring_t *)malloc (
+        sizeof (workq_ring_t) + (size - 1) * sizeof (workq_cell_t));
+    if (ring == NULL)
         return NULL;
+    atomic_init (&ring->head, 0);
+    atomic_init (&ring->tail, 0);
+    ring->mask = size - 1;
+    for (i = 0; i < size; i++)
+        atomic_init (&ring->cell[i].seq, i);
+    return ring;
+}
+
+/*
+ * Copy an entry into the ring. Returns 0 if the ring is full.
+ */
+static int workq_ring_push (workq_ring_t *ring, workq_ele_t *we)
+{
+    workq_cell_t *cell;
+    size_t pos, seq;
 
+    pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
     while (1) {
-        timedout = 0;
-        DPRINTF (("Worker waiting for work\n"));
-        clock_gettime (CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += 2;
+        cell = &ring->cell[pos & ring->mask];
+        seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak (&ring->tail, &pos, pos + 1))
+                break;
+        } else if ((long)(seq - pos) < 0)
+            return 0;                   /* full */
+        else
+            pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    }
+    cell->ele = *we;
+    atomic_store_explicit (&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
 
-        while (wq->first == NULL && !wq->quit) {
-            /*
-             * Server threads time out after spending 2 seconds
-             * waiting for new work, and exit.
-             */
-            status = pthread_cond_timedwait (
-                    &wq->cv, &wq->mutex, &timeout);
-            if (status == ETIMEDOUT) {
-                DPRINTF (("Worker wait timed out\n"));
-                timedout = 1;
+/*
+ * Copy "count" requests (at the lowest priority, all queued at
+ * time "stamp" in flush epoch "epoch") into consecutive cells of
+ * the ring, reserving all of them with a single compare-and-swap.
+ * A free cell can only be filled by the producer that moves the
+ * tail past it, so if all the cells are free when we look, and
+ * the tail hasn't moved, they're ours. Returns 0 (and copies
+ * nothing) if there isn't room for all of them.
+ */
+static int workq_ring_pushn (
+    workq_ring_t *ring, void **items, int count, uint64_t stamp,
+    int epoch)
+{
+    workq_cell_t *cell;
+    size_t pos, seq;
+    int i;
+
+    if ((size_t)count > ring->mask + 1)
+        return 0;
+    pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    while (1) {
+        for (i = 0; i < count; i++) {
+            cell = &ring->cell[(pos + i) & ring->mask];
+            seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+            if (seq != pos + i)
                 break;
-            } else if (status != 0) {
-                /*
-                 * This shouldn't happen, so the work queue
-                 * package should fail. Because the work queue
-                 * API is asynchronous, that would add
-                 * complication. Because the chances of failure
-                 * are slim, I choose to avoid that
-                 * complication. The server thread will return,
-                 * and allow another server thread to pick up
-                 * the work later. Note that, if this was the
-                 * only server thread, the queue won't be
-                 * serviced until a new work item is
-                 * queued. That could be fixed by creating a new
-                 * server here.
-                 */
-                DPRINTF ((
-                    "Worker wait failed, %d (%s)\n",
-                    status, strerror (status)));
-                wq->counter--;
-                pthread_mutex_unlock (&wq->mutex);
-                return NULL;
+        }
+        if (i == count) {
+            if (atomic_compare_exchange_weak (
+                    &ring->tail, &pos, pos + count))
+                break;
+        } else if ((long)(seq - (pos + i)) < 0)
+            return 0;                   /* not enough room */
+        else
+            pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    }
+    for (i = 0; i < count; i++) {
+        cell = &ring->cell[(pos + i) & ring->mask];
+        cell->ele.data = items[i];
+        cell->ele.next = NULL;
+        cell->ele.prio = 0;
+        cell->ele.stamp = stamp;
+        cell->ele.future = NULL;
+        cell->ele.epoch = epoch;
+        atomic_store_explicit (
+            &cell->seq, pos + i + 1, memory_order_release);
+    }
+    return 1;
+}
+
+/*
+ * Copy the oldest entry out of the ring. Returns 0 if the ring
+ * is empty.
+ */
+static int workq_ring_pop (workq_ring_t *ring, workq_ele_t *we)
+{
+    workq_cell_t *cell;
+    size_t pos, seq;
+
+    pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    while (1) {
+        cell = &ring->cell[pos & ring->mask];
+        seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+        if (seq == pos + 1) {
+            if (atomic_compare_exchange_weak (&ring->head, &pos, pos + 1))
+                break;
+        } else if ((long)(seq - (pos + 1)) < 0)
+            return 0;                   /* empty */
+        else
+            pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    }
+    *we = cell->ele;
+    atomic_store_explicit (
+        &cell->seq, pos + ring->mask + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Check (without removing anything) whether the ring holds
+ * work. A producer may have claimed a cell without filling it
+ * yet, in which case this reports work that can't be dequeued
+ * for a moment.
+ */
+static int workq_ring_busy (workq_ring_t *ring)
+{
+    size_t head, tail;
+
+    head = atomic_load (&ring->head);
+    tail = atomic_load (&ring->tail);
+    return tail != head;
+}
+
+/*
+ * Push a batch of free entries (linked through "next") onto the
+ * queue's returned stack. The batches on the stack are linked
+ * through the "data" field of their first entries, which is
+ * otherwise unused in a free entry. Nothing is ever popped
+ * individually from this stack (a thread that needs entries
+ * takes all of them), so a simple compare-and-swap loop is safe.
+ * "first" may also be a chain of batches, ending with "last";
+ * otherwise "last" is the same as "first".
+ */
+static void workq_return (workq_t *wq, workq_ele_t *first, workq_ele_t *last)
+{
+    workq_ele_t *top;
+
+    top = atomic_load_explicit (&wq->returned, memory_order_relaxed);
+    do {
+        last->data = (void *)top;
+    } while (!atomic_compare_exchange_weak_explicit (
+            &wq->returned, &top, first,
+            memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Take one batch of free entries from the queue's returned
+ * stack, putting any others back.
+ */
+static workq_ele_t *workq_reclaim (workq_t *wq)
+{
+    workq_ele_t *batch, *rest, *last;
+
+    batch = atomic_exchange_explicit (
+        &wq->returned, NULL, memory_order_acquire);
+    if (batch == NULL)
+        return NULL;
+    rest = (workq_ele_t *)batch->data;
+    if (rest != NULL) {
+        for (last = rest; last->data != NULL;
+                last = (workq_ele_t *)last->data)
+            ;
+        workq_return (wq, rest, last);
+    }
+    return batch;
+}
+
+/*
+ * Thread-specific data destructor for a producer's magazine:
+ * return its entries, and let another thread have it.
+ */
+static void workq_magazine_release (void *arg)
+{
+    workq_magazine_t *mag = (workq_magazine_t *)arg;
+    workq_t *wq = mag->wq;
+
+    if (mag->first != NULL)
+        workq_return (wq, mag->first, mag->first);
+    if (mag->spare != NULL)
+        workq_return (wq, mag->spare, mag->spare);
+    mag->first = mag->spare = NULL;
+    mag->count = 0;
+    pthread_mutex_lock (&wq->mutex);
+    mag->owned = 0;
+    pthread_mutex_unlock (&wq->mutex);
+}
+
+/*
+ * Find the calling thread's magazine, if it's not a server:
+ * create one (or adopt one whose owner has exited) the first
+ * time the thread adds a request.
+ */
+static workq_magazine_t *workq_magazine (workq_t *wq)
+{
+    workq_magazine_t *mag;
+
+    mag = (workq_magazine_t *)pthread_getspecific (wq->magazine_key);
+    if (mag != NULL)
+        return mag;
+    if (pthread_mutex_lock (&wq->mutex) != 0)
+        return NULL;
+    for (mag = wq->magazines; mag != NULL; mag = mag->link)
+        if (!mag->owned)
+            break;
+    if (mag == NULL) {
+        mag = (workq_magazine_t *)malloc (sizeof (workq_magazine_t));
+        if (mag != NULL) {
+            mag->wq = wq;
+            mag->first = mag->spare = NULL;
+            mag->count = 0;
+            mag->link = wq->magazines;
+            wq->magazines = mag;
+        }
+    }
+    if (mag != NULL) {
+        mag->owned = 1;
+        if (pthread_setspecific (wq->magazine_key, mag) != 0)
+            mag->owned = 0;
+    }
+    pthread_mutex_unlock (&wq->mutex);
+    return (mag != NULL && mag->owned) ? mag : NULL;
+}
+
+/*
+ * Allocate a queue entry, from the caller's magazine if
+ * possible (preferring recently freed entries, which are likely
+ * to still be cached), then from the entries returned by
+ * servers, and finally from the heap.
+ */
+static workq_ele_t *workq_ele_alloc (workq_t *wq, workq_server_t *self)
+{
+    workq_magazine_t *mag;
+    workq_ele_t *we;
+
+    mag = (self != NULL) ? &self->magazine : workq_magazine (wq);
+    if (mag == NULL)
+        return (workq_ele_t *)malloc (sizeof (workq_ele_t));
+    if (mag->first != NULL) {
+        we = mag->first;
+        mag->first = we->next;
+        mag->count--;
+        return we;
+    }
+    if (mag->spare == NULL) {
+        mag->spare = workq_reclaim (wq);
+        if (mag->spare == NULL)
+            return (workq_ele_t *)malloc (sizeof (workq_ele_t));
+    }
+    we = mag->spare;
+    mag->spare = we->next;
+    return we;
+}
+
+/*
+ * Free a queue entry into a server's magazine. When enough have
+ * collected, give them back so that producers can use them.
+ */
+static void workq_ele_free (workq_t *wq, workq_server_t *self, workq_ele_t *we)
+{
+    workq_magazine_t *mag = &self->magazine;
+
+    we->next = mag->first;
+    mag->first = we;
+    if (++mag->count >= WORKQ_MAGAZINE) {
+        workq_return (wq, mag->first, mag->first);
+        mag->first = NULL;
+        mag->count = 0;
+    }
+}
+
+/*
+ * Free a list of queue entries (during rundown).
+ */
+static void workq_ele_freelist (workq_ele_t *we)
+{
+    workq_ele_t *next;
+
+    while (we != NULL) {
+        next = we->next;
+        free (we);
+        we = next;
+    }
+}
+
+/*
+ * Read the clock used to time requests, in nanoseconds.
+ */
+static uint64_t workq_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Determine whether a delayed item is due.
+ */
+static int workq_timer_due (workq_t *wq)
+{
+    return wq->timer_count > 0 && workq_now () >= wq->next_timer;
+}
+
+/*
+ * Check (without removing anything) whether a deque holds work.
+ */
+static int workq_deque_busy (workq_deque_t *dq)
+{
+    long b, t;
+
+    b = atomic_load (&dq->bottom);
+    t = atomic_load (&dq->top);
+    return b > t;
+}
+
+/*
+ * Determine whether any work is available, either on the shared
+ * queue (or ring), a node's queue, or some server's deque. This
+ * doesn't need the mutex, although (as with any unlocked check)
+ * the answer may be out of date by the time the caller sees it.
+ */
+static int workq_ready (workq_t *wq)
+{
+    int i;
+
+    if (wq->queued > 0 || wq->runnable > 0 || workq_timer_due (wq))
+        return 1;
+    if (wq->capacity > 0)
+        for (i = 0; i < WORKQ_PRIORITIES; i++)
+            if (workq_ring_busy (wq->lanes[i].ring))
+                return 1;
+    for (i = 0; wq->nodes != NULL && i < wq->node_count; i++)
+        if (wq->nodes[i].queued > 0)
+            return 1;
+    for (i = 0; i < wq->slots; i++)
+        if (workq_deque_busy (&wq->servers[i].deque))
+            return 1;
+    return 0;
+}
+
+/*
+ * Before waiting for work, a server may spin for a while
+ * (yielding the processor each time) to see whether work shows
+ * up. That's cheaper than a wait and wakeup, when requests
+ * arrive in quick succession. Returns 1 if work showed up. Stop
+ * (returning 0) if the servers have been asked to quit, so that
+ * the caller goes on to the shutdown check. (The mutex isn't
+ * locked here, which is why quit is atomic.)
+ */
+static int workq_spin (workq_t *wq)
+{
+    int i;
+
+    for (i = 0; i < wq->spin && !atomic_load (&wq->quit); i++) {
+        if (workq_ready (wq))
+            return 1;
+        sched_yield ();
+    }
+    return 0;
+}
+
+/*
+ * Try to steal an item from another server's deque, starting
+ * with a randomly chosen victim so that thieves spread out.
+ */
+static workq_ele_t *workq_steal (workq_t *wq, workq_server_t *self)
+{
+    workq_server_t *victim;
+    workq_ele_t *we;
+    int start, i;
+
+    start = rand_r (&self->seed) % wq->slots;
+    for (i = 0; i < wq->slots; i++) {
+        victim = &wq->servers[(start + i) % wq->slots];
+        if (victim == self)
+            continue;
+        do {
+            we = workq_deque_steal (&victim->deque);
+        } while (we == WORKQ_ABORT);
+        if (we != NULL)
+            return we;
+    }
+    return NULL;
+}
+
+/*
+ * Wake producers that are waiting for space in the ring, after a
+ * server has dequeued "count" entries. As with idle servers, a
+ * producer counts itself as blocked before it checks the ring
+ * for the last time, so it can't miss the wakeup.
+ */
+static void workq_space (workq_t *wq, int count)
+{
+    atomic_thread_fence (memory_order_seq_cst);
+    if (wq->blocked > 0) {
+        pthread_mutex_lock (&wq->mutex);
+        if (count > 1)
+            pthread_cond_broadcast (&wq->space);
+        else
+            pthread_cond_signal (&wq->space);
+        pthread_mutex_unlock (&wq->mutex);
+    }
+}
+
+/*
+ * Determine whether requests above the lowest priority are
+ * waiting on the shared queue (or ring).
+ */
+static int workq_urgent (workq_t *wq)
+{
+    int prio;
+
+    if (wq->capacity == 0)
+        return wq->urgent > 0;
+    for (prio = 1; prio < WORKQ_PRIORITIES; prio++)
+        if (workq_ring_busy (wq->lanes[prio].ring))
+            return 1;
+    return 0;
+}
+
+/*
+ * Choose the lane from which a server takes its next request,
+ * from among those with a bit set in "ready". Under the weighted
+ * policy, taking a request from a lane uses one of the server's
+ * credits for that lane; the highest priority lane with credit
+ * left wins, and when none of the ready lanes has any, every
+ * lane's credits are reset to its weight. Returns -1 if no lane
+ * is ready.
+ */
+static int workq_lane (workq_t *wq, workq_server_t *self, unsigned int ready)
+{
+    int prio, pass;
+
+    if (ready == 0)
+        return -1;
+    if (wq->policy == WORKQ_STRICT) {
+        for (prio = WORKQ_PRIORITIES - 1; prio > 0; prio--)
+            if (ready & (1u << prio))
+                break;
+        return prio;
+    }
+    for (pass = 0; pass < 2; pass++) {
+        for (prio = WORKQ_PRIORITIES - 1; prio >= 0; prio--) {
+            if ((ready & (1u << prio)) && self->credit[prio] > 0) {
+                self->credit[prio]--;
+                return prio;
+            }
+        }
+        for (prio = 0; prio < WORKQ_PRIORITIES; prio++)
+            self->credit[prio] = wq->lanes[prio].weight;
+    }
+    return -1;
+}
+
+static int workq_get_node (
+    workq_t *wq, workq_server_t *self, int node, workq_ele_t *items, int max);
+
+/*
+ * Take up to "max" requests from a server's own deque, and then
+ * from its node's queue (if there are node queues), copying them
+ * to "items".
+ */
+static int workq_get_local (
+    workq_t *wq, workq_server_t *self, workq_ele_t *items, int max)
+{
+    workq_ele_t *we;
+    int count = 0;
+
+    while (count < max) {
+        we = workq_deque_take (&self->deque);
+        if (we == NULL)
+            break;
+        items[count++] = *we;
+        workq_ele_free (wq, self, we);
+    }
+    if (count < max && wq->nodes != NULL)
+        count += workq_get_node (
+            wq, self, self->node, items + count, max - count);
+    return count;
+}
+
+/*
+ * Take up to "max" requests from the shared queue (or ring),
+ * copying them to "items", choosing among the priority lanes as
+ * directed by the work queue's policy. Requests on the shared
+ * queue are removed in a single critical section.
+ */
+static int workq_get_shared (
+    workq_t *wq, workq_server_t *self, workq_ele_t *items, int max)
+{
+    workq_lane_t *lane;
+    workq_ele_t *we;
+    unsigned int ready = 0;
+    int count = 0, urgent = 0, prio;
+
+    if (wq->capacity > 0) {
+        for (prio = 0; prio < WORKQ_PRIORITIES; prio++)
+            if (workq_ring_busy (wq->lanes[prio].ring))
+                ready |= 1u << prio;
+        while (count < max && (prio = workq_lane (wq, self, ready)) >= 0) {
+            if (workq_ring_pop (wq->lanes[prio].ring, &items[count]))
+                count++;
+            else
+                ready &= ~(1u << prio);
+        }
+        if (count > 0)
+            workq_space (wq, count);
+        return count;
+    }
+    if (wq->queued == 0 || pthread_mutex_lock (&wq->mutex) != 0)
+        return 0;
+    for (prio = 0; prio < WORKQ_PRIORITIES; prio++)
+        if (wq->lanes[prio].first != NULL)
+            ready |= 1u << prio;
+    while (count < max && (prio = workq_lane (wq, self, ready)) >= 0) {
+        lane = &wq->lanes[prio];
+        we = lane->first;
+        lane->first = we->next;
+        lane->queued--;
+        if (lane->first == NULL) {
+            lane->last = NULL;
+            ready &= ~(1u << prio);
+        }
+        if (prio > 0)
+            urgent++;
+        items[count++] = *we;
+        workq_ele_free (wq, self, we);
+    }
+    wq->queued -= count;
+    wq->urgent -= urgent;
+    pthread_mutex_unlock (&wq->mutex);
+    return count;
+}
+
+/*
+ * Find the node whose queue a thread should use: a server's own
+ * node, or the node of the processor a producer is running on.
+ * Returns -1 if the requests should go on the shared queue.
+ */
+static int workq_node_of (workq_t *wq, workq_server_t *self)
+{
+    int cpu = -1;
+
+    if (self != NULL)
+        return self->node;
+#ifdef __linux__
+    cpu = sched_getcpu ();
+#endif
+    if (cpu < 0 || cpu >= wq->cpu_max)
+        return -1;
+    return wq->cpu_node[cpu];
+}
+
+/*
+ * Append a list of "count" requests to a node's queue.
+ */
+static int workq_add_node (
+    workq_t *wq, int node, workq_ele_t *first, workq_ele_t *last, int count)
+{
+    workq_node_t *nq = &wq->nodes[node];
+    int status;
+
+    status = pthread_mutex_lock (&nq->mutex);
+    if (status != 0)
+        return status;
+    if (nq->first == NULL)
+        nq->first = first;
+    else
+        nq->last->next = first;
+    nq->last = last;
+    nq->queued += count;
+    pthread_mutex_unlock (&nq->mutex);
+    return 0;
+}
+
+/*
+ * Take up to "max" requests from a node's queue, copying them
+ * to "items".
+ */
+static int workq_get_node (
+    workq_t *wq, workq_server_t *self, int node, workq_ele_t *items, int max)
+{
+    workq_node_t *nq = &wq->nodes[node];
+    workq_ele_t *we;
+    int count = 0;
+
+    if (nq->queued == 0 || pthread_mutex_lock (&nq->mutex) != 0)
+        return 0;
+    while (count < max && nq->first != NULL) {
+        we = nq->first;
+        nq->first = we->next;
+        items[count++] = *we;
+        workq_ele_free (wq, self, we);
+    }
+    if (nq->first == NULL)
+        nq->last = NULL;
+    nq->queued -= count;
+    pthread_mutex_unlock (&nq->mutex);
+    return count;
+}
+
+/*
+ * Take up to "max" requests from the queues of nodes other than
+ * the server's own, nearest numbers first.
+ */
+static int workq_get_remote (
+    workq_t *wq, workq_server_t *self, workq_ele_t *items, int max)
+{
+    int count, i;
+
+    for (i = 1; i < wq->node_count; i++) {
+        count = workq_get_node (wq, self,
+            (self->node + i) % wq->node_count, items, max);
+        if (count > 0) {
+            atomic_store_explicit (&self->remote,
+                atomic_load_explicit (&self->remote, memory_order_relaxed)
+                    + count,
+                memory_order_relaxed);
+            return count;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Find the bucket of the key table that holds "key".
+ */
+static workq_strand_t **workq_key_bucket (workq_keys_t *keys, unsigned long key)
+{
+    key *= 0x9e3779b97f4a7c15UL;        /* spread the bits */
+    return &keys->bucket[(key >> 24) & (WORKQ_KEY_BUCKETS - 1)];
+}
+
+/*
+ * Take a turn of the first runnable strand: up to "max" of its
+ * requests, copied to "items". The strand isn't runnable again
+ * until the server calls workq_strand_done.
+ */
+static int workq_get_keyed (
+    workq_t *wq, workq_server_t *self, workq_ele_t *items, int max)
+{
+    workq_keys_t *keys = wq->keys;
+    workq_strand_t *strand;
+    workq_ele_t *we;
+    int count = 0;
+
+    if (wq->runnable == 0 || pthread_mutex_lock (&keys->mutex) != 0)
+        return 0;
+    strand = keys->first;
+    if (strand != NULL) {
+        keys->first = strand->next;
+        if (keys->first == NULL)
+            keys->last = NULL;
+        wq->runnable--;
+        while (count < max && strand->first != NULL) {
+            we = strand->first;
+            strand->first = we->next;
+            items[count++] = *we;
+            workq_ele_free (wq, self, we);
+        }
+        keys->queued -= count;
+        if (strand->first == NULL)
+            strand->last = NULL;
+        self->strand = strand;
+    }
+    pthread_mutex_unlock (&keys->mutex);
+    return count;
+}
+
+/*
+ * End a server's turn of a strand. If more requests arrived for
+ * the key, put the strand at the end of the runnable list (the
+ * server itself will get to it, if nobody else does); otherwise
+ * remove it from the key table.
+ */
+static void workq_strand_done (workq_t *wq, workq_server_t *self)
+{
+    workq_keys_t *keys = wq->keys;
+    workq_strand_t *strand = self->strand, **link;
+
+    self->strand = NULL;
+    pthread_mutex_lock (&keys->mutex);
+    if (strand->first != NULL) {
+        strand->next = NULL;
+        if (keys->first == NULL)
+            keys->first = strand;
+        else
+            keys->last->next = strand;
+        keys->last = strand;
+        wq->runnable++;
+    } else {
+        for (link = workq_key_bucket (keys, strand->key);
+                *link != strand; link = &(*link)->link)
+            ;
+        *link = strand->link;
+        strand->scheduled = 0;
+        strand->link = keys->free;
+        keys->free = strand;
+    }
+    pthread_mutex_unlock (&keys->mutex);
+}
+
+/*
+ * Count "count" requests that are about to be queued against the
+ * current flush epoch, and return the epoch's parity, which the
+ * requests carry until they've been run. Requests must be counted
+ * before a server can see them, so the count can't drop to zero
+ * (and satisfy a flush) while one is still queued.
+ */
+static int workq_begin (workq_t *wq, int count)
+{
+    int epoch = atomic_load (&wq->epoch) & 1;
+
+    atomic_fetch_add (&wq->counted[epoch], count);
+    return epoch;
+}
+
+/*
+ * Determine whether all the requests of an epoch (of parity
+ * "epoch") have been run. Servers count the requests they've run
+ * in their own counters, so as not to fight over a cache line;
+ * we add those up before reading how many were queued, so that
+ * (since no request is run before it's counted) we can't see
+ * more requests run than were queued when we looked.
+ */
+static int workq_drained (workq_t *wq, int epoch)
+{
+    long finished = 0;
+    int i;
+
+    for (i = 0; i < wq->slots; i++)
+        finished += atomic_load (&wq->servers[i].finished[epoch]);
+    return atomic_load (&wq->counted[epoch]) == finished;
+}
+
+/*
+ * If a thread is flushing the work queue, and the requests of an
+ * epoch have all been run, wake it. (The flushing count is raised
+ * before the flusher checks the epoch, and we changed the counts
+ * before checking the flushing count, so one of us must see the
+ * other's change.)
+ */
+static void workq_drain_check (workq_t *wq, int epoch)
+{
+    if (atomic_load (&wq->flushing) > 0 && workq_drained (wq, epoch)) {
+        pthread_mutex_lock (&wq->mutex);
+        pthread_cond_broadcast (&wq->drained);
+        pthread_mutex_unlock (&wq->mutex);
+    }
+}
+
+/*
+ * Uncount "count" requests of an epoch that couldn't be queued
+ * after all.
+ */
+static void workq_finish (workq_t *wq, int epoch, int count)
+{
+    if (count == 0)
+        return;
+    atomic_fetch_sub (&wq->counted[epoch], count);
+    workq_drain_check (wq, epoch);
+}
+
+/*
+ * Restore the heap order after the deadline of the item at index
+ * "i" has changed (or a new item was put there), moving it up or
+ * down as needed. Called with the mutex locked.
+ */
+static void workq_timer_sift (workq_t *wq, int i)
+{
+    workq_timer_t *heap = wq->timers, item = heap[i];
+    int child;
+
+    while (i > 0 && item.deadline < heap[(i - 1) / 2].deadline) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < wq->timer_count) {
+        if (child + 1 < wq->timer_count
+                && heap[child + 1].deadline < heap[child].deadline)
+            child++;
+        if (item.deadline <= heap[child].deadline)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = item;
+    wq->next_timer = (wq->timer_count > 0) ? heap[0].deadline : WORKQ_NEVER;
+}
+
+/*
+ * Remove the item at index "i" from the heap. Called with the
+ * mutex locked.
+ */
+static void workq_timer_remove (workq_t *wq, int i)
+{
+    int last = --wq->timer_count;
+
+    if (i < last) {
+        wq->timers[i] = wq->timers[last];
+        workq_timer_sift (wq, i);
+    } else
+        wq->next_timer = (last > 0) ? wq->timers[0].deadline : WORKQ_NEVER;
+}
+
+/*
+ * Take up to "max" items whose deadlines have passed from the
+ * timer heap. A periodic item goes back in the heap with its
+ * next deadline (skipping any that have already passed, if the
+ * servers have fallen behind). An item's queueing delay is
+ * measured from its deadline.
+ */
+static int workq_get_timers (workq_t *wq, workq_ele_t *items, int max)
+{
+    workq_timer_t *timer;
+    uint64_t now;
+    int count = 0;
+
+    if (!workq_timer_due (wq) || pthread_mutex_lock (&wq->mutex) != 0)
+        return 0;
+    now = workq_now ();
+    while (count < max && wq->timer_count > 0
+            && wq->timers[0].deadline <= now) {
+        timer = &wq->timers[0];
+        items[count].data = timer->data;
+        items[count].next = NULL;
+        items[count].prio = 0;
+        items[count].stamp = timer->deadline;
+        items[count].future = NULL;
+        items[count].epoch = workq_begin (wq, 1);
+        count++;
+        if (timer->period > 0) {
+            timer->deadline += timer->period;
+            if (timer->deadline <= now)
+                timer->deadline = now + timer->period;
+            workq_timer_sift (wq, 0);
+        } else
+            workq_timer_remove (wq, 0);
+    }
+    pthread_mutex_unlock (&wq->mutex);
+    return count;
+}
+
+/*
+ * Find up to "max" requests for a server, without waiting. Look
+ * first at the server's own deque (and its node's queue), then
+ * at the shared queue (or ring), then at other nodes' queues, and
+ * finally try to steal from another server. Every
+ * WORKQ_FAIR times, check the shared queue first, so that a
+ * busy engine that keeps adding to its own deque can't starve
+ * requests from other threads; and always check it first while
+ * requests above the lowest priority (which are never put on a
+ * deque) are waiting there. Keyed requests take turns with the
+ * rest: on every other call (unless higher priority requests are
+ * waiting) a server looks for a runnable key first, and otherwise
+ * just before resorting to theft. Requests found for a key are
+ * never mixed with others. Delayed items that are due come
+ * before anything else (and aren't mixed, either). The requests
+ * are copied to "items" (and the queue entries freed); returns
+ * the number found, or 0 if there was no work.
+ */
+#define WORKQ_FAIR      61
+
+static int workq_get (
+    workq_t *wq, workq_server_t *self, workq_ele_t *items, int max)
+{
+    workq_ele_t *we;
+    unsigned int ticks;
+    int count = 0, shared;
+
+    count = workq_get_timers (wq, items, max);
+    if (count > 0)
+        return count;
+    ticks = ++self->ticks;
+    shared = (ticks % WORKQ_FAIR == 0) || workq_urgent (wq);
+    if ((ticks & 1) && !shared) {
+        count = workq_get_keyed (wq, self, items, max);
+        if (count > 0)
+            return count;
+    }
+    if (!shared)
+        count = workq_get_local (wq, self, items, max);
+    if (count < max)
+        count += workq_get_shared (wq, self, items + count, max - count);
+    if (count < max && shared)
+        count += workq_get_local (wq, self, items + count, max - count);
+    if (count == 0)
+        count = workq_get_keyed (wq, self, items, max);
+    if (count == 0 && wq->nodes != NULL)
+        count = workq_get_remote (wq, self, items, max);
+    if (count == 0) {
+        we = workq_steal (wq, self);
+        if (we != NULL) {
+            atomic_store_explicit (&self->steals,
+                atomic_load_explicit (&self->steals, memory_order_relaxed) + 1,
+                memory_order_relaxed);
+            items[count++] = *we;
+            workq_ele_free (wq, self, we);
+        }
+    }
+    return count;
+}
+
+/*
+ * Add a sample to a histogram. Only the owning server writes to
+ * its histograms, so there's no need for read-modify-write
+ * operations; the atomic stores just let workq_delay (and
+ * workq_stats) read them.
+ */
+static void workq_record (workq_histo_t *h, uint64_t ns)
+{
+    uint64_t v;
+    int i;
+
+    for (i = 0, v = ns; v > 1 && i < WORKQ_BUCKETS - 1; i++)
+        v >>= 1;
+    atomic_store_explicit (&h->count,
+        atomic_load_explicit (&h->count, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    atomic_store_explicit (&h->sum,
+        atomic_load_explicit (&h->sum, memory_order_relaxed) + ns,
+        memory_order_relaxed);
+    if (ns > atomic_load_explicit (&h->max, memory_order_relaxed))
+        atomic_store_explicit (&h->max, ns, memory_order_relaxed);
+    atomic_store_explicit (&h->bucket[i],
+        atomic_load_explicit (&h->bucket[i], memory_order_relaxed) + 1,
+        memory_order_relaxed);
+}
+
+static int workq_wake (workq_t *wq, int count);
+
+/*
+ * Count the requests waiting to be started (not including
+ * delayed items that aren't due). Called with the mutex locked,
+ * although requests on deques and rings come and go without it.
+ */
+static int workq_backlog (workq_t *wq)
+{
+    size_t head, tail;
+    long b, t;
+    int backlog, i;
+
+    backlog = wq->queued + wq->runnable;
+    for (i = 0; wq->nodes != NULL && i < wq->node_count; i++)
+        backlog += wq->nodes[i].queued;
+    for (i = 0; i < wq->slots; i++) {
+        t = atomic_load (&wq->servers[i].deque.top);
+        b = atomic_load (&wq->servers[i].deque.bottom);
+        if (b > t)
+            backlog += b - t;
+    }
+    if (wq->capacity > 0) {
+        for (i = 0; i < WORKQ_PRIORITIES; i++) {
+            head = atomic_load (&wq->lanes[i].ring->head);
+            tail = atomic_load (&wq->lanes[i].ring->tail);
+            if (tail > head)
+                backlog += tail - head;
+        }
+    }
+    return backlog;
+}
+
+/*
+ * If an autoscaling interval has passed (at time "now"), adjust
+ * the work queue's parallelism. Called with the mutex locked.
+ */
+static void workq_autoscale (workq_t *wq, uint64_t now)
+{
+    workq_scale_t *scale = wq->scale;
+    workq_histo_t *h;
+    uint64_t count = 0, sum = 0, mean = 0;
+    int backlog, limit, i, j;
+
+    if (now < scale->next)
+        return;
+    scale->next = now + scale->interval;
+
+    /*
+     * Find the mean wait of requests started since last time.
+     */
+    for (i = 0; i < wq->slots; i++) {
+        for (j = 0; j < WORKQ_PRIORITIES; j++) {
+            h = &wq->servers[i].delay[j];
+            count += atomic_load_explicit (&h->count, memory_order_relaxed);
+            sum += atomic_load_explicit (&h->sum, memory_order_relaxed);
+        }
+    }
+    if (count > scale->count)
+        mean = (sum - scale->sum) / (count - scale->count);
+    scale->count = count;
+    scale->sum = sum;
+    backlog = workq_backlog (wq);
+    limit = wq->parallelism;
+
+    if (mean > scale->target && backlog > 0) {
+        scale->down = 0;
+        if (++scale->up >= WORKQ_SCALE_UP && limit < scale->max) {
+            limit += (limit / 4 > 1) ? limit / 4 : 1;
+            if (limit > scale->max)
+                limit = scale->max;
+            DPRINTF (("Autoscale up to %d\n", limit));
+            wq->parallelism = limit;
+            scale->up = 0;
+            workq_wake (wq, backlog);
+        }
+    } else if (mean < scale->target / 4
+            && (wq->idle > 0 || wq->counter < limit)) {
+        scale->up = 0;
+        if (++scale->down >= WORKQ_SCALE_DOWN && limit > scale->min) {
+            DPRINTF (("Autoscale down to %d\n", limit - 1));
+            wq->parallelism = limit - 1;
+            scale->down = 0;
+            if (wq->counter > wq->parallelism && wq->idle > 0)
+                pthread_cond_broadcast (&wq->cv);
+        }
+    } else
+        scale->up = scale->down = 0;
+}
+
+/*
+ * Check (without the mutex) whether it's time to autoscale, and
+ * if so, do it.
+ */
+static void workq_autoscale_check (workq_t *wq, uint64_t now)
+{
+    if (wq->scale == NULL || now < wq->scale->next)
+        return;
+    if (pthread_mutex_lock (&wq->mutex) != 0)
+        return;
+    workq_autoscale (wq, now);
+    pthread_mutex_unlock (&wq->mutex);
+}
+
+/*
+ * Called with the mutex locked by a server, between requests:
+ * if there are more servers than the current parallelism, exit
+ * (after working off its own deque, which no other server would
+ * look at until another thread claims the slot). Returns 1 if the
+ * server should exit.
+ */
+static int workq_retire (workq_t *wq, workq_server_t *self)
+{
+    if (wq->counter <= wq->parallelism || workq_deque_busy (&self->deque))
+        return 0;
+    DPRINTF (("Worker retiring\n"));
+    self->busy = 0;
+    wq->counter--;
+    wq->exited++;
+    return 1;
+}
+
+/*
+ * Find the parking lot slot for a future.
+ */
+static workq_park_t *workq_park_slot (workq_future_t *future)
+{
+    uintptr_t hash = (uintptr_t)future;
+
+    hash ^= hash >> 12;                 /* handles are small and aligned */
+    return &workq_park[(hash >> 6) & (WORKQ_PARK_SLOTS - 1)];
+}
+
+/*
+ * Initialize the parking lot. Like the servers' condition
+ * variable, the slots' condition variables use CLOCK_MONOTONIC,
+ * so that a timed wait for a future isn't upset by changes to
+ * the time of day.
+ */
+static void workq_park_init (void)
+{
+    pthread_condattr_t cvattr;
+    int i;
+
+    pthread_condattr_init (&cvattr);
+    pthread_condattr_setclock (&cvattr, CLOCK_MONOTONIC);
+    for (i = 0; i < WORKQ_PARK_SLOTS; i++) {
+        pthread_mutex_init (&workq_park[i].mutex, NULL);
+        pthread_cond_init (&workq_park[i].cond, &cvattr);
+    }
+    pthread_condattr_destroy (&cvattr);
+}
+
+/*
+ * Call a submitted function and make the result available. Once
+ * the state is set to done, the handle may be collected (and
+ * reused) at any moment, so after that we use only its address.
+ */
+static void workq_future_run (workq_future_t *future)
+{
+    workq_park_t *park = workq_park_slot (future);
+
+    future->result = future->fn (future->arg);
+    if (atomic_exchange (&future->state, WORKQ_DONE) == WORKQ_PARKED) {
+        pthread_mutex_lock (&park->mutex);
+        pthread_cond_broadcast (&park->cond);
+        pthread_mutex_unlock (&park->mutex);
+    }
+}
+
+/*
+ * Time the engine call (or submitted function) that just
+ * returned: it started at "*now", and the time it ended is when
+ * the next one starts.
+ */
+static void workq_service (workq_server_t *self, uint64_t *now)
+{
+    uint64_t then = *now;
+
+    *now = workq_now ();
+    workq_record (&self->service, *now - then);
+}
+
+/*
+ * Present a set of requests to the engine: all at once to a
+ * batch engine, if the work queue has one, or one at a time.
+ * Submitted functions are called one at a time. First record how
+ * long each request was queued, and then how long each call
+ * takes; afterwards, end the server's turn of a key, if the
+ * requests were keyed, and count them against their flush epochs.
+ */
+static void workq_run (
+    workq_t *wq, workq_server_t *self, workq_ele_t *items, int count)
+{
+    uint64_t now;
+    int i, n;
+
+    now = workq_now ();
+    for (i = 0; i < count; i++)
+        workq_record (&self->delay[items[i].prio],
+            now > items[i].stamp ? now - items[i].stamp : 0);
+    DPRINTF (("Worker calling engine\n"));
+    if (wq->batch_engine != NULL) {
+        for (i = n = 0; i < count; i++) {
+            if (items[i].future != NULL) {
+                workq_future_run (items[i].future);
+                workq_service (self, &now);
+            } else
+                self->data[n++] = items[i].data;
+        }
+        if (n > 0) {
+            wq->batch_engine (self->data, n);
+            workq_service (self, &now);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            if (items[i].future != NULL)
+                workq_future_run (items[i].future);
+            else
+                wq->engine (items[i].data);
+            workq_service (self, &now);
+        }
+    }
+    if (self->strand != NULL)
+        workq_strand_done (wq, self);
+    for (i = n = 0; i < count; i++)
+        n += items[i].epoch;
+    if (n < count)
+        atomic_fetch_add (&self->finished[0], count - n);
+    if (n > 0)
+        atomic_fetch_add (&self->finished[1], n);
+    if (n < count)
+        workq_drain_check (wq, 0);
+    if (n > 0)
+        workq_drain_check (wq, 1);
+    workq_autoscale_check (wq, now);
+}
+
+/*
+ * Claim a free server slot for the calling thread. Called with
+ * the mutex locked. There's always a free slot, because we never
+ * create a server when "parallelism" are running, and that's
+ * never more than the number of slots.
+ */
+static workq_server_t *workq_claim_server (workq_t *wq)
+{
+    workq_server_t *self;
+    int i;
+
+    for (i = 0; i < wq->slots; i++) {
+        self = &wq->servers[i];
+        if (!self->busy) {
+            self->busy = 1;
+            self->seed = (unsigned int)time (NULL) + i;
+            return self;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Bind a server to its slot's processor, if it has one. This is
+ * only advice: a server that can't be bound (because the process
+ * has since been restricted to other processors, say) still works.
+ */
+static void workq_bind (workq_server_t *self)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (self->cpu < 0)
+        return;
+    CPU_ZERO (&set);
+    CPU_SET (self->cpu, &set);
+    pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+#endif
+}
+
+/*
+ * Called with the mutex locked by a server thread that has
+ * stopped waiting for work. If workq_add already claimed this
+ * thread (by decrementing idle when it signalled), consume the
+ * wakeup; otherwise we're leaving the idle pool on our own
+ * (timeout, or a wakeup meant for another thread), so remove
+ * ourselves from the count. Either way, each waiting thread is
+ * counted in exactly one of idle or wakeups.
+ */
+static void workq_unidle (workq_t *wq)
+{
+    if (wq->wakeups > 0)
+        wq->wakeups--;
+    else
+        wq->idle--;
+}
+
+/*
+ * Thread start routine to serve the work queue.
+ */
+static void *workq_server (void *arg)
+{
+    struct timespec deadline;
+    workq_t *wq = (workq_t *)arg;
+    workq_server_t *self;
+    uint64_t timeout, wait;
+    int status, timedout, idling, keeper, count;
+
+    /*
+     * We don't need to validate the workq_t here... we don't
+     * create server threads until requests are queued (the
+     * queue has been initialized by then!) and we wait for all
+     * server threads to terminate before destroying a work
+     * queue.
+     */
+    DPRINTF (("A worker is starting\n"));
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return NULL;
+    self = workq_claim_server (wq);
+    pthread_setspecific (wq->server_key, self);
+    pthread_mutex_unlock (&wq->mutex);
+    workq_bind (self);
+
+    while (1) {
+        /*
+         * Process requests for as long as we can find them. We
+         * only need the mutex to wait for more.
+         */
+        count = workq_get (wq, self, self->items, wq->batch);
+        if (count > 0) {
+            workq_run (wq, self, self->items, count);
+            if (wq->counter > wq->parallelism) {
+                status = pthread_mutex_lock (&wq->mutex);
+                if (status != 0)
+                    return NULL;
+                if (workq_retire (wq, self))
+                    break;
+                pthread_mutex_unlock (&wq->mutex);
+            }
+            continue;
+        }
+        if (workq_spin (wq))
+            continue;
+        status = pthread_mutex_lock (&wq->mutex);
+        if (status != 0)
+            return NULL;
+
+        timedout = 0;
+        DPRINTF (("Worker waiting for work\n"));
+        timeout = workq_now () + (uint64_t)wq->timeout.tv_sec * 1000000000
+            + wq->timeout.tv_nsec;
+
+        /*
+         * Count ourselves as idle while waiting, so that
+         * workq_add will wake us instead of leaving the new
+         * item on the queue until our wait times out. Note
+         * that the predicate is re-evaluated after idle has
+         * been incremented: a thread adding to a deque or to
+         * the ring checks idle after the add, so one of us is
+         * sure to see the other. Each time we wake, we leave
+         * the idle pool (consuming the wakeup, if workq_add
+         * claimed us) and rejoin it before waiting again.
+         */
+        idling = keeper = 0;
+        while (!workq_ready (wq) && !wq->quit
+                && wq->counter <= wq->parallelism) {
+            if (!idling) {
+                wq->idle++;
+                atomic_thread_fence (memory_order_seq_cst);
+                idling = 1;
+                continue;
+            }
+
+            /*
+             * Server threads time out after spending the idle
+             * timeout (2 seconds, by default) waiting for new
+             * work, and exit -- unless they're needed to keep
+             * the minimum number of servers. If delayed items
+             * are pending, and no other server is waiting for
+             * them, this one waits only until the first is due.
+             */
+            wait = timeout;
+            if (wq->timer_count > 0 && (keeper || !wq->keeper)) {
+                wq->keeper = keeper = 1;
+                if (wq->next_timer < wait)
+                    wait = wq->next_timer;
+            }
+            deadline.tv_sec = wait / 1000000000;
+            deadline.tv_nsec = wait % 1000000000;
+            status = pthread_cond_timedwait (
+                    &wq->cv, &wq->mutex, &deadline);
+            workq_unidle (wq);
+            idling = 0;
+            if (status == ETIMEDOUT && wait < timeout)
+                continue;               /* an item is due */
+            if (status == ETIMEDOUT) {
+                DPRINTF (("Worker wait timed out\n"));
+                timedout = 1;
+                break;
+            } else if (status != 0) {
+                /*
+                 * This shouldn't happen, so the work queue
+                 * package should fail. Because the work queue
+                 * API is asynchronous, that would add
+                 * complication. Because the chances of failure
+                 * are slim, I choose to avoid that
+                 * complication. The server thread will return,
+                 * and allow another server thread to pick up
+                 * the work later. Note that, if this was the
+                 * only server thread, the queue won't be
+                 * serviced until a new work item is
+                 * queued. That could be fixed by creating a new
+                 * server here.
+                 */
+                DPRINTF ((
+                    "Worker wait failed, %d (%s)\n",
+                    status, strerror (status)));
+                if (keeper)
+                    wq->keeper = 0;
+                self->busy = 0;
+                wq->counter--;
+                pthread_mutex_unlock (&wq->mutex);
+                return NULL;
+            }
+        }
+        if (idling)
+            workq_unidle (wq);
+
+        /*
+         * If we were waiting for the delayed items, and we're
+         * about to do something else, wake another idle server
+         * (if there is one) to wait for them instead.
+         */
+        if (keeper) {
+            wq->keeper = 0;
+            if (wq->timer_count > 0 && wq->idle > 0)
+                workq_wake (wq, 1);
+        }
+        DPRINTF (("Work queue: %d, quit: %d\n", wq->queued, wq->quit));
+
+        /*
+         * If there are no more work requests, and the servers
+         * have been asked to quit, then shut down.
+         */
+        if (!workq_ready (wq) && wq->quit) {
+            DPRINTF (("Worker shutting down\n"));
+            self->busy = 0;
+            wq->counter--;
+
+            /*
+             * NOTE: Just to prove that every rule has an
+             * exception, I'm using the "cv" condition for two
+             * separate predicates here.  That's OK, since the
+             * case used here applies only once during the life
+             * of a work queue -- during rundown. The overhead
+             * is minimal and it's not worth creating a separate
+             * condition variable that would be waited and
+             * signaled exactly once!
+             */
+            if (wq->counter == 0)
+                pthread_cond_broadcast (&wq->cv);
+            pthread_mutex_unlock (&wq->mutex);
+            return NULL;
+        }
+
+        /*
+         * If the work queue's parallelism has been lowered, and
+         * there are too many servers, this one can go.
+         */
+        if (workq_retire (wq, self))
+            break;
+
+        /*
+         * If there's no more work, and we wait for as long as
+         * we're allowed, then terminate this server thread
+         * (unless it's one of the minimum number of servers, or
+         * the last server, and delayed items are pending).
+         */
+        if (!workq_ready (wq) && timedout
+                && wq->counter > wq->minthreads
+                && (wq->timer_count == 0 || wq->counter > 1)) {
+            DPRINTF (("engine terminating due to timeout.\n"));
+            self->busy = 0;
+            wq->counter--;
+            wq->exited++;
+            break;
+        }
+        pthread_mutex_unlock (&wq->mutex);
+    }
+
+    pthread_mutex_unlock (&wq->mutex);
+    DPRINTF (("Worker exiting\n"));
+    return NULL;
+}
+
+/*
+ * Wake idle servers, or create new ones, to handle "count" newly
+ * queued requests. Called with the mutex locked.
+ */
+static int workq_wake (workq_t *wq, int count)
+{
+    pthread_t id;
+    int status;
+
+    /*
+     * if any threads are idling, wake them (one per request).
+     * Claim each by moving it from the idle count to the pending
+     * wakeups, so that a request added before it runs will wake
+     * (or create) another server rather than signalling the same
+     * one.
+     */
+    while (count > 0 && wq->idle > 0) {
+        status = pthread_cond_signal (&wq->cv);
+        if (status != 0)
+            return status;
+        wq->idle--;
+        wq->wakeups++;
+        count--;
+    }
+
+    /*
+     * If there weren't enough idling threads, and we're allowed
+     * to create new threads, do so.
+     */
+    while (count > 0 && wq->counter < wq->parallelism) {
+        DPRINTF (("Creating new worker\n"));
+        status = pthread_create (
+            &id, &wq->attr, workq_server, (void*)wq);
+        if (status != 0)
+            return status;
+        wq->counter++;
+        wq->created++;
+        count--;
+    }
+    return 0;
+}
+
+/*
+ * Free the priority lanes (and their rings).
+ */
+static void workq_free_lanes (workq_lane_t *lanes)
+{
+    int i;
+
+    if (lanes == NULL)
+        return;
+    for (i = 0; i < WORKQ_PRIORITIES; i++)
+        free (lanes[i].ring);
+    free (lanes);
+}
+
+/*
+ * Free the array of server slots.
+ */
+static void workq_free_servers (workq_server_t *servers, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free (servers[i].items);
+        free (servers[i].data);
+    }
+    free (servers);
+}
+
+/*
+ * Free a work queue's node queues and processor map.
+ */
+static void workq_free_nodes (workq_t *wq)
+{
+    int i;
+
+    for (i = 0; wq->nodes != NULL && i < wq->node_count; i++)
+        pthread_mutex_destroy (&wq->nodes[i].mutex);
+    free (wq->nodes);
+    free (wq->cpu_node);
+    wq->nodes = NULL;
+    wq->cpu_node = NULL;
+}
+
+/*
+ * Replaces workq_topology, for testing (see workq.h).
+ */
+int (*workq_topology_hook) (int *cpu_node) = NULL;
+
+#ifdef __linux__
+/*
+ * Find the NUMA node of each processor the process may run on,
+ * numbering the nodes that have any from 0, and storing -1 for
+ * the rest. Returns the number of nodes.
+ */
+static int workq_topology (int *cpu_node)
+{
+    cpu_set_t allowed;
+    char name[64];
+    FILE *list;
+    int nodes = 0, used, node, cpu, lo, hi, c;
+
+    if (sched_getaffinity (0, sizeof (allowed), &allowed) != 0)
+        return 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        cpu_node[cpu] = CPU_ISSET (cpu, &allowed) ? 0 : -1;
+
+    /*
+     * Each node's "cpulist" is a list of ranges, like "0-3,8-11".
+     * Without sysfs, every processor stays on node 0.
+     */
+    for (node = 0; node < WORKQ_MAX_NODES; node++) {
+        sprintf (name, "/sys/devices/system/node/node%d/cpulist", node);
+        list = fopen (name, "r");
+        if (list == NULL)
+            continue;
+        used = 0;
+        while (fscanf (list, "%d", &lo) == 1) {
+            hi = lo;
+            c = getc (list);
+            if (c == '-') {
+                if (fscanf (list, "%d", &hi) != 1)
+                    break;
+                c = getc (list);
+            }
+            for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+                if (cpu_node[cpu] >= 0) {
+                    cpu_node[cpu] = nodes;
+                    used = 1;
+                }
+            }
+            if (c != ',')
+                break;
+        }
+        fclose (list);
+        nodes += used;
+    }
+    return nodes > 0 ? nodes : 1;
+}
+
+/*
+ * Choose a processor (and so a node) for each of the work
+ * queue's server slots, according to the attributes' placement
+ * policy, and set up a queue for each node that has servers.
+ */
+static int workq_place (workq_t *wq, workq_attr_t *attr, int slots)
+{
+    int *order, *start, *size, *has;
+    int nodes, count = 0, status = 0, node, cpu, i;
+
+    wq->cpu_node = (int *)malloc (CPU_SETSIZE * sizeof (int));
+    if (wq->cpu_node == NULL)
+        return ENOMEM;
+    if (workq_topology_hook != NULL)
+        nodes = workq_topology_hook (wq->cpu_node);
+    else
+        nodes = workq_topology (wq->cpu_node);
+    order = (int *)malloc (CPU_SETSIZE * sizeof (int));
+    start = (int *)calloc (nodes * 3, sizeof (int));
+    if (nodes == 0 || order == NULL || start == NULL) {
+        free (order);
+        free (start);
+        free (wq->cpu_node);
+        wq->cpu_node = NULL;
+        return nodes == 0 ? errno : ENOMEM;
+    }
+    size = start + nodes;
+    has = size + nodes;
+
+    /*
+     * List the processors in node order, and note where each
+     * node's begin.
+     */
+    for (node = 0; node < nodes; node++) {
+        start[node] = count;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (wq->cpu_node[cpu] == node)
+                order[count++] = cpu;
+        size[node] = count - start[node];
+    }
+
+    for (i = 0; i < slots; i++) {
+        switch (attr->placement) {
+        case WORKQ_PLACE_COMPACT:
+            cpu = order[i % count];
+            break;
+        case WORKQ_PLACE_SCATTER:
+            node = i % nodes;
+            cpu = order[start[node] + (i / nodes) % size[node]];
+            break;
+        default:
+            cpu = attr->cpus[i % attr->cpu_count];
+            if (cpu < 0 || cpu >= CPU_SETSIZE || wq->cpu_node[cpu] < 0)
+                status = EINVAL;
+            break;
+        }
+        if (status != 0)
+            break;
+        wq->servers[i].cpu = cpu;
+        wq->servers[i].node = wq->cpu_node[cpu];
+        has[wq->servers[i].node] = 1;
+    }
+
+    /*
+     * Threads on nodes without servers use the shared queue.
+     * Only bother with node queues if servers are on more than
+     * one node.
+     */
+    wq->cpu_max = 0;
+    for (cpu = 0; status == 0 && cpu < CPU_SETSIZE; cpu++) {
+        if (wq->cpu_node[cpu] >= 0) {
+            if (!has[wq->cpu_node[cpu]])
+                wq->cpu_node[cpu] = -1;
+            wq->cpu_max = cpu + 1;
+        }
+    }
+    for (node = count = 0; node < nodes; node++)
+        count += has[node];
+    if (status == 0 && count > 1) {
+        wq->nodes = (workq_node_t *)calloc (nodes, sizeof (workq_node_t));
+        if (wq->nodes == NULL)
+            status = ENOMEM;
+        for (i = 0; status == 0 && i < nodes; i++) {
+            status = pthread_mutex_init (&wq->nodes[i].mutex, NULL);
+            if (status != 0) {
+                while (--i >= 0)
+                    pthread_mutex_destroy (&wq->nodes[i].mutex);
+                free (wq->nodes);
+                wq->nodes = NULL;
+            }
+        }
+        wq->node_count = nodes;
+    }
+    free (order);
+    free (start);
+    if (status != 0) {
+        free (wq->cpu_node);
+        wq->cpu_node = NULL;
+    }
+    return status;
+}
+#endif
+
+/*
+ * Initialize a work queue attributes object.
+ */
+int workq_attr_init (workq_attr_t *attr)
+{
+    int i;
+
+    attr->capacity = 0;                 /* unbounded */
+    attr->full = WORKQ_FULL_BLOCK;
+    attr->batch = 1;
+    attr->batch_engine = NULL;          /* use plain engine */
+    attr->minthreads = 0;               /* all servers time out */
+    attr->prestart = 0;                 /* create servers on demand */
+    attr->spin = 0;                     /* wait immediately */
+    attr->timeout.tv_sec = 2;           /* idle timeout */
+    attr->timeout.tv_nsec = 0;
+    attr->policy = WORKQ_STRICT;
+    for (i = 0; i < WORKQ_PRIORITIES; i++)
+        attr->weight[i] = 1 << i;       /* 1, 2, 4, 8 */
+    attr->maxthreads = 0;               /* as many as "threads" */
+    attr->scale_min = attr->scale_max = 0;
+    attr->scale_interval = 0;           /* no autoscaling */
+    attr->scale_target = 0;
+    attr->placement = WORKQ_PLACE_NONE;
+    attr->cpus = NULL;
+    attr->cpu_count = 0;
+    return 0;
+}
+
+/*
+ * Destroy a work queue attributes object.
+ */
+int workq_attr_destroy (workq_attr_t *attr)
+{
+    free (attr->cpus);
+    attr->cpus = NULL;
+    return 0;
+}
+
+/*
+ * Set the capacity of a bounded work queue. A capacity of 0
+ * (the default) means the queue is unbounded. The capacity is
+ * rounded up to a power of 2.
+ */
+int workq_attr_setcapacity (workq_attr_t *attr, int capacity)
+{
+    if (capacity < 0)
+        return EINVAL;
+    attr->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Set the behavior of workq_add when a bounded work queue is
+ * full: WORKQ_FULL_BLOCK (the default) or WORKQ_FULL_EAGAIN.
+ */
+int workq_attr_setfull (workq_attr_t *attr, int full)
+{
+    if (full != WORKQ_FULL_BLOCK && full != WORKQ_FULL_EAGAIN)
+        return EINVAL;
+    attr->full = full;
+    return 0;
+}
+
+/*
+ * Specify a batch engine, which is given up to "max" requests
+ * (as an array of their data pointers) at a time. A work queue
+ * with a batch engine doesn't call the plain engine routine.
+ */
+int workq_attr_setbatch (
+    workq_attr_t *attr, void (*engine)(void **items, int count), int max)
+{
+    if (engine == NULL || max < 1)
+        return EINVAL;
+    attr->batch_engine = engine;
+    attr->batch = max;
+    return 0;
+}
+
+/*
+ * Set the number of servers that stay resident however long
+ * they're idle. (They're still only created when needed, unless
+ * they're prestarted.)
+ */
+int workq_attr_setminthreads (workq_attr_t *attr, int minthreads)
+{
+    if (minthreads < 0)
+        return EINVAL;
+    attr->minthreads = minthreads;
+    return 0;
+}
+
+/*
+ * Set the number of servers to create when the work queue is
+ * initialized, so that the first requests don't wait for thread
+ * creation. Prestarted servers still time out when idle, unless
+ * they're within the minimum set by workq_attr_setminthreads.
+ */
+int workq_attr_setprestart (workq_attr_t *attr, int prestart)
+{
+    if (prestart < 0)
+        return EINVAL;
+    attr->prestart = prestart;
+    return 0;
+}
+
+/*
+ * Set the number of times an idle server checks for new work
+ * (yielding the processor in between) before it waits.
+ */
+int workq_attr_setspin (workq_attr_t *attr, int spin)
+{
+    if (spin < 0)
+        return EINVAL;
+    attr->spin = spin;
+    return 0;
+}
+
+/*
+ * Set how long a server waits for work before it exits.
+ */
+int workq_attr_settimeout (workq_attr_t *attr, const struct timespec *timeout)
+{
+    if (timeout->tv_sec < 0
+            || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000)
+        return EINVAL;
+    attr->timeout = *timeout;
+    return 0;
+}
+
+/*
+ * Set how servers choose among the priority lanes: always from
+ * the highest priority lane that has requests (WORKQ_STRICT, the
+ * default), or in proportion to the lanes' weights
+ * (WORKQ_WEIGHTED).
+ */
+int workq_attr_setpolicy (workq_attr_t *attr, int policy)
+{
+    if (policy != WORKQ_STRICT && policy != WORKQ_WEIGHTED)
+        return EINVAL;
+    attr->policy = policy;
+    return 0;
+}
+
+/*
+ * Set the weight of a priority lane under WORKQ_WEIGHTED. While
+ * several lanes have requests, each gets a share of the servers'
+ * attention in proportion to its weight. By default, each
+ * priority has twice the weight of the one below.
+ */
+int workq_attr_setweight (workq_attr_t *attr, int prio, int weight)
+{
+    if (prio < 0 || prio >= WORKQ_PRIORITIES || weight < 1)
+        return EINVAL;
+    attr->weight[prio] = weight;
+    return 0;
+}
+
+/*
+ * Set the number of server slots, which limits how far the work
+ * queue's parallelism can be raised with workq_set_parallelism.
+ * (By default, there are as many as the "threads" argument to
+ * workq_init_attr, so the parallelism can only be lowered.)
+ */
+int workq_attr_setmaxthreads (workq_attr_t *attr, int maxthreads)
+{
+    if (maxthreads < 0)
+        return EINVAL;
+    attr->maxthreads = maxthreads;
+    return 0;
+}
+
+/*
+ * Ask the work queue to adjust its own parallelism, every
+ * "interval" ns, between "min" and "max" threads, trying to keep
+ * the mean time requests wait to be started under "target" ns.
+ * (There are at least "max" server slots.)
+ */
+int workq_attr_setautoscale (
+    workq_attr_t *attr, int min, int max, uint64_t interval, uint64_t target)
+{
+    if (min < 1 || max < min || interval == 0)
+        return EINVAL;
+    attr->scale_min = min;
+    attr->scale_max = max;
+    attr->scale_interval = interval;
+    attr->scale_target = target;
+    return 0;
+}
+
+/*
+ * Set the policy for binding servers to processors. Binding is
+ * supported only on Linux.
+ */
+int workq_attr_setplacement (workq_attr_t *attr, int placement)
+{
+    if (placement != WORKQ_PLACE_NONE && placement != WORKQ_PLACE_COMPACT
+            && placement != WORKQ_PLACE_SCATTER)
+        return EINVAL;
+#ifndef __linux__
+    if (placement != WORKQ_PLACE_NONE)
+        return ENOSYS;
+#endif
+    attr->placement = placement;
+    return 0;
+}
+
+/*
+ * Bind servers to the "count" processors listed in "cpus", in
+ * turn, by server slot. (A processor may be listed more than
+ * once.)
+ */
+int workq_attr_setcpus (workq_attr_t *attr, const int *cpus, int count)
+{
+#ifdef __linux__
+    int *copy;
+    int i;
+
+    if (cpus == NULL || count < 1)
+        return EINVAL;
+    copy = (int *)malloc (count * sizeof (int));
+    if (copy == NULL)
+        return ENOMEM;
+    for (i = 0; i < count; i++)
+        copy[i] = cpus[i];
+    free (attr->cpus);
+    attr->cpus = copy;
+    attr->cpu_count = count;
+    attr->placement = WORKQ_PLACE_CPUS;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+/*
+ * Initialize a work queue.
+ */
+int workq_init (workq_t *wq, int threads, void (*engine)(void *arg))
+{
+    return workq_init_attr (wq, NULL, threads, engine);
+}
+
+/*
+ * Initialize a work queue, with optional attributes.
+ */
+int workq_init_attr (
+    workq_t *wq, workq_attr_t *attr,
+    int threads, void (*engine)(void *arg))
+{
+    workq_attr_t defaults;
+    pthread_condattr_t cvattr;
+    int status, slots, i;
+
+    pthread_once (&workq_park_once, workq_park_init);
+    if (attr == NULL) {
+        workq_attr_init (&defaults);
+        attr = &defaults;
+    }
+
+    status = pthread_attr_init (&wq->attr);
+    if (status != 0)
+        return status;
+    status = pthread_attr_setdetachstate (
+        &wq->attr, PTHREAD_CREATE_DETACHED);
+    if (status != 0) {
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    status = pthread_mutex_init (&wq->mutex, NULL);
+    if (status != 0) {
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    /*
+     * Servers wait for work (and for delayed items) with absolute
+     * times measured by CLOCK_MONOTONIC.
+     */
+    status = pthread_condattr_init (&cvattr);
+    if (status != 0) {
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    status = pthread_condattr_setclock (&cvattr, CLOCK_MONOTONIC);
+    if (status == 0)
+        status = pthread_cond_init (&wq->cv, &cvattr);
+    pthread_condattr_destroy (&cvattr);
+    if (status != 0) {
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    status = pthread_cond_init (&wq->space, NULL);
+    if (status != 0) {
+        pthread_cond_destroy (&wq->cv);
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    status = pthread_cond_init (&wq->drained, NULL);
+    if (status != 0) {
+        pthread_cond_destroy (&wq->space);
+        pthread_cond_destroy (&wq->cv);
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    status = pthread_key_create (&wq->server_key, NULL);
+    if (status != 0) {
+        pthread_cond_destroy (&wq->drained);
+        pthread_cond_destroy (&wq->space);
+        pthread_cond_destroy (&wq->cv);
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    status = pthread_key_create (
+        &wq->magazine_key, workq_magazine_release);
+    if (status != 0) {
+        pthread_key_delete (wq->server_key);
+        pthread_cond_destroy (&wq->drained);
+        pthread_cond_destroy (&wq->space);
+        pthread_cond_destroy (&wq->cv);
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status;
+    }
+    if (attr->scale_interval > 0) {
+        if (threads < attr->scale_min)
+            threads = attr->scale_min;
+        if (threads > attr->scale_max)
+            threads = attr->scale_max;
+    }
+    slots = threads;
+    if (slots < attr->maxthreads)
+        slots = attr->maxthreads;
+    if (attr->scale_interval > 0 && slots < attr->scale_max)
+        slots = attr->scale_max;
+    wq->servers = (workq_server_t *)calloc (
+        slots, sizeof (workq_server_t));
+    wq->batch = (attr->batch_engine != NULL) ? attr->batch : 1;
+    for (i = 0; wq->servers != NULL && i < slots; i++) {
+        wq->servers[i].cpu = -1;        /* not bound */
+        wq->servers[i].items = (workq_ele_t *)malloc (
+            wq->batch * sizeof (workq_ele_t));
+        wq->servers[i].data = (void **)malloc (
+            wq->batch * sizeof (void *));
+        if (wq->servers[i].items == NULL
+                || wq->servers[i].data == NULL) {
+            workq_free_servers (wq->servers, slots);
+            wq->servers = NULL;
+        }
+    }
+    wq->nodes = NULL;
+    wq->node_count = 0;
+    wq->cpu_node = NULL;
+    wq->cpu_max = 0;
+    status = 0;
+#ifdef __linux__
+    if (wq->servers != NULL && attr->placement != WORKQ_PLACE_NONE) {
+        status = workq_place (wq, attr, slots);
+        if (status != 0) {
+            workq_free_servers (wq->servers, slots);
+            wq->servers = NULL;
+        }
+    }
+#endif
+    wq->scale = NULL;
+    if (wq->servers != NULL && attr->scale_interval > 0) {
+        wq->scale = (workq_scale_t *)calloc (1, sizeof (workq_scale_t));
+        if (wq->scale == NULL) {
+            workq_free_servers (wq->servers, slots);
+            wq->servers = NULL;
+        } else {
+            wq->scale->min = attr->scale_min;
+            wq->scale->max = attr->scale_max;
+            wq->scale->interval = attr->scale_interval;
+            wq->scale->target = attr->scale_target;
+            atomic_init (
+                &wq->scale->next, workq_now () + attr->scale_interval);
+        }
+    }
+    wq->futures = NULL;
+    if (wq->servers != NULL) {
+        wq->futures = (workq_pool_t *)malloc (sizeof (workq_pool_t));
+        if (wq->futures == NULL
+                || pthread_mutex_init (&wq->futures->mutex, NULL) != 0) {
+            free (wq->futures);
+            workq_free_servers (wq->servers, slots);
+            wq->servers = NULL;
+        } else
+            wq->futures->free = NULL;
+    }
+    wq->keys = NULL;
+    if (wq->servers != NULL) {
+        wq->keys = (workq_keys_t *)calloc (1, sizeof (workq_keys_t));
+        if (wq->keys == NULL
+                || pthread_mutex_init (&wq->keys->mutex, NULL) != 0) {
+            free (wq->keys);
+            pthread_mutex_destroy (&wq->futures->mutex);
+            free (wq->futures);
+            workq_free_servers (wq->servers, slots);
+            wq->servers = NULL;
+        }
+    }
+    wq->lanes = NULL;
+    if (wq->servers != NULL) {
+        wq->lanes = (workq_lane_t *)calloc (
+            WORKQ_PRIORITIES, sizeof (workq_lane_t));
+        for (i = 0; wq->lanes != NULL && i < WORKQ_PRIORITIES; i++) {
+            wq->lanes[i].weight = attr->weight[i];
+            if (attr->capacity > 0) {
+                wq->lanes[i].ring = workq_ring_alloc (attr->capacity);
+                if (wq->lanes[i].ring == NULL) {
+                    workq_free_lanes (wq->lanes);
+                    wq->lanes = NULL;
+                }
+            }
+        }
+        if (wq->lanes == NULL) {
+            pthread_mutex_destroy (&wq->keys->mutex);
+            free (wq->keys);
+            pthread_mutex_destroy (&wq->futures->mutex);
+            free (wq->futures);
+            workq_free_servers (wq->servers, slots);
+            wq->servers = NULL;
+        }
+    }
+    if (wq->servers == NULL) {
+        workq_free_nodes (wq);
+        free (wq->scale);
+        pthread_key_delete (wq->magazine_key);
+        pthread_key_delete (wq->server_key);
+        pthread_cond_destroy (&wq->drained);
+        pthread_cond_destroy (&wq->space);
+        pthread_cond_destroy (&wq->cv);
+        pthread_mutex_destroy (&wq->mutex);
+        pthread_attr_destroy (&wq->attr);
+        return status != 0 ? status : ENOMEM;
+    }
+    wq->quit = 0;                       /* not time to quit */
+    wq->capacity = attr->capacity;
+    wq->policy = attr->policy;
+    wq->parallelism = threads;          /* max servers */
+    wq->slots = slots;                  /* most it can be raised to */
+    wq->counter = 0;                    /* no server threads yet */
+    wq->idle = 0;                       /* no idle servers */
+    wq->wakeups = 0;                    /* no wakeups pending */
+    wq->created = wq->exited = 0;
+    wq->full = attr->full;
+    wq->magazines = NULL;               /* no producer caches */
+    atomic_init (&wq->returned, NULL);  /* no free entries */
+    wq->blocked = 0;                    /* no producers waiting */
+    wq->engine = engine;
+    wq->batch_engine = attr->batch_engine;
+    wq->queued = 0;                     /* shared queue is empty */
+    wq->urgent = 0;
+    wq->runnable = 0;                   /* no keyed requests */
+    wq->timers = NULL;                  /* no delayed items */
+    wq->timer_count = wq->timer_size = 0;
+    wq->timer_id = 0;
+    wq->next_timer = WORKQ_NEVER;
+    wq->keeper = 0;
+    atomic_init (&wq->epoch, 1);        /* no flushes yet */
+    wq->flushed = 0;
+    atomic_init (&wq->counted[0], 0);
+    atomic_init (&wq->counted[1], 0);
+    wq->flushing = 0;
+    wq->minthreads = attr->minthreads;
+    wq->spin = attr->spin;
+    wq->timeout = attr->timeout;
+    wq->valid = WORKQ_VALID;
+
+    /*
+     * Create any servers that were requested up front. If that
+     * fails, the work queue is still usable (servers will be
+     * created as requests arrive), so don't report an error.
+     */
+    if (attr->prestart > 0) {
+        pthread_mutex_lock (&wq->mutex);
+        workq_wake (wq, attr->prestart);
+        pthread_mutex_unlock (&wq->mutex);
+    }
+    return 0;
+}
+
+/*
+ * Destroy a work queue.
+ */
+int workq_destroy (workq_t *wq)
+{
+    workq_magazine_t *mag;
+    workq_strand_t *strand;
+    workq_future_t *future;
+    workq_ele_t *we, *next;
+    int status, status1, status2, i;
+
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return status;
+    wq->valid = 0;                 /* prevent any other operations */
+
+    /*
+     * Check whether any threads are active, and run them down:
+     *
+     * 1.       set the quit flag
+     * 2.       broadcast to wake any servers that may be asleep
+     * 4.       wait for all threads to quit (counter goes to 0)
+     *          Because we don't use join, we don't need to worry
+     *          about tracking thread IDs.
+     */
+    if (wq->counter > 0) {
+        wq->quit = 1;
+        /* if any threads are idling, wake them. */
+        if (wq->idle > 0) {
+            status = pthread_cond_broadcast (&wq->cv);
+            if (status != 0) {
+                pthread_mutex_unlock (&wq->mutex);
+                return status;
+            }
+        }
+
+        /*
+         * Just to prove that every rule has an exception, I'm
+         * using the "cv" condition for two separate predicates
+         * here. That's OK, since the case used here applies
+         * only once during the life of a work queue -- during
+         * rundown. The overhead is minimal and it's not worth
+         * creating a separate condition variable that would be
+         * waited and signalled exactly once!
+         */
+        while (wq->counter > 0) {
+            status = pthread_cond_wait (&wq->cv, &wq->mutex);
+            if (status != 0) {
+                pthread_mutex_unlock (&wq->mutex);
+                return status;
+            }
+        }       
+    }
+    status = pthread_mutex_unlock (&wq->mutex);
+    if (status != 0)
+        return status;
+
+    /*
+     * Free all cached queue entries. Delete the magazine key
+     * first, so that no thread's destructor will run after this.
+     * (Threads must, of course, have stopped using the queue.)
+     */
+    pthread_key_delete (wq->magazine_key);
+    while (wq->magazines != NULL) {
+        mag = wq->magazines;
+        wq->magazines = mag->link;
+        workq_ele_freelist (mag->first);
+        workq_ele_freelist (mag->spare);
+        free (mag);
+    }
+    for (i = 0; i < wq->slots; i++) {
+        workq_ele_freelist (wq->servers[i].magazine.first);
+        workq_ele_freelist (wq->servers[i].magazine.spare);
+    }
+    for (we = atomic_load (&wq->returned); we != NULL; we = next) {
+        next = (workq_ele_t *)we->data;
+        workq_ele_freelist (we);
+    }
+    while (wq->keys->free != NULL) {
+        strand = wq->keys->free;
+        wq->keys->free = strand->link;
+        free (strand);
+    }
+    pthread_mutex_destroy (&wq->keys->mutex);
+    free (wq->keys);
+    while (wq->futures->free != NULL) {
+        future = wq->futures->free;
+        wq->futures->free = future->link;
+        free (future);
+    }
+    pthread_mutex_destroy (&wq->futures->mutex);
+    free (wq->futures);
+    free (wq->timers);
+    free (wq->scale);
+    workq_free_nodes (wq);
+    workq_free_lanes (wq->lanes);
+    workq_free_servers (wq->servers, wq->slots);
+    pthread_key_delete (wq->server_key);
+    pthread_cond_destroy (&wq->drained);
+    pthread_cond_destroy (&wq->space);
+    status = pthread_mutex_destroy (&wq->mutex);
+    status1 = pthread_cond_destroy (&wq->cv);
+    status2 = pthread_attr_destroy (&wq->attr);
+    return (status ? status : (status1 ? status1 : status2));
+}
+
+/*
+ * Add an entry to the ring of a bounded work queue's lane for
+ * the entry's priority, waiting for space if necessary (and
+ * allowed).
+ */
+static int workq_add_ring (workq_t *wq, workq_ele_t *item, int wait)
+{
+    workq_ring_t *ring = wq->lanes[item->prio].ring;
+    int status, pushed;
+
+    if (workq_ring_push (ring, item))
+        return 0;
+    if (!wait)
+        return EAGAIN;
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return status;
+    wq->blocked++;
+    atomic_thread_fence (memory_order_seq_cst);
+    while (!(pushed = workq_ring_push (ring, item))) {
+        status = pthread_cond_wait (&wq->space, &wq->mutex);
+        if (status != 0)
+            break;
+    }
+    wq->blocked--;
+    pthread_mutex_unlock (&wq->mutex);
+    return pushed ? 0 : status;
+}
+
+/*
+ * Make sure that a server will see an entry that was just added
+ * to a deque, to the ring, or to a newly runnable key, without
+ * the mutex. We only need the mutex if some other server may be
+ * able to help: one is idle, or we're allowed to create another.
+ * (The fence orders our check of idle after the add; a server
+ * about to wait counts itself idle before checking for work for
+ * the last time.)
+ */
+static int workq_added (workq_t *wq, int count)
+{
+    int status;
+
+    if (wq->scale != NULL)
+        workq_autoscale_check (wq, workq_now ());
+    atomic_thread_fence (memory_order_seq_cst);
+    if (wq->idle == 0 && wq->counter >= wq->parallelism)
+        return 0;
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return status;
+    status = workq_wake (wq, count);
+    pthread_mutex_unlock (&wq->mutex);
+    return status;
+}
+
+/*
+ * Queue a request: either an item for the engine or, if "future"
+ * isn't NULL, a call submitted by workq_submit.
+ */
+static int workq_enqueue (
+    workq_t *wq, int prio, void *element, workq_future_t *future)
+{
+    workq_ele_t *item, ele;
+    workq_server_t *self;
+    workq_lane_t *lane;
+    int status, node;
+
+    self = (workq_server_t *)pthread_getspecific (wq->server_key);
+    lane = &wq->lanes[prio];
+
+    /*
+     * A bounded queue copies the request into the ring, rather
+     * than allocating an entry. A server thread never waits for
+     * space -- if every server were waiting, nothing would ever
+     * empty the ring -- so it can only get EAGAIN.
+     */
+    if (wq->capacity > 0 && self == NULL) {
+        ele.data = element;
+        ele.next = NULL;
+        ele.prio = prio;
+        ele.stamp = workq_now ();
+        ele.future = future;
+        ele.epoch = workq_begin (wq, 1);
+        status = workq_add_ring (
+            wq, &ele, wq->full == WORKQ_FULL_BLOCK);
+        if (status != 0) {
+            workq_finish (wq, ele.epoch, 1);
+            return status;
+        }
+        return workq_added (wq, 1);
+    }
+
+    /*
+     * Create and initialize a request structure.
+     */
+    item = workq_ele_alloc (wq, self);
+    if (item == NULL)
+        return ENOMEM;
+    item->data = element;
+    item->next = NULL;
+    item->prio = prio;
+    item->stamp = workq_now ();
+    item->future = future;
+    item->epoch = workq_begin (wq, 1);
+
+    /*
+     * If we're being called by one of our own servers, push
+     * the request on its deque. (If the deque is full, or the
+     * request has a higher priority, fall through and queue the
+     * request on the shared queue.)
+     */
+    if (self != NULL && prio == 0 && workq_deque_push (&self->deque, item))
+        return workq_added (wq, 1);
+    if (wq->capacity > 0) {
+        status = workq_add_ring (wq, item, 0);
+        if (status != 0)
+            workq_finish (wq, item->epoch, 1);
+        workq_ele_free (wq, self, item);
+        if (status != 0)
+            return status;
+        return workq_added (wq, 1);
+    }
+
+    /*
+     * If there are node queues, use the queue of the node we're
+     * running on.
+     */
+    if (wq->nodes != NULL && prio == 0
+            && (node = workq_node_of (wq, self)) >= 0) {
+        status = workq_add_node (wq, node, item, item, 1);
+        if (status != 0) {
+            workq_finish (wq, item->epoch, 1);
+            free (item);
+            return status;
+        }
+        return workq_added (wq, 1);
+    }
+
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0) {
+        workq_finish (wq, item->epoch, 1);
+        free (item);
+        return status;
+    }
+
+    /*
+     * Add the request to the end of its lane, updating the
+     * first and last pointers.
+     */
+    if (lane->first == NULL)
+        lane->first = item;
+    else
+        lane->last->next = item;
+    lane->last = item;
+    lane->queued++;
+    wq->queued++;
+    if (prio > 0)
+        wq->urgent++;
+
+    if (wq->scale != NULL)
+        workq_autoscale (wq, item->stamp);
+    status = workq_wake (wq, 1);
+    pthread_mutex_unlock (&wq->mutex);
+    return status;
+}
+
+/*
+ * Add an item to a work queue, at the lowest priority.
+ */
+int workq_add (workq_t *wq, void *element)
+{
+    return workq_add_prio (wq, 0, element);
+}
+
+/*
+ * Add an item to a work queue, at priority "prio" (from 0, the
+ * lowest, to WORKQ_PRIORITIES - 1).
+ */
+int workq_add_prio (workq_t *wq, int prio, void *element)
+{
+    if (wq->valid != WORKQ_VALID || prio < 0 || prio >= WORKQ_PRIORITIES)
+        return EINVAL;
+    return workq_enqueue (wq, prio, element, NULL);
+}
+
+/*
+ * Add "count" items to a work queue at once. This is equivalent
+ * to calling workq_add for each item, but the items are queued
+ * with a single lock of the mutex (or a single reservation of
+ * space in the ring), and idle servers are woken (or new servers
+ * created) all at once.
+ *
+ * The items are queued at the lowest priority. If
+ * workq_add_batch returns an error, none of the items have
+ * been queued -- with one exception: on a bounded queue that
+ * waits when full, the items are queued as space becomes
+ * available, so an unexpected error may leave some queued.
+ */
+int workq_add_batch (workq_t *wq, void **items, int count)
+{
+    workq_ele_t *first = NULL, *last = NULL, *item, ele;
+    workq_server_t *self;
+    workq_lane_t *lane;
+    uint64_t stamp;
+    int status, local, epoch, node, i;
+
+    if (wq->valid != WORKQ_VALID || count < 0)
+        return EINVAL;
+    if (count == 0)
+        return 0;
+    self = (workq_server_t *)pthread_getspecific (wq->server_key);
+    lane = &wq->lanes[0];
+    stamp = workq_now ();
+    epoch = workq_begin (wq, count);
+
+    /*
+     * A server puts as many of the requests as will fit on its
+     * own deque. Only the server pushes onto its deque, so the
+     * space can't shrink under us.
+     */
+    local = 0;
+    if (self != NULL) {
+        local = workq_deque_room (&self->deque);
+        if (local > count)
+            local = count;
+    }
+
+    /*
+     * Allocate entries for any requests that won't be copied
+     * into the ring, before queueing anything.
+     */
+    for (i = 0; i < (wq->capacity > 0 ? local : count); i++) {
+        item = workq_ele_alloc (wq, self);
+        if (item == NULL) {
+            workq_ele_freelist (first);
+            workq_finish (wq, epoch, count);
+            return ENOMEM;
+        }
+        item->data = items[i];
+        item->next = NULL;
+        item->prio = 0;
+        item->stamp = stamp;
+        item->future = NULL;
+        item->epoch = epoch;
+        if (first == NULL)
+            first = item;
+        else
+            last->next = item;
+        last = item;
+    }
+
+    /*
+     * Copy the rest into the ring. Reserve space for all of them
+     * at once unless we're allowed to wait (and servers never
+     * wait for space).
+     */
+    if (wq->capacity > 0 && local < count) {
+        if (self != NULL || wq->full == WORKQ_FULL_EAGAIN) {
+            if (!workq_ring_pushn (
+                    lane->ring, items + local, count - local,
+                    stamp, epoch)) {
+                workq_ele_freelist (first);
+                workq_finish (wq, epoch, count);
+                return EAGAIN;
+            }
+        } else {
+            for (i = local; i < count; i++) {
+                ele.data = items[i];
+                ele.next = NULL;
+                ele.prio = 0;
+                ele.stamp = stamp;
+                ele.future = NULL;
+                ele.epoch = epoch;
+                status = workq_add_ring (wq, &ele, 1);
+                if (status != 0) {
+                    workq_ele_freelist (first);
+                    workq_finish (wq, epoch, local + count - i);
+                    workq_added (wq, i - local);
+                    return status;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < local; i++) {
+        item = first;
+        first = item->next;
+        workq_deque_push (&self->deque, item);
+    }
+    if (first == NULL)
+        return workq_added (wq, count);
+
+    /*
+     * The remaining entries go on the queue of the node we're
+     * running on, if there are node queues, or on the shared
+     * queue, in a single critical section.
+     */
+    if (wq->nodes != NULL && (node = workq_node_of (wq, self)) >= 0) {
+        status = workq_add_node (wq, node, first, last, count - local);
+        if (status != 0) {
+            workq_ele_freelist (first);
+            workq_finish (wq, epoch, count - local);
+            return status;
+        }
+        return workq_added (wq, count);
+    }
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0) {
+        workq_ele_freelist (first);
+        workq_finish (wq, epoch, count - local);
+        return status;
+    }
+    if (lane->first == NULL)
+        lane->first = first;
+    else
+        lane->last->next = first;
+    lane->last = last;
+    lane->queued += count - local;
+    wq->queued += count - local;
+    if (wq->scale != NULL)
+        workq_autoscale (wq, stamp);
+    status = workq_wake (wq, count);
+    pthread_mutex_unlock (&wq->mutex);
+    return status;
+}
+
+/*
+ * Empty a histogram.
+ */
+static void workq_hist_clear (workq_hist_t *hist)
+{
+    int i;
+
+    hist->count = hist->sum = hist->max = 0;
+    for (i = 0; i < WORKQ_BUCKETS; i++)
+        hist->bucket[i] = 0;
+}
+
+/*
+ * Add the samples from a server's histogram to "hist". The server
+ * may be adding samples at the same time, so the totals may be a
+ * little inconsistent with each other.
+ */
+static void workq_hist_add (workq_hist_t *hist, workq_histo_t *h)
+{
+    uint64_t max;
+    int i;
+
+    hist->count += atomic_load_explicit (&h->count, memory_order_relaxed);
+    hist->sum += atomic_load_explicit (&h->sum, memory_order_relaxed);
+    max = atomic_load_explicit (&h->max, memory_order_relaxed);
+    if (max > hist->max)
+        hist->max = max;
+    for (i = 0; i < WORKQ_BUCKETS; i++)
+        hist->bucket[i] += atomic_load_explicit (
+            &h->bucket[i], memory_order_relaxed);
+}
+
+/*
+ * Report how long requests of priority "prio" have waited on the
+ * work queue (from being added until a server started to run
+ * them), by adding up the histograms kept by each server.
+ */
+int workq_delay (workq_t *wq, int prio, workq_hist_t *hist)
+{
+    int i;
+
+    if (wq->valid != WORKQ_VALID || prio < 0 || prio >= WORKQ_PRIORITIES)
+        return EINVAL;
+    workq_hist_clear (hist);
+    for (i = 0; i < wq->slots; i++)
+        workq_hist_add (hist, &wq->servers[i].delay[prio]);
+    return 0;
+}
+
+/*
+ * Estimate a percentile (from 0 to 100) of the samples in a
+ * histogram: the upper bound of the bucket holding that sample,
+ * but no more than the longest sample. Returns 0 if the
+ * histogram is empty.
+ */
+uint64_t workq_hist_percentile (const workq_hist_t *hist, double pct)
+{
+    uint64_t total = 0, rank, limit;
+    int i;
+
+    for (i = 0; i < WORKQ_BUCKETS; i++)
+        total += hist->bucket[i];
+    if (total == 0)
+        return 0;
+    rank = (uint64_t)(total * pct / 100.0);
+    if (rank >= total)
+        rank = total - 1;
+    for (i = 0; i < WORKQ_BUCKETS - 1; i++) {
+        if (rank < hist->bucket[i])
+            break;
+        rank -= hist->bucket[i];
+    }
+    if (i == WORKQ_BUCKETS - 1)
+        return hist->max;
+    limit = (uint64_t)2 << i;           /* upper bound of bucket i */
+    return limit < hist->max ? limit : hist->max;
+}
+
+/*
+ * Add an item to a work queue, to be run after (and never at the
+ * same time as) any items already added with the same key. Keyed
+ * items are queued at the lowest priority.
+ */
+int workq_add_keyed (workq_t *wq, unsigned long key, void *element)
+{
+    workq_keys_t *keys = wq->keys;
+    workq_strand_t *strand, **bucket;
+    workq_server_t *self;
+    workq_ele_t *item;
+    int status, wake = 0;
+
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    self = (workq_server_t *)pthread_getspecific (wq->server_key);
+    item = workq_ele_alloc (wq, self);
+    if (item == NULL)
+        return ENOMEM;
+    item->data = element;
+    item->next = NULL;
+    item->prio = 0;
+    item->stamp = workq_now ();
+    item->future = NULL;
+    item->epoch = workq_begin (wq, 1);
+
+    status = pthread_mutex_lock (&keys->mutex);
+    if (status != 0) {
+        workq_finish (wq, item->epoch, 1);
+        free (item);
+        return status;
+    }
+
+    /*
+     * Find the key's strand, or start a new one.
+     */
+    bucket = workq_key_bucket (keys, key);
+    for (strand = *bucket; strand != NULL; strand = strand->link)
+        if (strand->key == key)
+            break;
+    if (strand == NULL) {
+        strand = keys->free;
+        if (strand != NULL)
+            keys->free = strand->link;
+        else {
+            strand = (workq_strand_t *)malloc (sizeof (workq_strand_t));
+            if (strand == NULL) {
+                pthread_mutex_unlock (&keys->mutex);
+                workq_finish (wq, item->epoch, 1);
+                free (item);
+                return ENOMEM;
             }
         }
-        DPRINTF (("Work queue: %#lx, quit: %d\n", wq->first, wq->quit));
-        we = wq->first;
+        strand->key = key;
+        strand->first = strand->last = NULL;
+        strand->scheduled = 0;
+        strand->link = *bucket;
+        *bucket = strand;
+    }
+    if (strand->first == NULL)
+        strand->first = item;
+    else
+        strand->last->next = item;
+    strand->last = item;
+    keys->queued++;
 
-        if (we != NULL) {
-            wq->first = we->next;
-            if (wq->last == we)
-                wq->last = NULL;
-            status = pthread_mutex_unlock (&wq->mutex);
-            if (status != 0)
-                return NULL;
-            DPRINTF (("Worker calling engine\n"));
-            wq->engine (we->data);
-            free (we);
-            status = pthread_mutex_lock (&wq->mutex);
-            if (status != 0)
-                return NULL;
-        }
+    /*
+     * If the key wasn't already runnable (or running), it is now,
+     * and a server needs to know about it.
+     */
+    if (!strand->scheduled) {
+        strand->scheduled = 1;
+        strand->next = NULL;
+        if (keys->first == NULL)
+            keys->first = strand;
+        else
+            keys->last->next = strand;
+        keys->last = strand;
+        wq->runnable++;
+        wake = 1;
+    }
+    pthread_mutex_unlock (&keys->mutex);
+    return wake ? workq_added (wq, 1) : 0;
+}
 
-        /*
-         * If there are no more work requests, and the servers
-         * have been asked to quit, then shut down.
-         */
-        if (wq->first == NULL && wq->quit) {
-            DPRINTF (("Worker shutting down\n"));
-            wq->counter--;
+/*
+ * Take a snapshot of a work queue's statistics. The counts of
+ * server threads and queued requests are consistent with each
+ * other; the histograms are being added to as we read them.
+ */
+int workq_stats (workq_t *wq, workq_stats_t *stats)
+{
+    workq_server_t *server;
+    size_t head, tail;
+    long b, t;
+    int status, prio, i;
 
-            /*
-             * NOTE: Just to prove that every rule has an
-             * exception, I'm using the "cv" condition for two
-             * separate predicates here.  That's OK, since the
-             * case used here applies only once during the life
-             * of a work queue -- during rundown. The overhead
-             * is minimal and it's not worth creating a separate
-             * condition variable that would be waited and
-             * signaled exactly once!
-             */
-            if (wq->counter == 0)
-                pthread_cond_broadcast (&wq->cv);
-            pthread_mutex_unlock (&wq->mutex);
-            return NULL;
-        }
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    workq_hist_clear (&stats->wait);
+    workq_hist_clear (&stats->service);
+    stats->steals = stats->remote = 0;
+    for (prio = 0; prio < WORKQ_PRIORITIES; prio++)
+        stats->queued[prio] = 0;
+    for (i = 0; i < wq->slots; i++) {
+        server = &wq->servers[i];
+        for (prio = 0; prio < WORKQ_PRIORITIES; prio++)
+            workq_hist_add (&stats->wait, &server->delay[prio]);
+        workq_hist_add (&stats->service, &server->service);
+        stats->steals += atomic_load_explicit (
+            &server->steals, memory_order_relaxed);
+        stats->remote += atomic_load_explicit (
+            &server->remote, memory_order_relaxed);
 
         /*
-         * If there's no more work, and we wait for as long as
-         * we're allowed, then terminate this server thread.
+         * Requests on a server's deque are all of the lowest
+         * priority.
          */
-        if (wq->first == NULL && timedout) {
-            DPRINTF (("engine terminating due to timeout.\n"));
-            wq->counter--;
-            break;
-        }
+        t = atomic_load (&server->deque.top);
+        b = atomic_load (&server->deque.bottom);
+        if (b > t)
+            stats->queued[0] += b - t;
     }
 
+    status = pthread_mutex_lock (&wq->keys->mutex);
+    if (status != 0)
+        return status;
+    stats->keyed = wq->keys->queued;
+    pthread_mutex_unlock (&wq->keys->mutex);
+
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return status;
+    stats->threads = wq->counter;
+    stats->parallelism = wq->parallelism;
+    stats->idle = wq->idle;
+    stats->created = wq->created;
+    stats->exited = wq->exited;
+    stats->delayed = wq->timer_count;
+    for (prio = 0; prio < WORKQ_PRIORITIES; prio++) {
+        if (wq->capacity > 0) {
+            head = atomic_load (&wq->lanes[prio].ring->head);
+            tail = atomic_load (&wq->lanes[prio].ring->tail);
+            if (tail > head)
+                stats->queued[prio] += tail - head;
+        } else
+            stats->queued[prio] += wq->lanes[prio].queued;
+    }
+    for (i = 0; wq->nodes != NULL && i < wq->node_count; i++)
+        stats->queued[0] += wq->nodes[i].queued;
     pthread_mutex_unlock (&wq->mutex);
-    DPRINTF (("Worker exiting\n"));
-    return NULL;
+    return 0;
 }
 
 /*
- * Initialize a work queue.
+ * Return a future handle to its work queue's pool.
  */
-int workq_init (workq_t *wq, int threads, void (*engine)(void *arg))
+static void workq_future_free (workq_future_t *future)
+{
+    workq_pool_t *pool = future->wq->futures;
+
+    pthread_mutex_lock (&pool->mutex);
+    future->link = pool->free;
+    pool->free = future;
+    pthread_mutex_unlock (&pool->mutex);
+}
+
+/*
+ * Queue a call of "fn" with argument "arg", at the lowest
+ * priority, and return a handle for its result.
+ */
+int workq_submit (
+    workq_t *wq, void *(*fn)(void *), void *arg, workq_future_t **handle)
 {
+    workq_pool_t *pool = wq->futures;
+    workq_future_t *future;
     int status;
 
-    status = pthread_attr_init (&wq->attr);
+    if (wq->valid != WORKQ_VALID || fn == NULL)
+        return EINVAL;
+    status = pthread_mutex_lock (&pool->mutex);
     if (status != 0)
         return status;
-    status = pthread_attr_setdetachstate (
-        &wq->attr, PTHREAD_CREATE_DETACHED);
-    if (status != 0) {
-        pthread_attr_destroy (&wq->attr);
-        return status;
+    future = pool->free;
+    if (future != NULL)
+        pool->free = future->link;
+    pthread_mutex_unlock (&pool->mutex);
+    if (future == NULL) {
+        future = (workq_future_t *)malloc (sizeof (workq_future_t));
+        if (future == NULL)
+            return ENOMEM;
+        future->wq = wq;
     }
-    status = pthread_mutex_init (&wq->mutex, NULL);
+    future->fn = fn;
+    future->arg = arg;
+    future->result = NULL;
+    atomic_init (&future->state, WORKQ_PENDING);
+
+    status = workq_enqueue (wq, 0, arg, future);
     if (status != 0) {
-        pthread_attr_destroy (&wq->attr);
+        workq_future_free (future);
         return status;
     }
-    status = pthread_cond_init (&wq->cv, NULL);
-    if (status != 0) {
-        pthread_mutex_destroy (&wq->mutex);
-        pthread_attr_destroy (&wq->attr);
+    *handle = future;
+    return 0;
+}
+
+/*
+ * Wait until a future's result is ready, or (if "abstime" isn't
+ * NULL) until the time "abstime", measured by CLOCK_MONOTONIC.
+ * Like an idle server, first check as many times as the work
+ * queue's spin attribute allows, yielding the processor in
+ * between. Then mark the handle parked with the slot's mutex
+ * locked: the server locks the same mutex to broadcast, so it
+ * can't do that between our check of the state and our wait.
+ */
+static int workq_future_park (
+    workq_future_t *future, const struct timespec *abstime)
+{
+    workq_park_t *park = workq_park_slot (future);
+    int state = WORKQ_PENDING, status = 0, i;
+
+    for (i = 0; atomic_load (&future->state) != WORKQ_DONE; i++) {
+        if (i >= future->wq->spin)
+            break;
+        sched_yield ();
+    }
+    if (atomic_load (&future->state) == WORKQ_DONE)
+        return 0;
+    status = pthread_mutex_lock (&park->mutex);
+    if (status != 0)
         return status;
+    if (atomic_compare_exchange_strong (
+            &future->state, &state, WORKQ_PARKED)
+            || state == WORKQ_PARKED) {
+        while (atomic_load (&future->state) != WORKQ_DONE) {
+            if (abstime == NULL)
+                status = pthread_cond_wait (&park->cond, &park->mutex);
+            else
+                status = pthread_cond_timedwait (
+                    &park->cond, &park->mutex, abstime);
+            if (status != 0)
+                break;
+        }
     }
-    wq->quit = 0;                       /* not time to quit */
-    wq->first = wq->last = NULL;        /* no queue entries */
-    wq->parallelism = threads;          /* max servers */
-    wq->counter = 0;                    /* no server threads yet */
-    wq->idle = 0;                       /* no idle servers */
-    wq->engine = engine;
-    wq->valid = WORKQ_VALID;
+    pthread_mutex_unlock (&park->mutex);
+    if (atomic_load (&future->state) == WORKQ_DONE)
+        return 0;
+    return status;
+}
+
+/*
+ * Wait for the function submitted with a handle to return, and
+ * collect its result. The handle may not be used again.
+ */
+int workq_future_wait (workq_future_t *handle, void **result)
+{
+    int status;
+
+    status = workq_future_park (handle, NULL);
+    if (status != 0)
+        return status;
+    if (result != NULL)
+        *result = handle->result;
+    workq_future_free (handle);
     return 0;
 }
 
 /*
- * Destroy a work queue.
+ * Like workq_future_wait, but give up at the time "abstime",
+ * measured by CLOCK_MONOTONIC (as for the timed rwlock
+ * functions), returning ETIMEDOUT. The handle can still be
+ * waited for (or polled) after a timeout.
  */
-int workq_destroy (workq_t *wq)
+int workq_future_timedwait (
+    workq_future_t *handle, const struct timespec *abstime, void **result)
 {
-    int status, status1, status2;
+    int status;
+
+    status = workq_future_park (handle, abstime);
+    if (status != 0)
+        return status;
+    if (result != NULL)
+        *result = handle->result;
+    workq_future_free (handle);
+    return 0;
+}
+
+/*
+ * Collect a future's result if it's ready, without waiting;
+ * otherwise return EBUSY (and the handle can still be used).
+ */
+int workq_future_poll (workq_future_t *handle, void **result)
+{
+    if (atomic_load (&handle->state) != WORKQ_DONE)
+        return EBUSY;
+    if (result != NULL)
+        *result = handle->result;
+    workq_future_free (handle);
+    return 0;
+}
+
+/*
+ * Put an item in the timer heap, to be queued at (monotonic) time
+ * "deadline", and then every "period" ns if that isn't 0.
+ */
+static int workq_add_timer (
+    workq_t *wq, uint64_t deadline, uint64_t period,
+    void *element, unsigned long *id)
+{
+    workq_timer_t *heap;
+    int status, size;
 
-    if (wq->valid != WORKQ_VALID)
-        return EINVAL;
     status = pthread_mutex_lock (&wq->mutex);
     if (status != 0)
         return status;
-    wq->valid = 0;                 /* prevent any other operations */
+    if (wq->timer_count == wq->timer_size) {
+        size = (wq->timer_size > 0) ? wq->timer_size * 2 : 16;
+        heap = (workq_timer_t *)realloc (
+            wq->timers, size * sizeof (workq_timer_t));
+        if (heap == NULL) {
+            pthread_mutex_unlock (&wq->mutex);
+            return ENOMEM;
+        }
+        wq->timers = heap;
+        wq->timer_size = size;
+    }
+    heap = &wq->timers[wq->timer_count++];
+    heap->deadline = deadline;
+    heap->period = period;
+    heap->data = element;
+    heap->id = ++wq->timer_id;
+    if (id != NULL)
+        *id = heap->id;
+    workq_timer_sift (wq, wq->timer_count - 1);
 
     /*
-     * Check whether any threads are active, and run them down:
-     *
-     * 1.       set the quit flag
-     * 2.       broadcast to wake any servers that may be asleep
-     * 4.       wait for all threads to quit (counter goes to 0)
-     *          Because we don't use join, we don't need to worry
-     *          about tracking thread IDs.
+     * If the new item is now the first due, whichever server is
+     * waiting for the heap is waiting too long; since we can't
+     * tell which of the idle servers that is, wake them all (and
+     * they'll sort it out). If there are no servers at all, we
+     * need one.
      */
-    if (wq->counter > 0) {
-        wq->quit = 1;
-        /* if any threads are idling, wake them. */
-        if (wq->idle > 0) {
-            status = pthread_cond_broadcast (&wq->cv);
-            if (status != 0) {
-                pthread_mutex_unlock (&wq->mutex);
-                return status;
-            }
-        }
+    if (wq->next_timer == deadline && wq->idle > 0)
+        status = pthread_cond_broadcast (&wq->cv);
+    else if (wq->counter == 0)
+        status = workq_wake (wq, 1);
+    pthread_mutex_unlock (&wq->mutex);
+    return status;
+}
 
-        /*
-         * Just to prove that every rule has an exception, I'm
-         * using the "cv" condition for two separate predicates
-         * here. That's OK, since the case used here applies
-         * only once during the life of a work queue -- during
-         * rundown. The overhead is minimal and it's not worth
-         * creating a separate condition variable that would be
-         * waited and signalled exactly once!
-         */
-        while (wq->counter > 0) {
-            status = pthread_cond_wait (&wq->cv, &wq->mutex);
-            if (status != 0) {
-                pthread_mutex_unlock (&wq->mutex);
-                return status;
-            }
-        }       
-    }
-    status = pthread_mutex_unlock (&wq->mutex);
-    if (status != 0)
-        return status;
-    status = pthread_mutex_destroy (&wq->mutex);
-    status1 = pthread_cond_destroy (&wq->cv);
-    status2 = pthread_attr_destroy (&wq->attr);
-    return (status ? status : (status1 ? status1 : status2));
+/*
+ * Add an item to a work queue, at the lowest priority, after
+ * "delay" nanoseconds.
+ */
+int workq_add_after (workq_t *wq, uint64_t delay, void *element)
+{
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    return workq_add_timer (wq, workq_now () + delay, 0, element, NULL);
 }
 
 /*
- * Add an item to a work queue.
+ * Add an item to a work queue every "period" nanoseconds
+ * (starting one period from now), until it's cancelled. If the
+ * servers fall behind, missed periods are skipped rather than
+ * queued all at once. The item's id is returned in "id".
  */
-int workq_add (workq_t *wq, void *element)
+int workq_add_periodic (
+    workq_t *wq, uint64_t period, void *element, unsigned long *id)
 {
-    workq_ele_t *item;
-    pthread_t id;
-    int status;
+    if (wq->valid != WORKQ_VALID || period == 0)
+        return EINVAL;
+    return workq_add_timer (
+        wq, workq_now () + period, period, element, id);
+}
+
+/*
+ * Cancel a periodic item. (If it has already been queued, that
+ * request still runs.) Returns ESRCH if there's no such item.
+ */
+int workq_cancel (workq_t *wq, unsigned long id)
+{
+    int status, i;
 
     if (wq->valid != WORKQ_VALID)
         return EINVAL;
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return status;
+    for (i = 0; i < wq->timer_count; i++)
+        if (wq->timers[i].id == id)
+            break;
+    if (i < wq->timer_count)
+        workq_timer_remove (wq, i);
+    else
+        status = ESRCH;
+    pthread_mutex_unlock (&wq->mutex);
+    return status;
+}
 
-    /*
-     * Create and initialize a request structure.
-     */
-    item = (workq_ele_t *)malloc (sizeof (workq_ele_t));
-    if (item == NULL)
-        return ENOMEM;
-    item->data = element;
-    item->next = NULL;
+/*
+ * Change the maximum number of server threads, up to the number
+ * of server slots. If it's raised, start servers for any backlog
+ * now; if it's lowered, busy servers exit as they finish their
+ * current requests, and idle servers as soon as they're woken.
+ * (If the work queue is autoscaling, it will go on adjusting the
+ * parallelism from this new value, within its limits.)
+ */
+int workq_set_parallelism (workq_t *wq, int threads)
+{
+    int status, backlog;
+
+    if (wq->valid != WORKQ_VALID || threads < 1 || threads > wq->slots)
+        return EINVAL;
     status = pthread_mutex_lock (&wq->mutex);
-    if (status != 0) {
-        free (item);
+    if (status != 0)
         return status;
+    if (threads > wq->parallelism) {
+        wq->parallelism = threads;
+        backlog = workq_backlog (wq);
+        if (backlog > threads - wq->counter)
+            backlog = threads - wq->counter;
+        if (backlog > 0)
+            status = workq_wake (wq, backlog);
+    } else {
+        wq->parallelism = threads;
+        if (wq->counter > threads && wq->idle > 0)
+            status = pthread_cond_broadcast (&wq->cv);
     }
+    pthread_mutex_unlock (&wq->mutex);
+    return status;
+}
 
-    /*
-     * Add the request to the end of the queue, updating the
-     * first and last pointers.
-     */
-    if (wq->first == NULL)
-        wq->first = item;
-    else
-        wq->last->next = item;
-    wq->last = item;
+/*
+ * Wait until every request queued before the call has been run.
+ * The servers go on working, and requests queued meanwhile (by
+ * the engine, or by other threads) may or may not be waited for.
+ *
+ * Requests carry the parity of the epoch in which they were
+ * queued, and the epochs from the one after "flushed" up to the
+ * current one haven't drained. There are never more than two of
+ * them, since the epoch only moves on while the one before it
+ * has drained -- so its parity is free for the new epoch. Each
+ * flush moves the epoch on (unless another flush has since done
+ * so) and then waits until the epoch that was current when it
+ * was called has drained; flushes called at the same time share
+ * the work.
+ *
+ * A server can't wait for its own request to finish, so a flush
+ * from an engine returns EDEADLK.
+ */
+int workq_flush (workq_t *wq)
+{
+    unsigned long target, next;
+    int status;
 
-    /*
-     * if any threads are idling, wake one.
-     */
-    if (wq->idle > 0) {
-        status = pthread_cond_signal (&wq->cv);
-        if (status != 0) {
-            pthread_mutex_unlock (&wq->mutex);
-            return status;
-        }
-    } else if (wq->counter < wq->parallelism) {
-        /*
-         * If there were no idling threads, and we're allowed to
-         * create a new thread, do so.
-         */
-        DPRINTF (("Creating new worker\n"));
-        status = pthread_create (
-            &id, &wq->attr, workq_server, (void*)wq);
-        if (status != 0) {
-            pthread_mutex_unlock (&wq->mutex);
-            return status;
+    if (wq->valid != WORKQ_VALID)
+        return EINVAL;
+    if (pthread_getspecific (wq->server_key) != NULL)
+        return EDEADLK;
+    status = pthread_mutex_lock (&wq->mutex);
+    if (status != 0)
+        return status;
+    wq->flushing++;
+    target = atomic_load (&wq->epoch);
+    while (wq->flushed < target) {
+        next = wq->flushed + 1;         /* oldest epoch not drained */
+        if (atomic_load (&wq->epoch) == next)
+            atomic_store (&wq->epoch, next + 1);
+        if (workq_drained (wq, next & 1)) {
+            wq->flushed = next;
+            pthread_cond_broadcast (&wq->drained);
+            continue;
         }
-        wq->counter++;
+        status = pthread_cond_wait (&wq->drained, &wq->mutex);
+        if (status != 0)
+            break;
     }
+    wq->flushing--;
     pthread_mutex_unlock (&wq->mutex);
-    return 0;
+    return status;
 }
@@ -19,8 +19,117 @@
  * processing engine until the queue is empty; at that point,
  * processing threads will begin to shut down. (They will be
  * restarted when work appears.)
+ *
+ * Items added by a server thread (that is, by an engine routine
+ * that queues more work) go onto that server's own deque, where
+ * it can take them back without locking; idle servers steal
+ * from the other end. Items added by any other thread go onto
+ * the shared queue, protected by the mutex.
+ *
+ * A work queue may optionally be "bounded", by initializing it
+ * with workq_init_attr and an attributes object that specifies a
+ * capacity. The shared queue is then a fixed-size ring of
+ * entries that producers and servers access without locking,
+ * and workq_add either waits for space or returns EAGAIN when
+ * the ring is full.
+ *
+ * An attributes object may also specify a "batch engine", which
+ * is called with an array of up to a specified number of
+ * requests at a time, instead of the engine routine (which is
+ * called with one request at a time). Servers then remove up to
+ * that many requests from the shared queue each time they lock
+ * the mutex.
+ *
+ * The attributes object also controls the life cycle of server
+ * threads: how many are created by workq_init_attr, how many
+ * stay resident when there's no work, how long the others wait
+ * for work before exiting, and how many times a server checks
+ * for new work before it waits at all.
+ *
+ * Requests may be queued at one of WORKQ_PRIORITIES priorities
+ * with workq_add_prio (workq_add uses the lowest, 0). Each
+ * priority has its own "lane" of the shared queue. Servers take
+ * requests from the highest priority lane that has any (the
+ * default, WORKQ_STRICT), or share out their attention among the
+ * lanes in proportion to weights given in the attributes object
+ * (WORKQ_WEIGHTED), so that low priority work isn't starved.
+ * Requests above the lowest priority always go to the shared
+ * queue, and servers look there before their own deques when
+ * any are waiting. The time each request spends queued is
+ * recorded by priority, and can be read with workq_delay.
+ *
+ * Requests added with workq_add_keyed are run one at a time, in
+ * the order they were added, for each key; requests with
+ * different keys run in parallel. A key's requests take turns
+ * with other keys (and with unkeyed requests), so a busy key
+ * doesn't hold up the rest. Keyed requests aren't counted
+ * against the capacity of a bounded queue.
+ *
+ * workq_stats takes a snapshot of the work queue's statistics:
+ * the number of server threads (and how many have been created
+ * and have exited), how many requests are queued, and histograms
+ * of how long requests wait to be started and how long the
+ * engine takes to run them. Servers keep their own statistics,
+ * which are added up only when a snapshot is taken, so keeping
+ * them costs little more than reading the clock.
+ *
+ * workq_submit queues a call of a function (rather than of the
+ * engine), and returns a "future" handle with which the caller
+ * can wait for, or check on, the function's result. Handles are
+ * recycled by the work queue, and waiting threads sleep on one
+ * of a fixed set of condition variables shared by all handles,
+ * so a request costs no mutex or condition variable of its own.
+ * A handle may be waited for (or polled) by only one thread, and
+ * is returned to the work queue when its result is collected.
+ * The deadline for workq_future_timedwait is an absolute time
+ * measured by CLOCK_MONOTONIC.
+ *
+ * workq_add_after queues an item for the engine after a delay,
+ * and workq_add_periodic queues one repeatedly, at a fixed
+ * interval, until it's cancelled with workq_cancel. The pending
+ * items are kept in a heap ordered by deadline; one idle server
+ * waits until the earliest deadline (rather than for its idle
+ * timeout), and busy servers check it as they look for work. A
+ * server stays resident as long as any are pending. Delays are
+ * measured by CLOCK_MONOTONIC, in nanoseconds, and pending items
+ * are discarded by workq_destroy.
+ *
+ * The maximum number of server threads ("parallelism") can be
+ * changed with workq_set_parallelism, up to the number of server
+ * slots set aside by workq_init_attr (the larger of its "threads"
+ * argument and the maxthreads attribute). When it's lowered,
+ * extra servers exit as they finish what they're doing. An
+ * attributes object may instead ask for the work queue to adjust
+ * its own parallelism, within limits, according to how many
+ * requests are waiting and how long they've waited.
+ *
+ * workq_flush waits until every request queued before the call
+ * has been run, without stopping the servers. (A delayed item
+ * counts once it's due.) Each request is counted in one of two
+ * "epochs"; a flush starts a new epoch for later requests, and
+ * waits for the count of the old one to drain to zero.
+ *
+ * On Linux, servers can be bound to processors: packed onto as
+ * few NUMA nodes as possible (WORKQ_PLACE_COMPACT), spread
+ * across the nodes (WORKQ_PLACE_SCATTER), or bound to a list of
+ * processors (workq_attr_setcpus). When the servers span more
+ * than one node, each node has its own queue for requests of the
+ * lowest priority, and a request goes on the queue of the node
+ * where it's added; the servers on that node look there first,
+ * and take from other nodes' queues (or steal) only when they
+ * run out of work. (A bounded work queue keeps using its ring.)
  */
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define WORKQ_PRIORITIES        4       /* priorities are 0 (lowest) to 3 */
+
+/*
+ * Handle for the result of a request queued by workq_submit.
+ */
+typedef struct workq_future_tag workq_future_t;
 
 /*
  * Structure to keep track of work queue requests.
@@ -28,22 +137,143 @@
 typedef struct workq_ele_tag {
     struct workq_ele_tag        *next;
     void                        *data;
+    int                         prio;   /* priority lane */
+    int                         epoch;  /* flush epoch (0 or 1) */
+    uint64_t                    stamp;  /* time queued (ns) */
+    workq_future_t              *future; /* submitted call, or NULL */
 } workq_ele_t;
 
+/*
+ * Attributes object, used to specify optional behavior when a
+ * work queue is initialized.
+ */
+typedef struct workq_attr_tag {
+    int                 capacity;       /* ring size (0 if unbounded) */
+    int                 full;           /* WORKQ_FULL_* policy */
+    int                 batch;          /* max requests per batch */
+    void                (*batch_engine)(void **items, int count);
+    int                 minthreads;     /* servers kept when idle */
+    int                 prestart;       /* servers created by init */
+    int                 spin;           /* checks for work before waiting */
+    struct timespec     timeout;        /* idle time before exit */
+    int                 policy;         /* WORKQ_STRICT or WORKQ_WEIGHTED */
+    int                 weight[WORKQ_PRIORITIES]; /* shares if weighted */
+    int                 maxthreads;     /* server slots */
+    int                 scale_min;      /* autoscaling limits... */
+    int                 scale_max;
+    uint64_t            scale_interval; /* ... how often (0 if off) */
+    uint64_t            scale_target;   /* ... acceptable wait */
+    int                 placement;      /* WORKQ_PLACE_* policy */
+    int                 *cpus;          /* ... processors to use */
+    int                 cpu_count;
+} workq_attr_t;
+
+/*
+ * What workq_add does when a bounded queue is full.
+ */
+#define WORKQ_FULL_BLOCK        0       /* wait for space */
+#define WORKQ_FULL_EAGAIN       1       /* return EAGAIN */
+
+/*
+ * How servers choose among priority lanes.
+ */
+#define WORKQ_STRICT            0       /* highest priority first */
+#define WORKQ_WEIGHTED          1       /* in proportion to weights */
+
+/*
+ * Server placement policies.
+ */
+#define WORKQ_PLACE_NONE        0       /* servers aren't bound */
+#define WORKQ_PLACE_COMPACT     1       /* fill one node, then the next */
+#define WORKQ_PLACE_SCATTER     2       /* round robin across nodes */
+#define WORKQ_PLACE_CPUS        3       /* the processors listed */
+
+/*
+ * A histogram of times, in nanoseconds. Bucket 0 counts times
+ * less than 2ns, and bucket i (for i > 0) counts times from 2^i
+ * up to 2^(i+1) ns; the last bucket also counts anything longer.
+ */
+#define WORKQ_BUCKETS           40
+
+typedef struct workq_hist_tag {
+    uint64_t            count;          /* number of samples */
+    uint64_t            sum;            /* total of all samples */
+    uint64_t            max;            /* longest sample */
+    uint64_t            bucket[WORKQ_BUCKETS];
+} workq_hist_t;
+
+/*
+ * A snapshot of a work queue's statistics, from workq_stats.
+ */
+typedef struct workq_stats_tag {
+    int                 threads;        /* server threads running */
+    int                 parallelism;    /* ... allowed */
+    int                 idle;           /* ... waiting for work */
+    uint64_t            created;        /* server threads created */
+    uint64_t            exited;         /* ... that timed out */
+    uint64_t            queued[WORKQ_PRIORITIES]; /* by priority */
+    uint64_t            keyed;          /* keyed requests queued */
+    uint64_t            delayed;        /* delayed items pending */
+    uint64_t            steals;         /* taken from another server */
+    uint64_t            remote;         /* ... from another node's queue */
+    workq_hist_t        wait;           /* from add to start, in ns */
+    workq_hist_t        service;        /* engine calls, in ns */
+} workq_stats_t;
+
 /*
  * Structure describing a work queue.
  */
 typedef struct workq_tag {
     pthread_mutex_t     mutex;
     pthread_cond_t      cv;             /* wait for work */
+    pthread_cond_t      space;          /* wait for space in ring */
+    pthread_cond_t      drained;        /* wait for flush */
     pthread_attr_t      attr;           /* create detached threads */
-    workq_ele_t         *first, *last;  /* work queue */
+    pthread_key_t       server_key;     /* identify server threads */
+    pthread_key_t       magazine_key;   /* per-thread entry cache */
+    struct workq_magazine_tag *magazines; /* all producer caches */
+    _Atomic (workq_ele_t *) returned;   /* entries freed by servers */
+    struct workq_lane_tag *lanes;       /* work queue, by priority */
+    int                 capacity;       /* ring size (0 if unbounded) */
+    int                 policy;         /* WORKQ_STRICT or WORKQ_WEIGHTED */
+    struct workq_server_tag *servers;   /* per-server deques */
     int                 valid;          /* set when valid */
-    int                 quit;           /* set when workq should quit */
-    int                 parallelism;    /* number of threads required */
-    int                 counter;        /* current number of threads */
-    int                 idle;           /* number of idle threads */
+    atomic_int          quit;           /* set when workq should quit */
+    atomic_int          parallelism;    /* number of threads allowed */
+    int                 slots;          /* ... at most */
+    struct workq_scale_tag *scale;      /* autoscaling, if any */
+    atomic_int          counter;        /* current number of threads */
+    atomic_int          idle;           /* number of idle threads */
+    int                 wakeups;        /* idle threads signalled */
+    uint64_t            created;        /* servers created */
+    uint64_t            exited;         /* servers timed out */
+    int                 minthreads;     /* servers kept when idle */
+    int                 spin;           /* checks for work before waiting */
+    struct timespec     timeout;        /* idle time before exit */
+    atomic_int          queued;         /* requests on shared queue */
+    atomic_int          urgent;         /* ... above lowest priority */
+    struct workq_keys_tag *keys;        /* keyed requests */
+    atomic_int          runnable;       /* keys with requests to run */
+    struct workq_pool_tag *futures;     /* free future handles */
+    struct workq_timer_tag *timers;     /* heap of delayed items */
+    atomic_int          timer_count;    /* items in the heap */
+    int                 timer_size;     /* ... room for */
+    unsigned long       timer_id;       /* last periodic item's id */
+    atomic_ullong       next_timer;     /* earliest deadline */
+    int                 keeper;         /* a server waits for it */
+    struct workq_node_tag *nodes;       /* per-node queues, or NULL */
+    int                 node_count;
+    int                 *cpu_node;      /* node of each processor */
+    int                 cpu_max;        /* ... (size of cpu_node) */
+    atomic_ulong        epoch;          /* current flush epoch */
+    unsigned long       flushed;        /* last epoch drained */
+    atomic_long         counted[2];     /* requests, by epoch parity */
+    atomic_int          flushing;       /* threads in workq_flush */
+    int                 full;           /* WORKQ_FULL_* policy */
+    atomic_int          blocked;        /* producers waiting for space */
+    int                 batch;          /* max requests per engine call */
     void                (*engine)(void *arg);   /* user engine */
+    void                (*batch_engine)(void **items, int count);
 } workq_t;
 
 #define WORKQ_VALID     0xdec1992
@@ -51,9 +281,72 @@ typedef struct workq_tag {
 /*
  * Define work queue functions
  */
+extern int workq_attr_init (workq_attr_t *attr);
+extern int workq_attr_destroy (workq_attr_t *attr);
+extern int workq_attr_setcapacity (workq_attr_t *attr, int capacity);
+extern int workq_attr_setfull (workq_attr_t *attr, int full);
+extern int workq_attr_setbatch (
+    workq_attr_t *attr,
+    void        (*engine)(void **items, int count),
+    int         max);                   /* max requests per call */
+extern int workq_attr_setminthreads (workq_attr_t *attr, int minthreads);
+extern int workq_attr_setprestart (workq_attr_t *attr, int prestart);
+extern int workq_attr_setspin (workq_attr_t *attr, int spin);
+extern int workq_attr_settimeout (
+    workq_attr_t *attr, const struct timespec *timeout);
+extern int workq_attr_setpolicy (workq_attr_t *attr, int policy);
+extern int workq_attr_setweight (workq_attr_t *attr, int prio, int weight);
+extern int workq_attr_setmaxthreads (workq_attr_t *attr, int maxthreads);
+extern int workq_attr_setautoscale (
+    workq_attr_t *attr,
+    int         min,                    /* fewest threads allowed */
+    int         max,                    /* most threads allowed */
+    uint64_t    interval,               /* ns between adjustments */
+    uint64_t    target);                /* ns requests may wait */
+extern int workq_attr_setplacement (workq_attr_t *attr, int placement);
+extern int workq_attr_setcpus (
+    workq_attr_t *attr, const int *cpus, int count);
 extern int workq_init (
     workq_t     *wq,
     int         threads,                /* maximum threads */
     void        (*engine)(void *));     /* engine routine */
+extern int workq_init_attr (
+    workq_t     *wq,
+    workq_attr_t *attr,                 /* optional attributes */
+    int         threads,                /* maximum threads */
+    void        (*engine)(void *));     /* engine routine */
 extern int workq_destroy (workq_t *wq);
 extern int workq_add (workq_t *wq, void *data);
+extern int workq_add_prio (workq_t *wq, int prio, void *data);
+extern int workq_add_batch (workq_t *wq, void **items, int count);
+extern int workq_add_keyed (workq_t *wq, unsigned long key, void *data);
+extern int workq_delay (workq_t *wq, int prio, workq_hist_t *hist);
+extern uint64_t workq_hist_percentile (const workq_hist_t *hist, double pct);
+extern int workq_stats (workq_t *wq, workq_stats_t *stats);
+extern int workq_submit (
+    workq_t     *wq,
+    void        *(*fn)(void *),         /* function to call */
+    void        *arg,                   /* ... and its argument */
+    workq_future_t **handle);           /* returns result handle */
+extern int workq_future_wait (workq_future_t *handle, void **result);
+extern int workq_future_timedwait (
+    workq_future_t *handle, const struct timespec *abstime, void **result);
+extern int workq_future_poll (workq_future_t *handle, void **result);
+extern int workq_add_after (workq_t *wq, uint64_t delay, void *data);
+extern int workq_add_periodic (
+    workq_t     *wq,
+    uint64_t    period,                 /* interval, in ns */
+    void        *data,
+    unsigned long *id);                 /* returns id for cancel */
+extern int workq_cancel (workq_t *wq, unsigned long id);
+extern int workq_set_parallelism (workq_t *wq, int threads);
+extern int workq_flush (workq_t *wq);
+
+/*
+ * If set before workq_init_attr, called (on Linux) instead of
+ * reading the processors' NUMA nodes from sysfs: it stores the
+ * node of each of CPU_SETSIZE processors in "cpu_node" (-1 for
+ * one the servers mustn't use), and returns the number of nodes.
+ * This lets a test fake a machine with several nodes.
+ */
+extern int (*workq_topology_hook) (int *cpu_node);
@@ -0,0 +1,384 @@
+/*
+ * workq_bench.c
+ *
+ * Measure the throughput and latency of the work queue package.
+ * Each run starts a set of producer threads, which add a fixed
+ * number of items (singly, or in batches with workq_add_batch)
+ * as fast as they can, to a work queue whose engine spins for a
+ * given time on each item. The program sweeps every combination
+ * of the lists of producer counts, worker counts, item costs and
+ * batch sizes given on the command line, and writes one line of
+ * comma-separated values for each run:
+ *
+ *      producers,workers,cost_ns,batch,capacity,spin,items,
+ *      seconds,items_per_sec,enq_p50_ns,enq_p99_ns,
+ *      e2e_p50_ns,e2e_p99_ns,e2e_p999_ns
+ *
+ * "enq" is the time a producer spends in workq_add (or in
+ * workq_add_batch, divided among the batch); "e2e" is the time
+ * from just before an item is added until its engine call
+ * returns. The clock stops when the engines have counted every
+ * item done (under a mutex, and signalling a condition variable
+ * for the last one).
+ *
+ * Compiled with -DWORKQ_BASELINE, the program uses only
+ * workq_init, workq_add and workq_destroy, so that it can be built
+ * against the original work queue package (which has neither
+ * attributes nor batches) and the results compared line by line;
+ * it then accepts only a batch size of 1, and no capacity or spin.
+ *
+ * Usage: workq_bench [-p producers] [-w workers] [-c cost_ns]
+ *          [-b batch] [-n items] [-q capacity] [-s spin] [-H]
+ *
+ * where producers, workers, cost_ns and batch are comma-separated
+ * lists, capacity and spin are work queue attributes, and -H
+ * omits the header line (to append to earlier results).
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "barrier.h"
+#include "workq.h"
+#include "errors.h"
+
+#define MAX_LIST        16
+
+typedef struct item_tag {
+    uint64_t    stamp;                  /* time added */
+    long        id;                     /* index into latency array */
+} item_t;
+
+typedef struct producer_tag {
+    pthread_t   thread_id;
+    long        first, count;           /* items to add */
+    uint64_t    *enqueue;               /* latency of each add */
+    long        calls;
+} producer_t;
+
+item_t *items;
+uint64_t *latency;                      /* end-to-end, by item */
+uint64_t cost;                          /* engine time per item */
+int batch;
+barrier_t start;
+workq_t workq;
+pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+long done_count;                        /* items the engines ran */
+long done_target;                       /* ... of this many */
+
+/*
+ * Return the time, in nanoseconds, measured by CLOCK_MONOTONIC.
+ */
+uint64_t bench_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * The engine spins for "cost" nanoseconds (standing in for real
+ * work, without giving up the processor) and then records how
+ * long the item took from start to finish.
+ */
+void engine_routine (void *arg)
+{
+    item_t *item = (item_t*)arg;
+    uint64_t begin;
+    int status;
+
+    begin = bench_now ();
+    while (cost > 0 && bench_now () - begin < cost)
+        ;
+    latency[item->id] = bench_now () - item->stamp;
+    status = pthread_mutex_lock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (++done_count == done_target) {
+        status = pthread_cond_signal (&done_cond);
+        if (status != 0)
+            err_abort (status, "Signal condition");
+    }
+    status = pthread_mutex_unlock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Thread start routine that adds a producer's share of the
+ * items, "batch" at a time.
+ */
+void *producer_routine (void *arg)
+{
+    producer_t *producer = (producer_t*)arg;
+    void *chunk[1024];
+    uint64_t begin, end;
+    long done, i;
+    int count, status;
+
+    barrier_wait (&start);
+    for (done = 0; done < producer->count; done += count) {
+        count = batch;
+        if (count > producer->count - done)
+            count = producer->count - done;
+        begin = bench_now ();
+        for (i = 0; i < count; i++) {
+            items[producer->first + done + i].stamp = begin;
+            chunk[i] = &items[producer->first + done + i];
+        }
+#ifdef WORKQ_BASELINE
+        status = workq_add (&workq, chunk[0]);
+#else
+        if (batch == 1)
+            status = workq_add (&workq, chunk[0]);
+        else
+            status = workq_add_batch (&workq, chunk, count);
+#endif
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+        end = bench_now ();
+        producer->enqueue[producer->calls++] = (end - begin) / count;
+    }
+    return NULL;
+}
+
+/*
+ * Compare function for qsort.
+ */
+int compare (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the "pct" percentile of a sorted array.
+ */
+uint64_t percentile (uint64_t *sorted, long count, double pct)
+{
+    long index = (long)(pct / 100.0 * count + 0.999999) - 1;
+
+    if (count == 0)
+        return 0;
+    if (index < 0)
+        index = 0;
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+/*
+ * Parse a comma-separated list of positive integers (or of
+ * non-negative ones, if "zero" is set).
+ */
+int parse_list (char *arg, long *list, int zero)
+{
+    char *end;
+    int count = 0;
+
+    while (count < MAX_LIST) {
+        list[count] = strtol (arg, &end, 10);
+        if (end == arg || list[count] < (zero ? 0 : 1)) {
+            fprintf (stderr, "Bad list \"%s\"\n", arg);
+            exit (1);
+        }
+        count++;
+        if (*end != ',')
+            break;
+        arg = end + 1;
+    }
+    return count;
+}
+
+/*
+ * Run the benchmark once, and write a line of results.
+ */
+void run (
+    int producers, int workers, long item_count, int capacity, int spin)
+{
+#ifndef WORKQ_BASELINE
+    workq_attr_t attr;
+#endif
+    producer_t *producer;
+    uint64_t *enqueue, begin, end;
+    long calls = 0, i;
+    int status, p;
+
+    done_count = 0;
+    done_target = item_count;
+#ifdef WORKQ_BASELINE
+    status = workq_init (&workq, workers, engine_routine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+#else
+    workq_attr_init (&attr);
+    workq_attr_setspin (&attr, spin);
+    workq_attr_setprestart (&attr, workers);
+    if (capacity > 0)
+        workq_attr_setcapacity (&attr, capacity);
+    status = workq_init_attr (&workq, &attr, workers, engine_routine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+#endif
+    status = barrier_init (&start, producers + 1);
+    if (status != 0)
+        err_abort (status, "Init barrier");
+
+    producer = (producer_t*)calloc (producers, sizeof (producer_t));
+    enqueue = (uint64_t*)malloc (item_count * sizeof (uint64_t));
+    if (producer == NULL || enqueue == NULL)
+        errno_abort ("Allocate producers");
+    for (p = 0; p < producers; p++) {
+        producer[p].first = item_count * p / producers;
+        producer[p].count =
+            item_count * (p + 1) / producers - producer[p].first;
+        producer[p].enqueue = enqueue + producer[p].first;
+        status = pthread_create (
+            &producer[p].thread_id, NULL,
+            producer_routine, (void*)&producer[p]);
+        if (status != 0)
+            err_abort (status, "Create producer");
+    }
+
+    /*
+     * Release the producers together, and stop the clock when
+     * every item they added has been run.
+     */
+    barrier_wait (&start);
+    begin = bench_now ();
+    for (p = 0; p < producers; p++) {
+        status = pthread_join (producer[p].thread_id, NULL);
+        if (status != 0)
+            err_abort (status, "Join producer");
+    }
+    status = pthread_mutex_lock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    while (done_count < done_target) {
+        status = pthread_cond_wait (&done_cond, &done_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on condition");
+    }
+    status = pthread_mutex_unlock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    end = bench_now ();
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    barrier_destroy (&start);
+
+    /*
+     * Pack the producers' enqueue times together (each has room
+     * for one per item, but a batch records only one).
+     */
+    for (p = 0; p < producers; p++)
+        for (i = 0; i < producer[p].calls; i++)
+            enqueue[calls++] = producer[p].enqueue[i];
+    qsort (enqueue, calls, sizeof (uint64_t), compare);
+    qsort (latency, item_count, sizeof (uint64_t), compare);
+    printf ("%d,%d,%lu,%d,%d,%d,%ld,%.6f,%.0f,%lu,%lu,%lu,%lu,%lu\n",
+        producers, workers, (unsigned long)cost, batch, capacity, spin,
+        item_count, (end - begin) / 1e9,
+        item_count / ((end - begin) / 1e9),
+        (unsigned long)percentile (enqueue, calls, 50.0),
+        (unsigned long)percentile (enqueue, calls, 99.0),
+        (unsigned long)percentile (latency, item_count, 50.0),
+        (unsigned long)percentile (latency, item_count, 99.0),
+        (unsigned long)percentile (latency, item_count, 99.9));
+    fflush (stdout);
+    free (enqueue);
+    free (producer);
+}
+
+int main (int argc, char *argv[])
+{
+    long producers[MAX_LIST] = {1}, workers[MAX_LIST] = {4};
+    long costs[MAX_LIST] = {0}, batches[MAX_LIST] = {1};
+    int nproducers = 1, nworkers = 1, ncosts = 1, nbatches = 1;
+    long item_count = 100000;
+    int capacity = 0, spin = 0, header = 1;
+    int p, w, c, b, option;
+    long i;
+
+    while ((option = getopt (argc, argv, "p:w:c:b:n:q:s:H")) != -1) {
+        switch (option) {
+        case 'p':
+            nproducers = parse_list (optarg, producers, 0);
+            break;
+        case 'w':
+            nworkers = parse_list (optarg, workers, 0);
+            break;
+        case 'c':
+            ncosts = parse_list (optarg, costs, 1);
+            break;
+        case 'b':
+            nbatches = parse_list (optarg, batches, 0);
+            break;
+        case 'n':
+            item_count = atol (optarg);
+            break;
+        case 'q':
+            capacity = atoi (optarg);
+            break;
+        case 's':
+            spin = atoi (optarg);
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            fprintf (stderr,
+                "Usage: %s [-p producers] [-w workers] [-c cost_ns]"
+                " [-b batch] [-n items] [-q capacity] [-s spin] [-H]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    for (b = 0; b < nbatches; b++) {
+        if (batches[b] > 1024) {
+            fprintf (stderr, "Batch size is at most 1024\n");
+            return 1;
+        }
+    }
+#ifdef WORKQ_BASELINE
+    if (nbatches > 1 || batches[0] != 1 || capacity != 0 || spin != 0) {
+        fprintf (stderr,
+            "Only batch 1, without capacity or spin, in this build\n");
+        return 1;
+    }
+#endif
+    if (item_count < 1) {
+        fprintf (stderr, "Item count must be positive\n");
+        return 1;
+    }
+
+    items = (item_t*)malloc (item_count * sizeof (item_t));
+    latency = (uint64_t*)malloc (item_count * sizeof (uint64_t));
+    if (items == NULL || latency == NULL)
+        errno_abort ("Allocate items");
+    for (i = 0; i < item_count; i++)
+        items[i].id = i;
+
+    if (header)
+        printf ("producers,workers,cost_ns,batch,capacity,spin,items,"
+            "seconds,items_per_sec,enq_p50_ns,enq_p99_ns,"
+            "e2e_p50_ns,e2e_p99_ns,e2e_p999_ns\n");
+    for (p = 0; p < nproducers; p++)
+        for (w = 0; w < nworkers; w++)
+            for (c = 0; c < ncosts; c++)
+                for (b = 0; b < nbatches; b++) {
+                    cost = costs[c];
+                    batch = batches[b];
+                    run (producers[p], workers[w],
+                        item_count, capacity, spin);
+                }
+    free (items);
+    free (latency);
+    return 0;
+}
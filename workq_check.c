@@ -0,0 +1,1867 @@
+/*
+ * workq_check.c
+ *
+ * Check the behavior of the work queue package, one case for each
+ * of its features. Each case sets up a work queue of its own, runs
+ * some requests through it, prints what it measured, and then
+ * "ok", or "FAILED" and why. Cases that wait for requests give up
+ * after a few seconds, so that a lost request fails the case
+ * rather than hanging the program.
+ *
+ * The cases are:
+ *
+ *      latency     Bursts of requests, with gaps long enough for
+ *                  the servers to go idle between them: every
+ *                  request should start within 100ms of being
+ *                  added (rather than waiting for an idle server
+ *                  to time out). Reports the 50th and 99th
+ *                  percentile and the longest time from
+ *                  workq_add to the engine.
+ *
+ *      steal       An engine that adds two more requests for each
+ *                  one it runs, down to a fixed depth. They go on
+ *                  the adding server's own deque, so the work
+ *                  spreads only by servers stealing from each
+ *                  other: every request should run exactly once,
+ *                  and more than one server should run some.
+ *                  Reports how many servers ran requests.
+ *
+ *      ring        A bounded work queue whose one server is held
+ *                  up: with WORKQ_FULL_EAGAIN, workq_add should
+ *                  fail with EAGAIN once the ring is full (and not
+ *                  before); with WORKQ_FULL_BLOCK, a producer
+ *                  adding far more than the capacity should be held
+ *                  up once the ring is full, and finish once the
+ *                  servers are let go.
+ *
+ *      magazines   Rounds of requests added and run, with 1 server
+ *                  and then 4: once the work queue has as many
+ *                  entries as a round can need, the rounds should
+ *                  make no calls to malloc or free at all. (A
+ *                  round needs its own requests' entries, plus
+ *                  whatever the servers' partly filled magazines
+ *                  hold; a warm-up that holds up the servers while
+ *                  that many are added makes sure the work queue
+ *                  allocates them.) Reports the heap calls made
+ *                  while warming up, and after.
+ *                  (Calls are counted only with glibc, which lets
+ *                  a program replace malloc and free with versions
+ *                  that call its own; elsewhere the case is
+ *                  skipped.)
+ *
+ *      batch       The same requests added one at a time with
+ *                  workq_add, and then in batches of 256 with
+ *                  workq_add_batch: each request should run
+ *                  exactly once. Reports the time spent adding,
+ *                  per request, each way.
+ *
+ *      engine      A batch engine taking up to 32 requests a call:
+ *                  each request should run exactly once, and no
+ *                  call should have more than 32. Reports the
+ *                  number of calls, and how many requests they
+ *                  took on average.
+ *
+ *      idle        A work queue that prestarts 4 servers, keeps 2
+ *                  resident, and lets the others exit after 50ms
+ *                  idle: all 4 should exist before any request is
+ *                  added, and 2 should be left after a burst of
+ *                  requests and a pause. Reports the time the
+ *                  first request of the burst waited to start.
+ *
+ *      prio        A backlog of bulk requests at priority 0, with
+ *                  requests at priority 3 added one a millisecond
+ *                  while it drains: the 99th percentile wait of the
+ *                  priority 3 requests (from workq_delay) should be
+ *                  less than the median wait of the bulk requests.
+ *                  Reports both percentiles at both priorities.
+ *
+ *      keyed       Requests for 8 keys, added with workq_add_keyed:
+ *                  each key's requests should run one at a time,
+ *                  in the order they were added. Then one key's
+ *                  first request is held up at the gate: the other
+ *                  keys' requests should all run meanwhile.
+ *
+ *      stats       Requests held up at the gate by 2 servers, and
+ *                  then let go: workq_stats should count the 2
+ *                  servers busy and the rest queued, and then
+ *                  every request once in its wait and service
+ *                  histograms, with a mean service time at least
+ *                  as long as the engine's 20us of work. Reports
+ *                  the snapshots.
+ *
+ *      future      Calls submitted with workq_submit, and their
+ *                  results collected with workq_future_wait, one
+ *                  at a time and 1000 at once: every result should
+ *                  be right. A call held up at the gate should make
+ *                  workq_future_timedwait time out and
+ *                  workq_future_poll return EBUSY, and still give
+ *                  its result when it's let go. Reports the time
+ *                  per call, and (with glibc) the heap calls made
+ *                  by calls after the first 100.
+ *
+ *      timer       Requests added with workq_add_after, with delays
+ *                  of 10 to 50ms: none should run early, or more
+ *                  than 20ms late, and 100 pending at once should
+ *                  need no more than the 2 servers allowed. A
+ *                  request added with workq_add_periodic every 10ms
+ *                  should run 8 to 11 times in 105ms, and not again
+ *                  once it's cancelled. Reports how late each
+ *                  delayed request was.
+ *
+ *      scale       A work queue with 1 server and 8 slots, raised
+ *                  to 4 with workq_set_parallelism while 8
+ *                  requests are held up, should start 4 servers;
+ *                  lowered to 2, it should keep no more than 2
+ *                  once they finish. An autoscaling work queue
+ *                  should raise its parallelism above 1 under a
+ *                  backlog. Reports how far it rose, and where it
+ *                  stood after a trickle of requests.
+ *
+ *      flush       Ten rounds of 1000 requests, added at every
+ *                  priority, with keys, and in batches, each
+ *                  followed by workq_flush on the same work queue:
+ *                  every request of the round should have run by
+ *                  the time the flush returns. Reports how long
+ *                  the flushes took.
+ *
+ *      placement   On Linux, servers bound with workq_attr_setcpus
+ *                  to one of the processors this process may use
+ *                  should run every request there. Then, with the
+ *                  allowed processors split into two nodes through
+ *                  workq_topology_hook, 2 servers held up at the
+ *                  gate should be on the first two processors of
+ *                  the first node with WORKQ_PLACE_COMPACT, and on
+ *                  the first of each node with WORKQ_PLACE_SCATTER
+ *                  (skipped if only one processor is allowed).
+ *                  Finally, with a second node faked from a
+ *                  processor that isn't allowed, a request added
+ *                  from the first node while its server is held
+ *                  up should be taken by the other node's server
+ *                  from the first node's queue (counted by
+ *                  workq_stats as "remote"). Elsewhere, binding
+ *                  should fail with ENOSYS, and the case is
+ *                  skipped.
+ *
+ * Usage: workq_check [case ...]
+ *
+ * With no arguments, every case is run. A case that fails may leave
+ * its work queue running, so the program stops there, with an exit
+ * status of 1.
+ */
+#ifdef __linux__
+# define _GNU_SOURCE                    /* for sched_getcpu */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "workq.h"
+#include "errors.h"
+
+#define WAIT_SECONDS    10              /* longest wait for requests */
+#define MAGAZINE        64              /* WORKQ_MAGAZINE, in workq.c */
+
+/*
+ * A request, with the time it was added, and what the engine
+ * found.
+ */
+typedef struct request_tag {
+    uint64_t    stamp;                  /* time added (ns) */
+    uint64_t    latency;                /* ... until the engine ran */
+} request_t;
+
+/*
+ * One case: "run" returns 0 if the case passed.
+ */
+typedef struct check_tag {
+    const char  *name;
+    int         (*run) (void);
+} check_t;
+
+const char *current;                    /* name of running case */
+workq_t workq;                          /* work queue of the case */
+pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t done_cond;               /* uses CLOCK_MONOTONIC */
+long done_count;                        /* requests finished */
+pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+int gate_closed;                        /* engines must wait */
+
+#ifdef __GLIBC__
+/*
+ * Count calls to malloc and free, passing them on to glibc's own.
+ */
+extern void *__libc_malloc (size_t size);
+extern void __libc_free (void *ptr);
+atomic_long heap_calls;
+
+void *malloc (size_t size)
+{
+    atomic_fetch_add_explicit (&heap_calls, 1, memory_order_relaxed);
+    return __libc_malloc (size);
+}
+
+void free (void *ptr)
+{
+    if (ptr != NULL)
+        atomic_fetch_add_explicit (&heap_calls, 1, memory_order_relaxed);
+    __libc_free (ptr);
+}
+#endif
+
+/*
+ * Return the time, in nanoseconds, measured by CLOCK_MONOTONIC.
+ */
+uint64_t now_ns (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Spin for "ns" nanoseconds, standing in for real work.
+ */
+void spin_ns (uint64_t ns)
+{
+    uint64_t begin = now_ns ();
+
+    while (now_ns () - begin < ns)
+        ;
+}
+
+/*
+ * Sleep for "ms" milliseconds.
+ */
+void sleep_ms (long ms)
+{
+    struct timespec delay;
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep (&delay, NULL);
+}
+
+/*
+ * Print a line of results, labelled with the name of the case.
+ */
+void report (const char *format, ...)
+{
+    va_list ap;
+
+    printf ("%s: ", current);
+    va_start (ap, format);
+    vprintf (format, ap);
+    va_end (ap);
+    printf ("\n");
+}
+
+/*
+ * Report why a case failed, and return 1 (for the case to
+ * return).
+ */
+int fail (const char *format, ...)
+{
+    va_list ap;
+
+    printf ("%s: FAILED: ", current);
+    va_start (ap, format);
+    vprintf (format, ap);
+    va_end (ap);
+    printf ("\n");
+    return 1;
+}
+
+/*
+ * Count "count" requests finished (called by engines).
+ */
+void done_many (long count)
+{
+    int status;
+
+    status = pthread_mutex_lock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Lock done mutex");
+    done_count += count;
+    status = pthread_cond_broadcast (&done_cond);
+    if (status != 0)
+        err_abort (status, "Broadcast done");
+    status = pthread_mutex_unlock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock done mutex");
+}
+
+/*
+ * Count one request finished.
+ */
+void done_one (void)
+{
+    done_many (1);
+}
+
+/*
+ * Return the number of requests finished so far.
+ */
+long done_get (void)
+{
+    long count;
+    int status;
+
+    status = pthread_mutex_lock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Lock done mutex");
+    count = done_count;
+    status = pthread_mutex_unlock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock done mutex");
+    return count;
+}
+
+/*
+ * Wait until "count" requests have finished, for at most
+ * "seconds"; return ETIMEDOUT if they haven't.
+ */
+int done_wait (long count, int seconds)
+{
+    struct timespec deadline;
+    int status, result = 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += seconds;
+    status = pthread_mutex_lock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Lock done mutex");
+    while (done_count < count && result == 0) {
+        result = pthread_cond_timedwait (&done_cond, &done_mutex, &deadline);
+        if (result != 0 && result != ETIMEDOUT)
+            err_abort (result, "Wait for done");
+    }
+    if (done_count >= count)
+        result = 0;
+    status = pthread_mutex_unlock (&done_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock done mutex");
+    return result;
+}
+
+/*
+ * Close or open the "gate", which holds up engines that pass it
+ * while it's closed.
+ */
+void gate_set (int closed)
+{
+    int status;
+
+    status = pthread_mutex_lock (&gate_mutex);
+    if (status != 0)
+        err_abort (status, "Lock gate mutex");
+    gate_closed = closed;
+    status = pthread_cond_broadcast (&gate_cond);
+    if (status != 0)
+        err_abort (status, "Broadcast gate");
+    status = pthread_mutex_unlock (&gate_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock gate mutex");
+}
+
+/*
+ * Wait until the gate is open.
+ */
+void gate_pass (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&gate_mutex);
+    if (status != 0)
+        err_abort (status, "Lock gate mutex");
+    while (gate_closed) {
+        status = pthread_cond_wait (&gate_cond, &gate_mutex);
+        if (status != 0)
+            err_abort (status, "Wait for gate");
+    }
+    status = pthread_mutex_unlock (&gate_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock gate mutex");
+}
+
+/*
+ * Compare function for qsort.
+ */
+int compare (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the "pct" percentile of a sorted array.
+ */
+uint64_t percentile (uint64_t *sorted, long count, double pct)
+{
+    long index = (long)(pct / 100.0 * count + 0.999999) - 1;
+
+    if (index < 0)
+        index = 0;
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+/*
+ * Get a work queue's statistics.
+ */
+void get_stats (workq_stats_t *stats)
+{
+    int status;
+
+    status = workq_stats (&workq, stats);
+    if (status != 0)
+        err_abort (status, "Get statistics");
+}
+
+/*
+ * Engine that records how long a request waited to start.
+ */
+void latency_engine (void *arg)
+{
+    request_t *request = (request_t*)arg;
+
+    request->latency = now_ns () - request->stamp;
+    spin_ns (10000);
+    done_one ();
+}
+
+/*
+ * latency: add bursts of requests to servers that have gone idle,
+ * and see how long each waits to start.
+ */
+int check_latency (void)
+{
+    enum {BURSTS = 20, BURST = 50, COUNT = BURSTS * BURST};
+    request_t requests[COUNT];
+    uint64_t times[COUNT];
+    int burst, i, status;
+
+    done_count = 0;
+    status = workq_init (&workq, 4, latency_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (burst = 0; burst < BURSTS; burst++) {
+        for (i = burst * BURST; i < (burst + 1) * BURST; i++) {
+            requests[i].stamp = now_ns ();
+            status = workq_add (&workq, &requests[i]);
+            if (status != 0)
+                err_abort (status, "Add to work queue");
+        }
+        if (done_wait ((burst + 1) * BURST, WAIT_SECONDS) != 0)
+            return fail ("burst %d didn't finish", burst);
+        sleep_ms (10);
+    }
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    for (i = 0; i < COUNT; i++)
+        times[i] = requests[i].latency;
+    qsort (times, COUNT, sizeof (uint64_t), compare);
+    report ("%d requests in bursts of %d: p50 %lu us, p99 %lu us,"
+        " max %lu us", COUNT, BURST,
+        (unsigned long)percentile (times, COUNT, 50.0) / 1000,
+        (unsigned long)percentile (times, COUNT, 99.0) / 1000,
+        (unsigned long)times[COUNT - 1] / 1000);
+    if (times[COUNT - 1] > 100000000)
+        return fail ("a request waited %lu ms to start",
+            (unsigned long)times[COUNT - 1] / 1000000);
+    return 0;
+}
+
+/*
+ * Engine that adds two requests of one less depth, for a request
+ * of depth greater than 0. (The data is a pointer into the
+ * "depths" array.)
+ */
+#define STEAL_DEPTH     14
+int depths[STEAL_DEPTH + 1];
+pthread_key_t seen_key;                 /* set once a server has run one */
+atomic_int seen;                        /* servers that have run one */
+
+void steal_engine (void *arg)
+{
+    int depth = *(int*)arg, status;
+
+    if (pthread_getspecific (seen_key) == NULL) {
+        status = pthread_setspecific (seen_key, &seen);
+        if (status != 0)
+            err_abort (status, "Set seen");
+        atomic_fetch_add (&seen, 1);
+    }
+
+    if (depth > 0) {
+        status = workq_add (&workq, &depths[depth - 1]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+        status = workq_add (&workq, &depths[depth - 1]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    spin_ns (1000);
+    done_one ();
+}
+
+/*
+ * steal: add one request, which fans out into a binary tree of
+ * requests through the servers' own deques.
+ */
+int check_steal (void)
+{
+    long total = (2L << STEAL_DEPTH) - 1;
+    uint64_t begin, end;
+    int i, status;
+
+    done_count = 0;
+    for (i = 0; i <= STEAL_DEPTH; i++)
+        depths[i] = i;
+    status = pthread_key_create (&seen_key, NULL);
+    if (status != 0)
+        err_abort (status, "Create seen key");
+    atomic_store (&seen, 0);
+    status = workq_init (&workq, 4, steal_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    begin = now_ns ();
+    status = workq_add (&workq, &depths[STEAL_DEPTH]);
+    if (status != 0)
+        err_abort (status, "Add to work queue");
+    if (done_wait (total, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %ld requests ran", done_get (), total);
+    end = now_ns ();
+    sleep_ms (10);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    pthread_key_delete (seen_key);
+    report ("%ld requests from one in %.1f ms, run by %d servers",
+        total, (end - begin) / 1e6, atomic_load (&seen));
+    if (done_get () != total)
+        return fail ("%ld requests ran, not %ld", done_get (), total);
+    if (atomic_load (&seen) < 2)
+        return fail ("no server stole from the first");
+    return 0;
+}
+
+/*
+ * Engine that waits at the gate.
+ */
+void gate_engine (void *arg)
+{
+    gate_pass ();
+    done_one ();
+}
+
+/*
+ * Producer for the ring case: add "count" requests, counting
+ * them in "ring_added".
+ */
+atomic_int ring_added;
+
+void *ring_producer (void *arg)
+{
+    int count = *(int*)arg, i, status;
+
+    for (i = 0; i < count; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+        atomic_fetch_add (&ring_added, 1);
+    }
+    return NULL;
+}
+
+/*
+ * ring: fill a bounded work queue whose server is held up at the
+ * gate, with WORKQ_FULL_EAGAIN; then overfill one with
+ * WORKQ_FULL_BLOCK.
+ */
+int check_ring (void)
+{
+    enum {CAPACITY = 64, SMALL = 16, SERVERS = 2, BLOCKED = 10000};
+    pthread_t producer;
+    workq_attr_t attr;
+    int added, count, status;
+
+    done_count = 0;
+    workq_attr_init (&attr);
+    workq_attr_setcapacity (&attr, CAPACITY);
+    workq_attr_setfull (&attr, WORKQ_FULL_EAGAIN);
+    status = workq_init_attr (&workq, &attr, 1, gate_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    gate_set (1);
+    for (added = 0; added < CAPACITY * 2; added++) {
+        status = workq_add (&workq, NULL);
+        if (status == EAGAIN)
+            break;
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    gate_set (0);
+    if (done_wait (added, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), added);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    report ("capacity %d: EAGAIN after %d requests", CAPACITY, added);
+    if (added < CAPACITY || added > CAPACITY + 1)
+        return fail ("EAGAIN after %d requests, not %d (or one more,"
+            " for the request the server holds)", added, CAPACITY);
+
+    /*
+     * Now block instead: hold up the servers, and let a producer
+     * try to add far more requests than the ring holds. It should
+     * get no further than filling the ring (plus one request for
+     * each server) until the servers are let go.
+     */
+    done_count = 0;
+    workq_attr_setfull (&attr, WORKQ_FULL_BLOCK);
+    workq_attr_setcapacity (&attr, SMALL);
+    status = workq_init_attr (&workq, &attr, SERVERS, gate_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    gate_set (1);
+    atomic_store (&ring_added, 0);
+    count = BLOCKED;
+    status = pthread_create (&producer, NULL, ring_producer, &count);
+    if (status != 0)
+        err_abort (status, "Create producer");
+    sleep_ms (100);
+    added = atomic_load (&ring_added);
+    gate_set (0);
+    status = pthread_join (producer, NULL);
+    if (status != 0)
+        err_abort (status, "Join producer");
+    if (done_wait (BLOCKED, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), BLOCKED);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    report ("capacity %d: producer held up after %d requests, then"
+        " added all %d", SMALL, added, BLOCKED);
+    if (added < SMALL || added > SMALL + SERVERS)
+        return fail ("producer held up after %d requests, not %d to %d",
+            added, SMALL, SMALL + SERVERS);
+    return 0;
+}
+
+/*
+ * magazines: warm up a work queue with "servers" servers, then
+ * run rounds of requests through it, and count the heap calls
+ * made by the rounds; fail if there are any.
+ */
+int check_magazines_with (int servers)
+{
+#ifdef __GLIBC__
+    enum {ROUNDS = 200, ROUND = 100};
+    long warmup, calls;
+    int count, round, i, status;
+
+    /*
+     * A server keeps up to MAGAZINE - 1 freed entries before it
+     * gives them back, so a round may need ROUND entries besides
+     * those. Add that many with the servers held up, so they're
+     * all allocated at once.
+     */
+    done_count = 0;
+    status = workq_init (&workq, servers, gate_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    count = ROUND + servers * MAGAZINE;
+    calls = atomic_load (&heap_calls);
+    gate_set (1);
+    for (i = 0; i < count; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    gate_set (0);
+    if (done_wait (count, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), count);
+    warmup = atomic_load (&heap_calls) - calls;
+
+    done_count = 0;
+    calls = atomic_load (&heap_calls);
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < ROUND; i++) {
+            status = workq_add (&workq, NULL);
+            if (status != 0)
+                err_abort (status, "Add to work queue");
+        }
+        if (done_wait ((long)(round + 1) * ROUND, WAIT_SECONDS) != 0)
+            return fail ("round %d didn't finish", round);
+    }
+    calls = atomic_load (&heap_calls) - calls;
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    report ("%d server%s: %ld heap calls warming up with %d requests,"
+        " %ld in %d rounds of %d after", servers, servers == 1 ? "" : "s",
+        warmup, count, calls, ROUNDS, ROUND);
+    if (calls != 0)
+        return fail ("%ld heap calls after warming up", calls);
+#else
+    report ("skipped: can't count heap calls without glibc");
+#endif
+    return 0;
+}
+
+/*
+ * Run the magazines case with one server, and then with four.
+ */
+int check_magazines (void)
+{
+    if (check_magazines_with (1) != 0)
+        return 1;
+    return check_magazines_with (4);
+}
+
+/*
+ * Engine that counts the runs of each request. (The data is a
+ * pointer into the "marks" array.)
+ */
+atomic_int *marks;
+
+void mark_engine (void *arg)
+{
+    atomic_fetch_add ((atomic_int*)arg, 1);
+    done_one ();
+}
+
+/*
+ * Check that each of the first "count" requests in "marks" has
+ * run exactly once (and reset them); return 1 if not.
+ */
+int marks_check (int count)
+{
+    int i, runs, wrong = 0;
+
+    for (i = 0; i < count; i++) {
+        runs = atomic_exchange (&marks[i], 0);
+        if (runs != 1 && wrong++ == 0)
+            fail ("request %d ran %d times", i, runs);
+    }
+    return wrong != 0;
+}
+
+/*
+ * batch: add requests one at a time, and then in batches, timing
+ * the calls that add them.
+ */
+int check_batch (void)
+{
+    enum {COUNT = 100000, BATCH = 256};
+    void *items[BATCH];
+    uint64_t begin, single, batched;
+    int i, j, count, status;
+
+    marks = (atomic_int*)calloc (COUNT, sizeof (atomic_int));
+    if (marks == NULL)
+        errno_abort ("Allocate marks");
+    done_count = 0;
+    status = workq_init (&workq, 4, mark_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    begin = now_ns ();
+    for (i = 0; i < COUNT; i++) {
+        status = workq_add (&workq, &marks[i]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    single = now_ns () - begin;
+    if (done_wait (COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), COUNT);
+    if (marks_check (COUNT) != 0)
+        return 1;
+
+    begin = now_ns ();
+    for (i = 0; i < COUNT; i += count) {
+        count = COUNT - i < BATCH ? COUNT - i : BATCH;
+        for (j = 0; j < count; j++)
+            items[j] = &marks[i + j];
+        status = workq_add_batch (&workq, items, count);
+        if (status != 0)
+            err_abort (status, "Add batch to work queue");
+    }
+    batched = now_ns () - begin;
+    if (done_wait (2 * COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d batched requests ran",
+            done_get () - COUNT, COUNT);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    report ("%d requests: %.0f ns per request to add singly,"
+        " %.0f ns in batches of %d", COUNT, (double)single / COUNT,
+        (double)batched / COUNT, BATCH);
+    status = marks_check (COUNT);
+    free (marks);
+    return status;
+}
+
+/*
+ * Batch engine that counts the runs of each request, the calls,
+ * and the most requests in one call.
+ */
+atomic_long batch_calls;
+atomic_int batch_most;
+
+void mark_batch_engine (void **items, int count)
+{
+    int i, most;
+
+    for (i = 0; i < count; i++)
+        atomic_fetch_add ((atomic_int*)items[i], 1);
+    atomic_fetch_add (&batch_calls, 1);
+    most = atomic_load (&batch_most);
+    while (count > most
+            && !atomic_compare_exchange_weak (&batch_most, &most, count))
+        ;
+    done_many (count);
+}
+
+/*
+ * engine: run batches of requests through a batch engine.
+ */
+int check_engine (void)
+{
+    enum {COUNT = 100000, BATCH = 256, MAX = 32};
+    workq_attr_t attr;
+    void *items[BATCH];
+    long calls;
+    int i, j, count, status;
+
+    marks = (atomic_int*)calloc (COUNT, sizeof (atomic_int));
+    if (marks == NULL)
+        errno_abort ("Allocate marks");
+    done_count = 0;
+    atomic_store (&batch_calls, 0);
+    atomic_store (&batch_most, 0);
+    workq_attr_init (&attr);
+    workq_attr_setbatch (&attr, mark_batch_engine, MAX);
+    status = workq_init_attr (&workq, &attr, 4, mark_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    for (i = 0; i < COUNT; i += count) {
+        count = COUNT - i < BATCH ? COUNT - i : BATCH;
+        for (j = 0; j < count; j++)
+            items[j] = &marks[i + j];
+        status = workq_add_batch (&workq, items, count);
+        if (status != 0)
+            err_abort (status, "Add batch to work queue");
+    }
+    if (done_wait (COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), COUNT);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    calls = atomic_load (&batch_calls);
+    report ("%d requests in %ld calls, %.1f requests per call,"
+        " at most %d", COUNT, calls, (double)COUNT / calls,
+        atomic_load (&batch_most));
+    status = marks_check (COUNT);
+    free (marks);
+    if (status != 0)
+        return 1;
+    if (atomic_load (&batch_most) > MAX)
+        return fail ("a call had %d requests, more than %d",
+            atomic_load (&batch_most), MAX);
+    return 0;
+}
+
+/*
+ * idle: check that servers are prestarted, and that the resident
+ * ones stay when the others time out.
+ */
+int check_idle (void)
+{
+    enum {COUNT = 100};
+    struct timespec timeout = {0, 50000000};
+    request_t requests[COUNT];
+    workq_attr_t attr;
+    workq_stats_t stats;
+    int round, i, status;
+
+    done_count = 0;
+    workq_attr_init (&attr);
+    workq_attr_setprestart (&attr, 4);
+    workq_attr_setminthreads (&attr, 2);
+    workq_attr_settimeout (&attr, &timeout);
+    workq_attr_setspin (&attr, 100);
+    status = workq_init_attr (&workq, &attr, 4, latency_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    get_stats (&stats);
+    report ("after init: %d servers, %lu created",
+        stats.threads, (unsigned long)stats.created);
+    if (stats.created != 4)
+        return fail ("%lu servers prestarted, not 4",
+            (unsigned long)stats.created);
+
+    for (round = 1; round <= 2; round++) {
+        for (i = 0; i < COUNT; i++) {
+            requests[i].stamp = now_ns ();
+            status = workq_add (&workq, &requests[i]);
+            if (status != 0)
+                err_abort (status, "Add to work queue");
+        }
+        if (done_wait (round * COUNT, WAIT_SECONDS) != 0)
+            return fail ("only %ld of %d requests ran",
+                done_get (), round * COUNT);
+        sleep_ms (300);
+        get_stats (&stats);
+        report ("burst %d: first request waited %lu us; 300ms later,"
+            " %d servers, %lu created, %lu exited", round,
+            (unsigned long)requests[0].latency / 1000, stats.threads,
+            (unsigned long)stats.created, (unsigned long)stats.exited);
+        if (stats.threads != 2)
+            return fail ("%d servers resident, not 2", stats.threads);
+    }
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    return 0;
+}
+
+/*
+ * Engine that works for 20us.
+ */
+void work_engine (void *arg)
+{
+    spin_ns (20000);
+    done_one ();
+}
+
+/*
+ * prio: add urgent requests while a backlog of bulk requests
+ * saturates the servers, and compare the waits at each priority.
+ */
+int check_prio (void)
+{
+    enum {BULK = 20000, URGENT = 200};
+    workq_hist_t bulk, urgent;
+    uint64_t bulk_p50, urgent_p99;
+    int i, status;
+
+    done_count = 0;
+    status = workq_init (&workq, 2, work_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (i = 0; i < BULK; i++) {
+        status = workq_add_prio (&workq, 0, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    for (i = 0; i < URGENT; i++) {
+        status = workq_add_prio (&workq, 3, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+        sleep_ms (1);
+    }
+    if (done_wait (BULK + URGENT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran",
+            done_get (), BULK + URGENT);
+    status = workq_delay (&workq, 0, &bulk);
+    if (status != 0)
+        err_abort (status, "Get delay");
+    status = workq_delay (&workq, 3, &urgent);
+    if (status != 0)
+        err_abort (status, "Get delay");
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    bulk_p50 = workq_hist_percentile (&bulk, 50.0);
+    urgent_p99 = workq_hist_percentile (&urgent, 99.0);
+    report ("priority 0 (%lu requests): p50 %lu us, p99 %lu us",
+        (unsigned long)bulk.count, (unsigned long)bulk_p50 / 1000,
+        (unsigned long)workq_hist_percentile (&bulk, 99.0) / 1000);
+    report ("priority 3 (%lu requests): p50 %lu us, p99 %lu us",
+        (unsigned long)urgent.count,
+        (unsigned long)workq_hist_percentile (&urgent, 50.0) / 1000,
+        (unsigned long)urgent_p99 / 1000);
+    if (urgent_p99 >= bulk_p50)
+        return fail ("priority 3 p99 isn't below priority 0 p50");
+    return 0;
+}
+
+/*
+ * A keyed request.
+ */
+#define KEYS            8
+
+typedef struct keyed_tag {
+    int         key;
+    int         seq;                    /* order added, for the key */
+    int         gated;                  /* wait at the gate */
+} keyed_t;
+
+atomic_int key_running[KEYS];           /* a request is running */
+int key_next[KEYS];                     /* next "seq" expected */
+atomic_int key_overlaps, key_disorders;
+
+/*
+ * Engine that checks that requests for a key run one at a time,
+ * in order.
+ */
+void keyed_engine (void *arg)
+{
+    keyed_t *request = (keyed_t*)arg;
+    int key = request->key;
+
+    if (atomic_exchange (&key_running[key], 1) != 0)
+        atomic_fetch_add (&key_overlaps, 1);
+    if (request->seq != key_next[key])
+        atomic_fetch_add (&key_disorders, 1);
+    key_next[key] = request->seq + 1;
+    if (request->gated)
+        gate_pass ();
+    spin_ns (2000);
+    atomic_store (&key_running[key], 0);
+    done_one ();
+}
+
+/*
+ * keyed: check the order of keyed requests, and that a key that's
+ * held up doesn't hold up the others.
+ */
+int check_keyed (void)
+{
+    enum {PER_KEY = 1000, COUNT = KEYS * PER_KEY};
+    keyed_t *requests;
+    int key, i, stalled, status;
+
+    requests = (keyed_t*)calloc (COUNT, sizeof (keyed_t));
+    if (requests == NULL)
+        errno_abort ("Allocate requests");
+    for (key = 0; key < KEYS; key++)
+        key_next[key] = 0;
+    atomic_store (&key_overlaps, 0);
+    atomic_store (&key_disorders, 0);
+    done_count = 0;
+    status = workq_init (&workq, 4, keyed_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (i = 0; i < COUNT; i++) {
+        requests[i].key = i % KEYS;
+        requests[i].seq = i / KEYS;
+        status = workq_add_keyed (&workq, requests[i].key, &requests[i]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    if (done_wait (COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), COUNT);
+    report ("%d requests for %d keys: %d overlapped, %d out of order",
+        COUNT, KEYS, atomic_load (&key_overlaps),
+        atomic_load (&key_disorders));
+    if (atomic_load (&key_overlaps) != 0
+            || atomic_load (&key_disorders) != 0)
+        return fail ("keyed requests overlapped or ran out of order");
+
+    /*
+     * Hold up key 0, and see that the other keys' requests all
+     * run; then let key 0's go.
+     */
+    done_count = 0;
+    for (key = 0; key < KEYS; key++)
+        key_next[key] = 0;
+    gate_set (1);
+    for (i = 0; i < COUNT; i++) {
+        requests[i].gated = (i == 0);
+        status = workq_add_keyed (&workq, requests[i].key, &requests[i]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    stalled = done_wait (COUNT - PER_KEY, WAIT_SECONDS);
+    report ("key 0 held up: %ld of the other %d requests ran, %d of"
+        " key 0's started", done_get (), COUNT - PER_KEY, key_next[0]);
+    gate_set (0);
+    if (stalled != 0 || done_get () != COUNT - PER_KEY)
+        return fail ("a held-up key held up other keys");
+    if (done_wait (COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), COUNT);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    free (requests);
+    if (atomic_load (&key_overlaps) != 0
+            || atomic_load (&key_disorders) != 0)
+        return fail ("keyed requests overlapped or ran out of order");
+    return 0;
+}
+
+/*
+ * Engine that waits at the gate, and then works for 20us.
+ */
+void gate_work_engine (void *arg)
+{
+    gate_pass ();
+    spin_ns (20000);
+    done_one ();
+}
+
+/*
+ * stats: take snapshots of a work queue's statistics while its
+ * servers are held up, and after they've finished.
+ */
+int check_stats (void)
+{
+    enum {COUNT = 1000};
+    workq_stats_t stats;
+    uint64_t mean;
+    int i, status;
+
+    done_count = 0;
+    status = workq_init (&workq, 2, gate_work_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    gate_set (1);
+    for (i = 0; i < COUNT; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    sleep_ms (50);
+    get_stats (&stats);
+    report ("held up: %d servers (%d idle), %lu queued",
+        stats.threads, stats.idle, (unsigned long)stats.queued[0]);
+    gate_set (0);
+    if (stats.threads != 2 || stats.idle != 0
+            || stats.queued[0] != COUNT - 2)
+        return fail ("expected 2 servers busy and %d queued", COUNT - 2);
+    if (done_wait (COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), COUNT);
+
+    /*
+     * A server records a request's service time after the engine
+     * returns, so give the last one time to do it.
+     */
+    sleep_ms (10);
+    get_stats (&stats);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    mean = stats.service.count ? stats.service.sum / stats.service.count : 0;
+    report ("finished: %lu created, wait: %lu requests, p50 %lu us,"
+        " p99 %lu us; service: %lu requests, mean %lu us, p99 %lu us",
+        (unsigned long)stats.created, (unsigned long)stats.wait.count,
+        (unsigned long)workq_hist_percentile (&stats.wait, 50.0) / 1000,
+        (unsigned long)workq_hist_percentile (&stats.wait, 99.0) / 1000,
+        (unsigned long)stats.service.count, (unsigned long)mean / 1000,
+        (unsigned long)workq_hist_percentile (&stats.service, 99.0) / 1000);
+    if (stats.wait.count != COUNT || stats.service.count != COUNT)
+        return fail ("histograms count %lu waits and %lu services, not %d",
+            (unsigned long)stats.wait.count,
+            (unsigned long)stats.service.count, COUNT);
+    if (mean < 20000)
+        return fail ("mean service time is less than the engine's work");
+    return 0;
+}
+
+/*
+ * Engine that only counts the request.
+ */
+void count_engine (void *arg)
+{
+    done_one ();
+}
+
+/*
+ * Function for workq_submit: return the argument plus one.
+ */
+void *add_one (void *arg)
+{
+    return (void*)((intptr_t)arg + 1);
+}
+
+/*
+ * Function for workq_submit: wait at the gate, then add one.
+ */
+void *gate_add_one (void *arg)
+{
+    gate_pass ();
+    return add_one (arg);
+}
+
+/*
+ * future: submit calls, and wait for, time out on and poll their
+ * results.
+ */
+int check_future (void)
+{
+    enum {CALLS = 10000, WARMUP = 100, OUTSTANDING = 1000};
+    workq_future_t *handles[OUTSTANDING];
+    struct timespec deadline;
+    uint64_t begin = 0, elapsed;
+#ifdef __GLIBC__
+    long heap = 0;
+#endif
+    void *result;
+    int i, status;
+
+    status = workq_init (&workq, 2, count_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (i = 0; i < CALLS; i++) {
+        if (i == WARMUP) {
+#ifdef __GLIBC__
+            heap = atomic_load (&heap_calls);
+#endif
+            begin = now_ns ();
+        }
+        status = workq_submit (&workq, add_one, (void*)(intptr_t)i,
+            &handles[0]);
+        if (status != 0)
+            err_abort (status, "Submit");
+        status = workq_future_wait (handles[0], &result);
+        if (status != 0)
+            err_abort (status, "Wait for future");
+        if ((intptr_t)result != i + 1)
+            return fail ("call %d returned %ld", i, (long)(intptr_t)result);
+    }
+    elapsed = now_ns () - begin;
+    report ("%d calls one at a time: %.0f ns per call",
+        CALLS, (double)elapsed / (CALLS - WARMUP));
+#ifdef __GLIBC__
+    report ("%ld heap calls after the first %d calls",
+        atomic_load (&heap_calls) - heap, WARMUP);
+#endif
+
+    for (i = 0; i < OUTSTANDING; i++) {
+        status = workq_submit (&workq, add_one, (void*)(intptr_t)i,
+            &handles[i]);
+        if (status != 0)
+            err_abort (status, "Submit");
+    }
+    for (i = 0; i < OUTSTANDING; i++) {
+        status = workq_future_wait (handles[i], &result);
+        if (status != 0)
+            err_abort (status, "Wait for future");
+        if ((intptr_t)result != i + 1)
+            return fail ("outstanding call %d returned %ld",
+                i, (long)(intptr_t)result);
+    }
+    report ("%d calls outstanding at once: all results right",
+        OUTSTANDING);
+
+    gate_set (1);
+    status = workq_submit (&workq, gate_add_one, (void*)41, &handles[0]);
+    if (status != 0)
+        err_abort (status, "Submit");
+    clock_gettime (CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += 20000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    begin = now_ns ();
+    status = workq_future_timedwait (handles[0], &deadline, &result);
+    elapsed = now_ns () - begin;
+    if (status != ETIMEDOUT) {
+        gate_set (0);
+        return fail ("timed wait for a held-up call returned %d", status);
+    }
+    status = workq_future_poll (handles[0], &result);
+    gate_set (0);
+    if (status != EBUSY)
+        return fail ("poll of a held-up call returned %d", status);
+    status = workq_future_wait (handles[0], &result);
+    if (status != 0)
+        err_abort (status, "Wait for future");
+    report ("held-up call: timed out after %.1f ms of 20, polled busy,"
+        " then returned %ld", elapsed / 1e6, (long)(intptr_t)result);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    if ((intptr_t)result != 42)
+        return fail ("held-up call returned %ld, not 42",
+            (long)(intptr_t)result);
+    if (elapsed < 20000000)
+        return fail ("timed wait returned early");
+    return 0;
+}
+
+/*
+ * Engine for delayed requests: a request_t records how long after
+ * it was added it ran, except that "ticks" only counts the runs
+ * of a periodic request.
+ */
+atomic_int ticks;
+
+void timer_engine (void *arg)
+{
+    request_t *request = (request_t*)arg;
+
+    if (arg == (void*)&ticks)
+        atomic_fetch_add (&ticks, 1);
+    else
+        request->latency = now_ns () - request->stamp;
+    done_one ();
+}
+
+/*
+ * timer: check when delayed requests run, and how often a
+ * periodic request does.
+ */
+int check_timer (void)
+{
+    enum {DELAYS = 5, PENDING = 100};
+    request_t requests[PENDING];
+    workq_stats_t stats;
+    unsigned long id;
+    uint64_t delay;
+    int i, count, status;
+
+    done_count = 0;
+    status = workq_init (&workq, 2, timer_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (i = 0; i < DELAYS; i++) {
+        requests[i].stamp = now_ns ();
+        status = workq_add_after (&workq,
+            (uint64_t)(i + 1) * 10000000, &requests[i]);
+        if (status != 0)
+            err_abort (status, "Add after delay");
+    }
+    if (done_wait (DELAYS, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d delayed requests ran",
+            done_get (), DELAYS);
+    for (i = 0; i < DELAYS; i++) {
+        delay = (uint64_t)(i + 1) * 10000000;
+        report ("delay %d ms: ran %.3f ms late", (i + 1) * 10,
+            ((double)requests[i].latency - delay) / 1e6);
+        if (requests[i].latency < delay)
+            return fail ("delayed request ran early");
+        if (requests[i].latency > delay + 20000000)
+            return fail ("delayed request ran more than 20ms late");
+    }
+
+    done_count = 0;
+    for (i = 0; i < PENDING; i++) {
+        requests[i].stamp = now_ns ();
+        status = workq_add_after (&workq, 50000000, &requests[i]);
+        if (status != 0)
+            err_abort (status, "Add after delay");
+    }
+    get_stats (&stats);
+    report ("%lu delayed requests pending, %d servers",
+        (unsigned long)stats.delayed, stats.threads);
+    if (stats.delayed != PENDING || stats.threads > 2)
+        return fail ("expected %d pending and at most 2 servers", PENDING);
+    if (done_wait (PENDING, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d delayed requests ran",
+            done_get (), PENDING);
+
+    atomic_store (&ticks, 0);
+    status = workq_add_periodic (&workq, 10000000, (void*)&ticks, &id);
+    if (status != 0)
+        err_abort (status, "Add periodic");
+    sleep_ms (105);
+    status = workq_cancel (&workq, id);
+    if (status != 0)
+        err_abort (status, "Cancel");
+    sleep_ms (20);
+    count = atomic_load (&ticks);
+    sleep_ms (50);
+    report ("period 10 ms: %d runs in 105 ms, %d after cancel",
+        count, atomic_load (&ticks) - count);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    if (count < 8 || count > 11)
+        return fail ("periodic request ran %d times, not 8 to 11", count);
+    if (atomic_load (&ticks) != count)
+        return fail ("periodic request ran after it was cancelled");
+    return 0;
+}
+
+/*
+ * scale: change a work queue's parallelism, and let another
+ * adjust its own.
+ */
+int check_scale (void)
+{
+    enum {HELD = 8, BACKLOG = 20000, TRICKLE = 150};
+    workq_attr_t attr;
+    workq_stats_t stats;
+    int most, i, status;
+
+    done_count = 0;
+    workq_attr_init (&attr);
+    workq_attr_setmaxthreads (&attr, 8);
+    status = workq_init_attr (&workq, &attr, 1, gate_work_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    gate_set (1);
+    for (i = 0; i < HELD; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    sleep_ms (50);
+    get_stats (&stats);
+    report ("parallelism 1: %d servers", stats.threads);
+    if (stats.threads != 1) {
+        gate_set (0);
+        return fail ("%d servers, not 1", stats.threads);
+    }
+    if (workq_set_parallelism (&workq, 9) != EINVAL) {
+        gate_set (0);
+        return fail ("parallelism raised past the slots");
+    }
+    status = workq_set_parallelism (&workq, 4);
+    if (status != 0)
+        err_abort (status, "Set parallelism");
+    sleep_ms (50);
+    get_stats (&stats);
+    report ("parallelism 4: %d servers", stats.threads);
+    if (stats.threads != 4) {
+        gate_set (0);
+        return fail ("%d servers, not 4", stats.threads);
+    }
+    status = workq_set_parallelism (&workq, 2);
+    if (status != 0)
+        err_abort (status, "Set parallelism");
+    gate_set (0);
+    if (done_wait (HELD, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), HELD);
+    sleep_ms (50);
+    get_stats (&stats);
+    report ("parallelism 2: %d servers", stats.threads);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    if (stats.threads > 2)
+        return fail ("%d servers, not at most 2", stats.threads);
+
+    /*
+     * The autoscaler only looks at requests as they're added and
+     * finished, so it takes a trickle of them, waiting little, to
+     * bring the parallelism back down.
+     */
+    done_count = 0;
+    workq_attr_init (&attr);
+    workq_attr_setautoscale (&attr, 1, 8, 10000000, 1000000);
+    status = workq_init_attr (&workq, &attr, 1, work_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    for (i = 0; i < BACKLOG; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    most = 1;
+    while (done_get () < BACKLOG) {
+        get_stats (&stats);
+        if (stats.parallelism > most)
+            most = stats.parallelism;
+        sleep_ms (5);
+    }
+    for (i = 0; i < TRICKLE; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+        sleep_ms (2);
+    }
+    if (done_wait (BACKLOG + TRICKLE, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran",
+            done_get (), BACKLOG + TRICKLE);
+    get_stats (&stats);
+    report ("autoscale: rose to %d under a backlog, %d after a trickle",
+        most, stats.parallelism);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    if (most < 2)
+        return fail ("parallelism never rose above 1");
+    return 0;
+}
+
+/*
+ * flush: check that workq_flush waits for every request queued
+ * before it, however it was added, and that the work queue goes
+ * on working afterwards.
+ */
+int check_flush (void)
+{
+    enum {ROUNDS = 10, ROUND = 1000, BATCH = 10};
+    void *items[BATCH] = {NULL};
+    uint64_t start, longest = 0, total = 0;
+    long done;
+    int round, added, step, count, status;
+
+    done_count = 0;
+    status = workq_init (&workq, 2, work_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    for (round = 0; round < ROUNDS; round++) {
+        for (added = step = 0; added < ROUND; added += count, step++) {
+            count = 1;
+            switch (step % 3) {
+            case 0:
+                count = ROUND - added < BATCH ? ROUND - added : BATCH;
+                status = workq_add_batch (&workq, items, count);
+                break;
+            case 1:
+                status = workq_add_prio (
+                    &workq, step % WORKQ_PRIORITIES, NULL);
+                break;
+            default:
+                status = workq_add_keyed (&workq, step % 7, NULL);
+                break;
+            }
+            if (status != 0)
+                err_abort (status, "Add to work queue");
+        }
+        start = now_ns ();
+        status = workq_flush (&workq);
+        if (status != 0)
+            err_abort (status, "Flush work queue");
+        start = now_ns () - start;
+        total += start;
+        if (start > longest)
+            longest = start;
+        done = done_get ();
+        if (done != (long)ROUND * (round + 1)) {
+            workq_destroy (&workq);
+            return fail ("round %d: %ld requests ran by the flush, not %ld",
+                round, done, (long)ROUND * (round + 1));
+        }
+    }
+    report ("%d flushes: mean %lu us, longest %lu us", ROUNDS,
+        (unsigned long)(total / ROUNDS / 1000),
+        (unsigned long)(longest / 1000));
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    return 0;
+}
+
+#ifdef __linux__
+/*
+ * Engine that counts requests run away from processor "bound_cpu".
+ */
+int bound_cpu;
+atomic_long off_cpu;
+
+void cpu_engine (void *arg)
+{
+    if (sched_getcpu () != bound_cpu)
+        atomic_fetch_add (&off_cpu, 1);
+    done_one ();
+}
+
+/*
+ * Engine that stores the processor it runs on in the int the
+ * data points to (if any), counts itself in "arrived", and then
+ * waits at the gate.
+ */
+atomic_int arrived;
+
+void hold_engine (void *arg)
+{
+    if (arg != NULL)
+        *(int*)arg = sched_getcpu ();
+    atomic_fetch_add (&arrived, 1);
+    gate_pass ();
+    done_one ();
+}
+
+/*
+ * The topology returned by fake_topology: the node of each
+ * processor, and the number of nodes.
+ */
+int fake_node[CPU_SETSIZE];
+int fake_nodes;
+
+int fake_topology (int *cpu_node)
+{
+    memcpy (cpu_node, fake_node, sizeof (fake_node));
+    return fake_nodes;
+}
+
+/*
+ * Start a work queue of "servers" servers with the given
+ * placement, and the fake topology; hold up as many requests
+ * (one per server) at the gate, storing their processors in
+ * "cpus". Returns 1 (leaving the gate open) if they didn't all
+ * arrive.
+ */
+int hold_placed (int placement, int servers, int *cpus)
+{
+    workq_attr_t attr;
+    int i, status;
+
+    done_count = 0;
+    atomic_store (&arrived, 0);
+    workq_topology_hook = fake_topology;
+    workq_attr_init (&attr);
+    status = workq_attr_setplacement (&attr, placement);
+    if (status != 0)
+        err_abort (status, "Set placement");
+    status = workq_init_attr (&workq, &attr, servers, hold_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    workq_topology_hook = NULL;
+    gate_set (1);
+    for (i = 0; i < servers; i++) {
+        status = workq_add (&workq, &cpus[i]);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    for (i = 0; i < WAIT_SECONDS * 1000; i++) {
+        if (atomic_load (&arrived) == servers)
+            return 0;
+        sleep_ms (1);
+    }
+    gate_set (0);
+    return fail ("only %d of %d requests reached the engine",
+        atomic_load (&arrived), servers);
+}
+
+/*
+ * Let held-up requests go, and wait for them and the work queue.
+ */
+int release_placed (int count)
+{
+    int status;
+
+    gate_set (0);
+    if (done_wait (count, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), count);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    return 0;
+}
+
+/*
+ * Check that 2 servers with the given placement are on the
+ * processors "first" and "second" (in either order).
+ */
+int check_placed (const char *name, int placement, int first, int second)
+{
+    int cpus[2];
+
+    if (hold_placed (placement, 2, cpus) != 0)
+        return 1;
+    if (release_placed (2) != 0)
+        return 1;
+    report ("%s: servers on processors %d and %d (expected %d and %d)",
+        name, cpus[0], cpus[1], first, second);
+    if (!(cpus[0] == first && cpus[1] == second)
+            && !(cpus[0] == second && cpus[1] == first))
+        return fail ("%s placed servers on the wrong processors", name);
+    return 0;
+}
+#endif
+
+/*
+ * placement: bind servers to processors, and check where they
+ * run requests, and that they take requests from each other's
+ * nodes.
+ */
+int check_placement (void)
+{
+    workq_attr_t attr;
+    int status;
+#ifdef __linux__
+    enum {COUNT = 1000};
+    workq_stats_t stats;
+    cpu_set_t allowed;
+    int cpus[2], order[CPU_SETSIZE];
+    int count = 0, other = -1, cpu, i;
+
+    if (sched_getaffinity (0, sizeof (allowed), &allowed) == -1)
+        errno_abort ("Get affinity");
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET (cpu, &allowed))
+            order[count++] = cpu;
+        else if (other < 0)
+            other = cpu;
+    }
+    if (count == 0)
+        return fail ("no processors allowed");
+
+    /*
+     * Use the last processor this process may run on, so that
+     * the servers are unlikely to be there by chance.
+     */
+    bound_cpu = order[count - 1];
+    done_count = 0;
+    atomic_store (&off_cpu, 0);
+    workq_attr_init (&attr);
+    if (workq_attr_setcpus (&attr, &bound_cpu, 0) != EINVAL) {
+        workq_attr_destroy (&attr);
+        return fail ("empty processor list accepted");
+    }
+    status = workq_attr_setcpus (&attr, &bound_cpu, 1);
+    if (status != 0)
+        err_abort (status, "Set processors");
+    status = workq_init_attr (&workq, &attr, 2, cpu_engine);
+    if (status != 0)
+        err_abort (status, "Init work queue");
+    workq_attr_destroy (&attr);
+    for (i = 0; i < COUNT; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    if (done_wait (COUNT, WAIT_SECONDS) != 0)
+        return fail ("only %ld of %d requests ran", done_get (), COUNT);
+    status = workq_destroy (&workq);
+    if (status != 0)
+        err_abort (status, "Destroy work queue");
+    report ("cpus: %ld of %d requests ran off processor %d",
+        atomic_load (&off_cpu), COUNT, bound_cpu);
+    if (atomic_load (&off_cpu) != 0)
+        return fail ("servers ran requests off their processor");
+
+    /*
+     * Split the allowed processors into two nodes, the first
+     * getting the odd one out: compact placement should fill the
+     * first node before using the second, and scatter placement
+     * should alternate. (With two processors, one in each node,
+     * they come out the same.)
+     */
+    if (count < 2)
+        report ("compact and scatter: skipped, only one processor allowed");
+    else {
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            fake_node[cpu] = -1;
+        for (i = 0; i < count; i++)
+            fake_node[order[i]] = (i < (count + 1) / 2) ? 0 : 1;
+        fake_nodes = 2;
+        if (check_placed ("compact", WORKQ_PLACE_COMPACT,
+                order[0], order[1]) != 0)
+            return 1;
+        if (check_placed ("scatter", WORKQ_PLACE_SCATTER,
+                order[0], order[(count + 1) / 2]) != 0)
+            return 1;
+    }
+
+    /*
+     * Fake a second node, from a processor the process can't use
+     * (binding a server to it fails, but that's only advice), so
+     * that there are node queues even on one processor. This
+     * thread is on the first node, so its requests go on that
+     * node's queue; with the first node's server held up, the
+     * second node's server can only get one from there.
+     */
+    if (other < 0) {
+        report ("nodes: skipped, every processor is allowed");
+        return 0;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        fake_node[cpu] = CPU_ISSET (cpu, &allowed) ? 0 : -1;
+    fake_node[other] = 1;
+    fake_nodes = 2;
+    if (hold_placed (WORKQ_PLACE_SCATTER, 2, cpus) != 0)
+        return 1;
+    get_stats (&stats);
+    for (i = 0; i < COUNT; i++) {
+        status = workq_add (&workq, NULL);
+        if (status != 0)
+            err_abort (status, "Add to work queue");
+    }
+    if (release_placed (COUNT + 2) != 0)
+        return 1;
+    report ("nodes: second node faked from processor %d; %lu request%s"
+        " taken from the first node's queue while its server was held up",
+        other, (unsigned long)stats.remote, stats.remote == 1 ? "" : "s");
+    if (stats.remote < 1)
+        return fail ("no request was taken from the other node");
+#else
+    int cpu = 0;
+
+    workq_attr_init (&attr);
+    status = workq_attr_setcpus (&attr, &cpu, 1);
+    if (status != ENOSYS)
+        return fail ("binding to processors returned %d, not ENOSYS",
+            status);
+    if (workq_attr_setplacement (&attr, WORKQ_PLACE_COMPACT) != ENOSYS)
+        return fail ("compact placement didn't return ENOSYS");
+    workq_attr_destroy (&attr);
+    report ("binding isn't supported here; skipped");
+#endif
+    return 0;
+}
+
+check_t checks[] = {
+    {"latency", check_latency},
+    {"steal", check_steal},
+    {"ring", check_ring},
+    {"magazines", check_magazines},
+    {"batch", check_batch},
+    {"engine", check_engine},
+    {"idle", check_idle},
+    {"prio", check_prio},
+    {"keyed", check_keyed},
+    {"stats", check_stats},
+    {"future", check_future},
+    {"timer", check_timer},
+    {"scale", check_scale},
+    {"flush", check_flush},
+    {"placement", check_placement},
+    {NULL}
+};
+
+int main (int argc, char *argv[])
+{
+    pthread_condattr_t attr;
+    int count, arg, status;
+
+    status = pthread_condattr_init (&attr);
+    if (status != 0)
+        err_abort (status, "Init cond attr");
+    status = pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort (status, "Set cond clock");
+    status = pthread_cond_init (&done_cond, &attr);
+    if (status != 0)
+        err_abort (status, "Init done cond");
+    pthread_condattr_destroy (&attr);
+
+    for (arg = 1; arg < argc; arg++) {
+        for (count = 0; checks[count].name != NULL; count++)
+            if (strcmp (argv[arg], checks[count].name) == 0)
+                break;
+        if (checks[count].name == NULL) {
+            fprintf (stderr, "Usage: %s [case ...]\ncase is", argv[0]);
+            for (count = 0; checks[count].name != NULL; count++)
+                fprintf (stderr, " %s", checks[count].name);
+            fprintf (stderr, "\n");
+            return 1;
+        }
+    }
+
+    for (count = 0; checks[count].name != NULL; count++) {
+        for (arg = 1; arg < argc; arg++)
+            if (strcmp (argv[arg], checks[count].name) == 0)
+                break;
+        if (argc > 1 && arg == argc)
+            continue;
+        current = checks[count].name;
+        if (checks[count].run () != 0)
+            return 1;
+        report ("ok");
+        fflush (stdout);
+    }
+    return 0;
+}